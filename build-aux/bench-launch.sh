@@ -0,0 +1,71 @@
+#!/usr/bin/env bash
+# Compare launch overhead and peak RSS of the full yawl binary against the yawl-launch front-end
+#
+# Usage: build-aux/bench-launch.sh [build_dir] [iterations]
+#
+# A scratch YAWL_INSTALL_DIR with a fake runtime (entry point = /bin/true) is used, so only the work
+# done by yawl itself is measured. Uses hyperfine if it's available, otherwise a plain loop.
+
+set -e
+
+BUILD_DIR="${1:-.}"
+ITERATIONS="${2:-500}"
+
+YAWL="$(realpath "$BUILD_DIR/yawl")"
+LAUNCHER="$(realpath "$BUILD_DIR/yawl-launch")"
+
+for bin in "$YAWL" "$LAUNCHER"; do
+    if [ ! -x "$bin" ]; then
+        echo "Not found: $bin (build first, or pass the build directory)" >&2
+        exit 1
+    fi
+done
+
+case "$(uname -m)" in
+aarch64) RUNTIME_NAME="SteamLinuxRuntime_sniper-arm64" ;;
+*) RUNTIME_NAME="SteamLinuxRuntime_sniper" ;;
+esac
+
+SCRATCH="$(mktemp -d)"
+trap 'rm -rf "$SCRATCH"' EXIT
+
+mkdir -p "$SCRATCH/$RUNTIME_NAME"
+ln -s /bin/true "$SCRATCH/$RUNTIME_NAME/_v2-entry-point"
+
+export YAWL_INSTALL_DIR="$SCRATCH"
+export YAWL_VERBS="exec=/bin/true"
+export YAWL_LOG_LEVEL="none"
+export YAWL_LOG_FILE="/dev/null"
+unset YAWL_TRACE
+
+# A file in place of the plans directory makes every plan lookup and write fail
+no_plans() { rm -rf "$SCRATCH/plans" && touch "$SCRATCH/plans"; }
+with_plans() { rm -rf "$SCRATCH/plans" && "$YAWL" >/dev/null; }
+
+run_bench() {
+    local name="$1"
+    shift
+
+    if command -v hyperfine &>/dev/null; then
+        hyperfine -N --warmup 20 --runs "$ITERATIONS" --command-name "$name" "$*"
+    else
+        local start end
+        start=$(date +%s%N)
+        for ((i = 0; i < ITERATIONS; i++)); do
+            "$@" >/dev/null
+        done
+        end=$(date +%s%N)
+        echo "$name: $(((end - start) / ITERATIONS / 1000)) us/launch"
+    fi
+
+    if [ -x /usr/bin/time ]; then
+        echo "$name: peak RSS $(/usr/bin/time -f %M "$@" 2>&1 >/dev/null | tail -n1) KiB"
+    fi
+}
+
+no_plans
+run_bench "yawl (full launch)" "$YAWL"
+
+with_plans
+run_bench "yawl (launch plan)" "$YAWL"
+run_bench "yawl-launch (launch plan)" "$LAUNCHER"
@@ -0,0 +1,84 @@
+#!/usr/bin/env bash
+# Compare yawl's directory removal against a plain rm -rf of the same tree
+#
+# Usage: build-aux/bench-remove.sh [build_dir] [iterations] [dirs] [files_per_dir]
+#
+# yawl has no verb that only removes a directory, so this flattens a scratch overlay prefix whose upper
+# layer holds the generated tree: the last step of 'flatten_prefix' removes the old layers, and the
+# "remove_dir" event that YAWL_TRACE records for it is the number reported here.
+
+set -e
+
+BUILD_DIR="${1:-.}"
+ITERATIONS="${2:-5}"
+DIRS="${3:-500}"
+FILES="${4:-100}"
+
+YAWL="$(realpath "$BUILD_DIR/yawl")"
+
+if [ ! -x "$YAWL" ]; then
+    echo "Not found: $YAWL (build first, or pass the build directory)" >&2
+    exit 1
+fi
+
+SCRATCH="$(mktemp -d)"
+trap 'rm -rf "$SCRATCH"' EXIT
+
+# A minimal template is enough, flatten_prefix never runs wine
+TEMPLATE="$SCRATCH/template"
+mkdir -p "$TEMPLATE"
+touch "$TEMPLATE/system.reg"
+
+export YAWL_INSTALL_DIR="$SCRATCH"
+export YAWL_VERBS="flatten_prefix"
+export YAWL_LOG_LEVEL="none"
+export YAWL_LOG_FILE="/dev/null"
+export WINEPREFIX="$SCRATCH/prefix"
+
+make_tree() {
+    local root="$1"
+    for ((d = 0; d < DIRS; d++)); do
+        mkdir -p "$root/drive_c/dir$d/sub"
+        for ((f = 0; f < FILES; f++)); do
+            : >"$root/drive_c/dir$d/file$f"
+        done
+        : >"$root/drive_c/dir$d/sub/file"
+    done
+}
+
+make_overlay() {
+    rm -rf "$WINEPREFIX" "$WINEPREFIX.overlay"
+    mkdir -p "$WINEPREFIX" "$WINEPREFIX.overlay/work"
+    echo "$TEMPLATE" >"$WINEPREFIX.overlay/base"
+    make_tree "$WINEPREFIX.overlay/upper"
+}
+
+yawl_total=0
+rm_total=0
+
+for ((i = 0; i < ITERATIONS; i++)); do
+    make_overlay
+    rm -f "$SCRATCH/trace.json"
+    YAWL_TRACE="$SCRATCH/trace.json" "$YAWL" >/dev/null
+
+    if [ -e "$WINEPREFIX.overlay" ]; then
+        echo "flatten_prefix left the overlay layers behind" >&2
+        exit 1
+    fi
+    ns=$(grep -o '"name":"remove_dir".*"dur_ns":[0-9]*' "$SCRATCH/trace.json" | tail -n1 | grep -o '[0-9]*$')
+    if [ -z "$ns" ]; then
+        echo "No remove_dir event in the trace" >&2
+        exit 1
+    fi
+    yawl_total=$((yawl_total + ns))
+
+    make_tree "$SCRATCH/baseline"
+    start=$(date +%s%N)
+    rm -rf "$SCRATCH/baseline"
+    end=$(date +%s%N)
+    rm_total=$((rm_total + end - start))
+done
+
+echo "Tree: $DIRS directories x $FILES files"
+echo "yawl remove_dir: $((yawl_total / ITERATIONS / 1000)) us"
+echo "rm -rf: $((rm_total / ITERATIONS / 1000)) us"
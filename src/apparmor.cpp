@@ -13,6 +13,7 @@
 #include "apparmor.hpp"
 #include "log.hpp"
 #include "macros.hpp"
+#include "trace.hpp"
 #include "util.hpp"
 #include "yawlconfig.hpp"
 
@@ -136,12 +137,12 @@ static RESULT install_apparmor_profile(void) {
     return result;
 }
 
-RESULT handle_apparmor(const char *entry_point) {
-    RESULT result;
+RESULT apparmor_detect(const char *entry_point) {
+    TRACE_SCOPE("apparmor_detect");
 
     LOG_DEBUG("Testing container functionality with entry point: %s", entry_point);
 
-    result = test_container(entry_point);
+    RESULT result = test_container(entry_point);
     if (SUCCEEDED(result)) {
         LOG_DEBUG("Container test passed, no AppArmor issues detected");
         return RESULT_OK;
@@ -151,8 +152,14 @@ RESULT handle_apparmor(const char *entry_point) {
     }
 
     LOG_INFO("Detected AppArmor restrictions preventing container operation");
+    return result;
+}
+
+RESULT apparmor_fix(const char *entry_point) {
+    TRACE_SCOPE("apparmor_fix");
+
     /* Try to install the AppArmor profile */
-    result = install_apparmor_profile();
+    RESULT result = install_apparmor_profile();
     if (FAILED(result)) {
         LOG_RESULT(Level::Debug, result, "Failed to install AppArmor profile");
 
@@ -13,7 +13,13 @@
 
 
 
-/* Handle AppArmor configuration if needed (usually Ubuntu/Debian distros) */
-RESULT handle_apparmor(const char *entry_point);
+/* Test whether AppArmor keeps the container from starting (usually Ubuntu/Debian distros), without changing
+ * anything. Returns RESULT_OK if the container works or fails for other reasons, E_ACCESS_DENIED if AppArmor
+ * is in the way */
+RESULT apparmor_detect(const char *entry_point);
+
+/* Install the AppArmor profile for the container and test it again, after apparmor_detect() found a problem.
+ * Returns RESULT_OK on success, error RESULT on failure */
+RESULT apparmor_fix(const char *entry_point);
 
 
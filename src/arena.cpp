@@ -0,0 +1,93 @@
+/*
+ * Bump allocator for short-lived strings
+ *
+ * Copyright (C) 2025 William Horvath
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ * See the full license text in the repository LICENSE file.
+ */
+
+#include <cstdlib>
+#include <cstring>
+
+#include "arena.hpp"
+
+#define ARENA_ALIGN 16
+#define JOIN_CACHED_LENGTHS 16 /* string lengths remembered between the sizing and copying passes */
+
+struct alignas(ARENA_ALIGN) arena_block {
+    struct arena_block *next;
+    size_t size;
+};
+
+void *arena_alloc(struct arena *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    if (size > arena->left) {
+        if (!arena->cur && !arena->blocks && size <= sizeof(arena->inline_buf)) {
+            arena->cur = arena->inline_buf;
+            arena->left = sizeof(arena->inline_buf);
+        } else {
+            size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+            struct arena_block *block = (struct arena_block *)malloc(sizeof(*block) + block_size);
+            if (!block)
+                return nullptr;
+
+            block->next = arena->blocks;
+            block->size = block_size;
+            arena->blocks = block;
+            arena->cur = (char *)(block + 1);
+            arena->left = block_size;
+        }
+    }
+
+    void *p = arena->cur;
+    arena->cur += size;
+    arena->left -= size;
+    return p;
+}
+
+void arena_restore(struct arena *arena, struct arena_mark mark) {
+    while (arena->blocks && arena->blocks != mark.blocks) {
+        struct arena_block *next = arena->blocks->next;
+        free(arena->blocks);
+        arena->blocks = next;
+    }
+
+    arena->cur = mark.cur;
+    arena->left = mark.left;
+}
+
+void arena_release(struct arena *arena) { arena_restore(arena, {nullptr, nullptr, 0}); }
+
+char *_arena_join_impl(struct arena *arena, const char *separator, size_t num_strings, const char *const strings[]) {
+    size_t lengths[JOIN_CACHED_LENGTHS];
+    size_t sep_len = strlen(separator);
+    size_t total_length = num_strings ? (num_strings - 1) * sep_len : 0;
+
+    for (size_t i = 0; i < num_strings; i++) {
+        size_t len = strlen(strings[i]);
+        if (i < JOIN_CACHED_LENGTHS)
+            lengths[i] = len;
+        total_length += len;
+    }
+
+    char *result = (char *)arena_alloc(arena, total_length + 1);
+    if (!result)
+        return nullptr;
+
+    char *dest = result;
+    for (size_t i = 0; i < num_strings; i++) {
+        if (i > 0) {
+            memcpy(dest, separator, sep_len);
+            dest += sep_len;
+        }
+
+        size_t len = i < JOIN_CACHED_LENGTHS ? lengths[i] : strlen(strings[i]);
+        memcpy(dest, strings[i], len);
+        dest += len;
+    }
+    *dest = '\0';
+
+    return result;
+}
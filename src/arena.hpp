@@ -0,0 +1,88 @@
+/*
+ * Bump allocator for short-lived strings
+ *
+ * Most paths yawl builds only live until the end of a launch phase, but join_paths() gives each one its own
+ * malloc (and a realloc for every append). An arena hands out strings from a buffer inside the arena itself
+ * first, then from big heap blocks, and frees all of them at once when it goes out of scope. ARENA_SCOPE()
+ * gives back everything allocated after it, at the end of the enclosing block (e.g. a loop body).
+ *
+ * Copyright (C) 2025 William Horvath
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ * See the full license text in the repository LICENSE file.
+ */
+
+#pragma once
+
+#include <cstddef>
+
+#include "macros.hpp"
+
+#define ARENA_INLINE_SIZE 1024        /* enough for a handful of paths without touching the heap */
+#define ARENA_BLOCK_SIZE (16 * 1024) /* heap blocks, unless a single allocation needs more */
+
+struct arena_block;
+
+/* Zero-initialize before use (`struct arena a = {};`), and release with arena_release() or `autoarena` */
+struct arena {
+    struct arena_block *blocks; /* heap blocks, newest first */
+    char *cur;
+    size_t left;
+    alignas(16) char inline_buf[ARENA_INLINE_SIZE];
+};
+
+/* Position in an arena to roll back to */
+struct arena_mark {
+    struct arena_block *blocks;
+    char *cur;
+    size_t left;
+};
+
+/* Uninitialized memory for `size` bytes, aligned for any type. nullptr if out of memory. */
+void *arena_alloc(struct arena *arena, size_t size);
+
+/* Free everything allocated after `mark` was taken */
+void arena_restore(struct arena *arena, struct arena_mark mark);
+
+/* Free everything, the arena can be used again afterwards */
+void arena_release(struct arena *arena);
+
+static forceinline struct arena_mark arena_save(const struct arena *arena) {
+    return {arena->blocks, arena->cur, arena->left};
+}
+
+char *_arena_join_impl(struct arena *arena, const char *separator, size_t num_strings, const char *const strings[]);
+
+/* Join strings with a `sep` separator into a new string in `arena`. Only takes strings, anything else
+ * doesn't compile. Returns nullptr if out of memory. */
+template <typename... Strings>
+static forceinline char *arena_join(struct arena *arena, const char *separator, Strings... strings) {
+    const char *const array[] = {strings...};
+    return _arena_join_impl(arena, separator, sizeof...(strings), array);
+}
+
+/* Join paths with a `/` separator into a new string in `arena` */
+template <typename... Strings>
+static forceinline char *arena_path(struct arena *arena, Strings... strings) {
+    return arena_join(arena, "/", strings...);
+}
+
+static forceinline void cleanup_arena(void *p) { arena_release((struct arena *)p); }
+
+struct arena_scope {
+    struct arena *arena;
+    struct arena_mark mark;
+};
+
+static forceinline void cleanup_arena_scope(void *p) {
+    struct arena_scope *scope = (struct arena_scope *)p;
+    arena_restore(scope->arena, scope->mark);
+}
+
+#define autoarena [[gnu::cleanup(cleanup_arena)]]
+
+#define _ARENA_SCOPE_NAME2(counter) _arena_scope_##counter
+#define _ARENA_SCOPE_NAME(counter) _ARENA_SCOPE_NAME2(counter)
+/* Roll `arena` back to its current position when the enclosing block ends */
+#define ARENA_SCOPE(arena)                                                                                             \
+    [[gnu::cleanup(cleanup_arena_scope)]] struct arena_scope _ARENA_SCOPE_NAME(__COUNTER__) = {arena, arena_save(arena)}
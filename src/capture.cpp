@@ -0,0 +1,534 @@
+/*
+ * Output capture for the supervised program
+ *
+ * splice() would move the data into a file without copying it, but the filtering, rate limiting and
+ * compression all need to look at the bytes, so the thread just read()s into a large buffer instead.
+ * What keeps the program from blocking is the thread itself (and a pipe as large as the system
+ * allows), not how the data is moved.
+ *
+ * Copyright (C) 2025 William Horvath
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ * See the full license text in the repository LICENSE file.
+ */
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <zstd.h>
+
+#include "capture.hpp"
+#include "log.hpp"
+#include "macros.hpp"
+#include "util.hpp"
+#include "yawlconfig.hpp"
+
+#include "fmt/printf.h"
+
+#define CAPTURE_SEGMENT_SIZE (64ULL * 1024 * 1024) /* uncompressed bytes per file */
+#define CAPTURE_KEEP_SEGMENTS 8                    /* per session, older segments are deleted */
+#define CAPTURE_MAX_AGE_DAYS 7                     /* files of older sessions are deleted on startup */
+#define CAPTURE_PIPE_SIZE (1024 * 1024)
+#define CAPTURE_READ_SIZE (64 * 1024)
+#define CAPTURE_LINE_MAX 4096
+#define CAPTURE_CHANNELS 512 /* must be a power of two */
+#define CAPTURE_CHANNEL_NAME_MAX 48
+#define CAPTURE_ZSTD_LEVEL 3
+#define CAPTURE_FLUSH_MS 1000 /* flush the compressed stream after this long without output */
+
+struct capture_channel {
+    bool used;
+    char name[CAPTURE_CHANNEL_NAME_MAX];
+    time_t window; /* second the count applies to */
+    unsigned count;
+    unsigned long long dropped;
+};
+
+struct capture_stream {
+    const char *name; /* channel for output that doesn't come from a wine debug channel */
+    int fd;
+    size_t len;
+    char line[CAPTURE_LINE_MAX];
+};
+
+struct capture_state {
+    bool running;
+    pthread_t thread;
+    int wake_fds[2];
+
+    struct capture_stream streams[2];
+
+    char *drop_copy;
+    const char *drop[64];
+    size_t drop_count;
+    unsigned rate;
+    bool rate_all; /* the rate was set explicitly, so it also limits plain stdout/stderr lines */
+
+    char *tail;
+    size_t tail_size;
+    size_t tail_pos;
+    bool tail_wrapped;
+
+    char *dir;
+    char session[64];
+    int segment_fd;
+    unsigned segment;
+    uint64_t segment_bytes;
+    ZSTD_CCtx *cctx;
+    bool dirty;
+
+    struct capture_channel channels[CAPTURE_CHANNELS];
+    unsigned long long lines_dropped;
+};
+
+static struct capture_state capture = {};
+static char zstd_out[CAPTURE_READ_SIZE];
+
+static void segment_path(char *path, size_t size, unsigned segment) {
+    snprintf(path, size, "%s/%s.%u.log.zst", capture.dir, capture.session, segment);
+}
+
+static void compress(const char *data, size_t len, ZSTD_EndDirective mode) {
+    ZSTD_inBuffer input = {data, len, 0};
+
+    for (;;) {
+        ZSTD_outBuffer output = {zstd_out, sizeof(zstd_out), 0};
+        size_t remaining = ZSTD_compressStream2(capture.cctx, &output, &input, mode);
+        if (ZSTD_isError(remaining)) {
+            LOG_DEBUG("Capture: compression failed: %s", ZSTD_getErrorName(remaining));
+            return;
+        }
+        write_all(capture.segment_fd, zstd_out, output.pos);
+        if (mode == ZSTD_e_continue ? input.pos == input.size : remaining == 0)
+            return;
+    }
+}
+
+static void close_segment(void) {
+    if (capture.segment_fd < 0)
+        return;
+    compress(nullptr, 0, ZSTD_e_end);
+    close(capture.segment_fd);
+    capture.segment_fd = -1;
+    capture.dirty = false;
+}
+
+static bool open_segment(void) {
+    char path[PATH_MAX];
+
+    capture.segment++;
+    segment_path(path, sizeof(path), capture.segment);
+    capture.segment_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (capture.segment_fd < 0) {
+        LOG_DEBUG("Capture: failed to create %s: %s", path, strerror(errno));
+        return false;
+    }
+    capture.segment_bytes = 0;
+
+    if (capture.segment > CAPTURE_KEEP_SEGMENTS) {
+        segment_path(path, sizeof(path), capture.segment - CAPTURE_KEEP_SEGMENTS);
+        unlink(path);
+    }
+
+    return true;
+}
+
+static void tail_append(const char *data, size_t len) {
+    if (!capture.tail)
+        return;
+
+    if (len > capture.tail_size) {
+        data += len - capture.tail_size;
+        len = capture.tail_size;
+    }
+
+    size_t first = capture.tail_size - capture.tail_pos;
+    if (first > len)
+        first = len;
+    memcpy(capture.tail + capture.tail_pos, data, first);
+    memcpy(capture.tail, data + first, len - first);
+
+    capture.tail_pos += len;
+    if (capture.tail_pos >= capture.tail_size) {
+        capture.tail_pos -= capture.tail_size;
+        capture.tail_wrapped = true;
+    }
+}
+
+static void emit(const char *data, size_t len) {
+    tail_append(data, len);
+
+    if (capture.segment_fd >= 0 && capture.segment_bytes >= CAPTURE_SEGMENT_SIZE)
+        close_segment();
+    if (capture.segment_fd < 0 && !open_segment())
+        return;
+
+    compress(data, len, ZSTD_e_continue);
+    capture.segment_bytes += len;
+    capture.dirty = true;
+}
+
+static void emit_dropped(struct capture_channel *channel) {
+    if (!channel->dropped)
+        return;
+
+    char note[128];
+    int len = snprintf(note, sizeof(note), "[" PROG_NAME "] dropped %llu lines from %s\n", channel->dropped,
+                       channel->name);
+    emit(note, (size_t)len < sizeof(note) ? (size_t)len : sizeof(note) - 1);
+    channel->dropped = 0;
+}
+
+/* Find the wine debug class and channel of a line like "0024:fixme:d3d:wined3d_foo message"
+ * (possibly with a timestamp, pid and tid in front) and write them to `name` as "class:channel".
+ * Returns false for anything else. */
+static bool parse_channel(const char *line, size_t len, char name[CAPTURE_CHANNEL_NAME_MAX]) {
+    static constexpr const char *const classes[] = {"err", "warn", "fixme", "trace"};
+    size_t limit = len < 64 ? len : 64;
+    size_t start = 0;
+
+    for (size_t i = 0; i < limit && line[i] != ' '; i++) {
+        if (line[i] != ':')
+            continue;
+
+        for (const char *cls : classes) {
+            size_t cls_len = strlen(cls);
+            if (i - start != cls_len || memcmp(line + start, cls, cls_len) != 0)
+                continue;
+
+            const char *channel = line + i + 1;
+            const char *end = (const char *)memchr(channel, ':', len - i - 1);
+            if (!end || end == channel || end - channel > 32)
+                return false;
+
+            snprintf(name, CAPTURE_CHANNEL_NAME_MAX, "%s:%.*s", cls, (int)(end - channel), channel);
+            return true;
+        }
+        start = i + 1;
+    }
+
+    return false;
+}
+
+/* "class:channel" specs, where either part can be '*'. A spec without ':' only looks at the class,
+ * which is all there is for plain "stdout"/"stderr" output. */
+static bool spec_matches(const char *spec, const char *name) {
+    const char *spec_colon = strchr(spec, ':');
+    const char *name_colon = strchr(name, ':');
+    size_t spec_class_len = spec_colon ? (size_t)(spec_colon - spec) : strlen(spec);
+    size_t name_class_len = name_colon ? (size_t)(name_colon - name) : strlen(name);
+
+    if (!(spec_class_len == 1 && spec[0] == '*') &&
+        (spec_class_len != name_class_len || strncmp(spec, name, name_class_len) != 0))
+        return false;
+
+    if (!spec_colon || STRING_EQUALS(spec_colon + 1, "*"))
+        return true;
+
+    return name_colon && STRING_EQUALS(spec_colon + 1, name_colon + 1);
+}
+
+static struct capture_channel *find_channel(const char *name) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const char *p = name; *p; p++) {
+        hash ^= (unsigned char)*p;
+        hash *= 0x100000001b3ULL;
+    }
+
+    for (size_t i = 0; i < CAPTURE_CHANNELS; i++) {
+        struct capture_channel *channel = &capture.channels[(hash + i) & (CAPTURE_CHANNELS - 1)];
+        if (!channel->used) {
+            channel->used = true;
+            snprintf(channel->name, sizeof(channel->name), "%s", name);
+            return channel;
+        }
+        if (STRING_EQUALS(channel->name, name))
+            return channel;
+    }
+
+    return nullptr; /* table is full, don't limit this one */
+}
+
+static void process_line(struct capture_stream *stream, const char *line, size_t len) {
+    char name[CAPTURE_CHANNEL_NAME_MAX];
+    bool debug_channel = parse_channel(line, len, name);
+    if (!debug_channel)
+        snprintf(name, sizeof(name), "%s", stream->name);
+
+    for (size_t i = 0; i < capture.drop_count; i++) {
+        if (spec_matches(capture.drop[i], name))
+            return;
+    }
+
+    /* By default, only wine's debug channels are limited, never the program's own output */
+    struct capture_channel *channel =
+        capture.rate != (unsigned)-1 && (debug_channel || capture.rate_all) ? find_channel(name) : nullptr;
+    if (channel) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+        if (now.tv_sec != channel->window) {
+            emit_dropped(channel);
+            channel->window = now.tv_sec;
+            channel->count = 0;
+        }
+        if (++channel->count > capture.rate) {
+            channel->dropped++;
+            capture.lines_dropped++;
+            return;
+        }
+    }
+
+    emit(line, len);
+}
+
+static void process_data(struct capture_stream *stream, const char *data, size_t len) {
+    while (len > 0) {
+        const char *newline = (const char *)memchr(data, '\n', len);
+        size_t piece = newline ? (size_t)(newline - data) + 1 : len;
+
+        /* Overlong lines are cut into CAPTURE_LINE_MAX pieces */
+        size_t room = sizeof(stream->line) - stream->len;
+        if (piece > room)
+            piece = room;
+
+        memcpy(stream->line + stream->len, data, piece);
+        stream->len += piece;
+        data += piece;
+        len -= piece;
+
+        if (stream->line[stream->len - 1] == '\n' || stream->len == sizeof(stream->line)) {
+            process_line(stream, stream->line, stream->len);
+            stream->len = 0;
+        }
+    }
+}
+
+/* Returns false once the stream is at EOF (or would block, with `nonblocking`) */
+static bool read_stream(struct capture_stream *stream, bool nonblocking) {
+    static char buf[CAPTURE_READ_SIZE];
+
+    for (;;) {
+        ssize_t n = read(stream->fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return n < 0 && errno == EAGAIN && !nonblocking;
+
+        process_data(stream, buf, (size_t)n);
+        if (!nonblocking)
+            return true;
+    }
+}
+
+static void *capture_thread(void *) {
+    struct pollfd fds[3] = {
+        {capture.streams[0].fd, POLLIN, 0},
+        {capture.streams[1].fd, POLLIN, 0},
+        {capture.wake_fds[0], POLLIN, 0},
+    };
+
+    while (fds[0].fd >= 0 || fds[1].fd >= 0) {
+        int ret = poll(fds, 3, capture.dirty ? CAPTURE_FLUSH_MS : -1);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            break;
+
+        if (ret == 0) {
+            /* Quiet for a while, make what we have readable in the file */
+            compress(nullptr, 0, ZSTD_e_flush);
+            capture.dirty = false;
+            continue;
+        }
+
+        for (int i = 0; i < 2; i++) {
+            if (fds[i].fd >= 0 && (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) &&
+                !read_stream(&capture.streams[i], false))
+                fds[i].fd = -1;
+        }
+
+        if (fds[2].revents & POLLIN) {
+            /* The program is gone, but something it left behind may still hold the pipes open */
+            for (int i = 0; i < 2; i++) {
+                if (fds[i].fd < 0)
+                    continue;
+                fcntl(fds[i].fd, F_SETFL, fcntl(fds[i].fd, F_GETFL) | O_NONBLOCK);
+                read_stream(&capture.streams[i], true);
+            }
+            break;
+        }
+    }
+
+    for (auto &stream : capture.streams) {
+        if (stream.len) {
+            process_line(&stream, stream.line, stream.len);
+            stream.len = 0;
+        }
+    }
+    for (auto &channel : capture.channels)
+        emit_dropped(&channel);
+
+    close_segment();
+    return nullptr;
+}
+
+/* Delete the files of sessions that are older than CAPTURE_MAX_AGE_DAYS */
+static void prune_old_sessions(void) {
+    autoclosedir DIR *dir = opendir(capture.dir);
+    if (!dir)
+        return;
+
+    time_t cutoff = time(nullptr) - CAPTURE_MAX_AGE_DAYS * 24 * 60 * 60;
+    struct dirent *entry;
+    struct stat st;
+    while ((entry = readdir(dir))) {
+        if (entry->d_name[0] == '.')
+            continue;
+        if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode) &&
+            st.st_mtime < cutoff)
+            unlinkat(dirfd(dir), entry->d_name, 0);
+    }
+}
+
+static void capture_free(void) {
+    for (int fd : {capture.streams[0].fd, capture.streams[1].fd, capture.wake_fds[0], capture.wake_fds[1]}) {
+        if (fd >= 0)
+            close(fd);
+    }
+    if (capture.cctx)
+        ZSTD_freeCCtx(capture.cctx);
+    free(capture.tail);
+    free(capture.drop_copy);
+    free(capture.dir);
+    capture = {};
+}
+
+RESULT capture_start(const struct capture_config *config, int child_fds[2]) {
+    RESULT result = RESULT_OK;
+    int out_pipe[2] = {-1, -1}, err_pipe[2] = {-1, -1};
+
+    if (!config || !child_fds)
+        return MAKE_RESULT(SEV_ERROR, CAT_GENERAL, E_INVALID_ARG);
+
+    capture = {};
+    capture.segment_fd = -1;
+    capture.streams[0].fd = capture.streams[1].fd = -1;
+    capture.wake_fds[0] = capture.wake_fds[1] = -1;
+
+    join_paths(capture.dir, config::yawl_dir, CAPTURE_DIR);
+    result = ensure_dir(capture.dir);
+    if (FAILED(result))
+        goto fail;
+    prune_old_sessions();
+
+    if (pipe2(out_pipe, O_CLOEXEC) < 0 || pipe2(err_pipe, O_CLOEXEC) < 0 || pipe2(capture.wake_fds, O_CLOEXEC) < 0) {
+        result = result_from_errno();
+        goto fail;
+    }
+
+    /* A bigger pipe absorbs bursts while we're busy compressing (capped by /proc/sys/fs/pipe-max-size) */
+    fcntl(out_pipe[0], F_SETPIPE_SZ, CAPTURE_PIPE_SIZE);
+    fcntl(err_pipe[0], F_SETPIPE_SZ, CAPTURE_PIPE_SIZE);
+
+    capture.streams[0] = {.name = "stdout", .fd = out_pipe[0], .len = 0, .line = {}};
+    capture.streams[1] = {.name = "stderr", .fd = err_pipe[0], .len = 0, .line = {}};
+    out_pipe[0] = err_pipe[0] = -1;
+
+    capture.rate = config->rate ? config->rate : CAPTURE_DEFAULT_RATE;
+    capture.rate_all = config->rate != 0;
+    if (config->drop) {
+        capture.drop_copy = strdup(config->drop);
+        char *saveptr;
+        for (char *spec = strtok_r(capture.drop_copy, ",", &saveptr);
+             spec && capture.drop_count < sizeof(capture.drop) / sizeof(capture.drop[0]);
+             spec = strtok_r(nullptr, ",", &saveptr))
+            capture.drop[capture.drop_count++] = spec;
+    }
+
+    capture.tail_size = (size_t)(config->tail_mb ? config->tail_mb : CAPTURE_DEFAULT_TAIL_MB) * 1024 * 1024;
+    capture.tail = (char *)malloc(capture.tail_size);
+
+    capture.cctx = ZSTD_createCCtx();
+    if (!capture.cctx) {
+        result = MAKE_RESULT(SEV_ERROR, CAT_SYSTEM, E_OUT_OF_MEMORY);
+        goto fail;
+    }
+    ZSTD_CCtx_setParameter(capture.cctx, ZSTD_c_compressionLevel, CAPTURE_ZSTD_LEVEL);
+
+    {
+        time_t now = time(nullptr);
+        struct tm tm_info;
+        localtime_r(&now, &tm_info);
+        size_t len = strftime(capture.session, sizeof(capture.session), "%Y%m%d-%H%M%S", &tm_info);
+        snprintf(capture.session + len, sizeof(capture.session) - len, "-%d", getpid());
+    }
+
+    {
+        /* The thread must never take the signals the supervisor waits for */
+        sigset_t all, old;
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, &old);
+        int ret = pthread_create(&capture.thread, nullptr, capture_thread, nullptr);
+        pthread_sigmask(SIG_SETMASK, &old, nullptr);
+        if (ret != 0) {
+            errno = ret;
+            result = result_from_errno();
+            goto fail;
+        }
+    }
+
+    capture.running = true;
+    child_fds[0] = out_pipe[1];
+    child_fds[1] = err_pipe[1];
+
+    LOG_INFO("Capturing program output to %s/%s.*.log.zst", capture.dir, capture.session);
+    return RESULT_OK;
+
+fail:
+    for (int fd : {out_pipe[0], out_pipe[1], err_pipe[0], err_pipe[1]}) {
+        if (fd >= 0)
+            close(fd);
+    }
+    LOG_RESULT(Level::Warning, result, "Failed to set up output capture");
+    capture_free();
+    return result;
+}
+
+void capture_stop(bool abnormal) {
+    if (!capture.running)
+        return;
+
+    char byte = 0;
+    write_all(capture.wake_fds[1], &byte, 1);
+    pthread_join(capture.thread, nullptr);
+
+    if (capture.lines_dropped)
+        LOG_INFO("Capture: dropped %llu lines over the rate limit", capture.lines_dropped);
+
+    if (abnormal && capture.tail && (capture.tail_pos || capture.tail_wrapped)) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s.tail.log", capture.dir, capture.session);
+
+        autoclosefd int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd >= 0) {
+            if (capture.tail_wrapped) {
+                /* Start at the first full line */
+                const char *start = capture.tail + capture.tail_pos;
+                size_t len = capture.tail_size - capture.tail_pos;
+                const char *newline = (const char *)memchr(start, '\n', len);
+                if (newline)
+                    write_all(fd, newline + 1, len - (size_t)(newline + 1 - start));
+            }
+            write_all(fd, capture.tail, capture.tail_pos);
+            LOG_WARNING("Capture: last output of the program saved to %s", path);
+        }
+    }
+
+    capture_free();
+}
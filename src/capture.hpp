@@ -0,0 +1,37 @@
+/*
+ * Output capture for the supervised program
+ *
+ * With 'capture_output', the supervisor hands the program pipes instead of our own stdout/stderr and
+ * drains them on a dedicated thread, so a chatty WINEDEBUG can't stall the game on a slow terminal.
+ * Lines are rate limited and filtered per wine debug channel, then streamed into zstd-compressed,
+ * rotating per-session files under yawl_dir/logs. The last few MiB are also kept in memory and dumped
+ * uncompressed if the program dies abnormally.
+ *
+ * Copyright (C) 2025 William Horvath
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ * See the full license text in the repository LICENSE file.
+ */
+
+#pragma once
+
+#include "result.hpp"
+
+#define CAPTURE_DIR "logs"
+#define CAPTURE_DEFAULT_RATE 1000 /* lines per second per channel */
+#define CAPTURE_DEFAULT_TAIL_MB 4
+
+struct capture_config {
+    const char *drop; /* Comma-separated channels to drop ("class:channel", either part can be '*'), or nullptr */
+    unsigned rate;    /* Lines per second per channel before dropping (0 = default, -1u = unlimited) */
+    unsigned tail_mb; /* MiB of recent output kept in memory for crash dumps (0 = default) */
+};
+
+/* Start the capture thread. `child_fds` receives the write ends of the stdout and stderr pipes,
+ * which the child should dup2() onto fds 1 and 2 (the caller closes them after forking).
+ * Returns RESULT_OK on success, error RESULT on failure */
+RESULT capture_start(const struct capture_config *config, int child_fds[2]);
+
+/* Drain whatever is left once the program is gone, finish the current file and stop the thread.
+ * If `abnormal`, the in-memory tail is written out and its path is printed. */
+void capture_stop(bool abnormal);
@@ -0,0 +1,540 @@
+/*
+ * Persistent container daemon
+ *
+ * The daemon starts the runtime entry point with a keepalive command (`sleep infinity`)
+ * and then accepts launch requests on a unix socket. Every request is handled in its own
+ * session process, which forks a worker that joins the keepalive's namespaces with
+ * do_nsenter() and execs the requested command there. The client's stdio and working
+ * directory are passed as file descriptors (SCM_RIGHTS), and the wait status is sent back.
+ *
+ * Protocol (client -> daemon):
+ *   struct daemon_request + fds {stdin, stdout, stderr, cwd}
+ *   data_size bytes of NUL-terminated strings: argc arguments, then envc "NAME=VALUE" entries
+ *   afterwards: uint32_t signal numbers to forward, until the connection is closed
+ * (daemon -> client):
+ *   int32_t wait status
+ *
+ * Copyright (C) 2025 William Horvath
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ * See the full license text in the repository LICENSE file.
+ */
+
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <poll.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "daemon.hpp"
+#include "log.hpp"
+#include "macros.hpp"
+#include "nsenter.hpp"
+#include "util.hpp"
+#include "yawlconfig.hpp"
+
+#define DAEMON_MAGIC 0x59574c44 /* "YWLD" */
+#define DAEMON_MAX_DATA (4U * 1024 * 1024)
+#define DAEMON_NUM_FDS 4
+#define DAEMON_CONTAINER_TIMEOUT 120 /* seconds to wait for the container to come up */
+#define DAEMON_POLL_INTERVAL_MS 250
+
+struct daemon_request {
+    uint32_t magic;
+    uint32_t argc;
+    uint32_t envc;
+    uint32_t data_size;
+};
+
+/* Variables that pressure-vessel sets up for the container. The container's values
+ * are kept for these, everything else is taken from the client. */
+static constexpr const char *const container_managed_vars[] = {
+    "LD_LIBRARY_PATH=",
+    "LD_PRELOAD=",
+    "PATH=",
+    "LIBGL_DRIVERS_PATH=",
+    "LIBVA_DRIVERS_PATH=",
+    "VDPAU_DRIVER_PATH=",
+    "GBM_BACKENDS_PATH=",
+    "XDG_DATA_DIRS=",
+    "XDG_CONFIG_DIRS=",
+    "VK_ICD_FILENAMES=",
+    "VK_DRIVER_FILES=",
+    "VK_ADD_LAYER_PATH=",
+    "VK_LAYER_PATH=",
+    "__EGL_VENDOR_LIBRARY_FILENAMES=",
+    "__EGL_EXTERNAL_PLATFORM_CONFIG_DIRS=",
+    "PRESSURE_VESSEL_",
+    "STEAM_RUNTIME",
+    "YAWL_VERBS=",
+};
+
+static int read_all(int fd, void *buf, size_t count) {
+    char *p = (char *)buf;
+    while (count > 0) {
+        ssize_t got = read(fd, p, count);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return -1;
+        p += got;
+        count -= got;
+    }
+    return 0;
+}
+
+static int connect_socket(const char *socket_path) {
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+
+    return fd;
+}
+
+char *daemon_socket_path(const char *name) {
+    char *socket_path = nullptr;
+    char *run_dir = nullptr;
+
+    /* One daemon per config and prefix */
+    const char *prefix = getenv("WINEPREFIX");
+    if (!prefix)
+        prefix = getenv("STEAM_COMPAT_DATA_PATH");
+
+    uint32_t hash = 0x811c9dc5;
+    for (const char *c = prefix ? prefix : ""; *c; c++)
+        hash = (hash ^ (unsigned char)*c) * 0x01000193;
+
+    join_paths(run_dir, config::yawl_dir, DAEMON_RUN_DIR);
+    char file_name[NAME_MAX];
+    snprintf(file_name, sizeof(file_name), "%s-%08x.sock", name, hash);
+    for (char *c = file_name; *c; c++) {
+        if (*c == '/')
+            *c = '_';
+    }
+    join_paths(socket_path, run_dir, file_name);
+    free(run_dir);
+
+    if (strlen(socket_path) >= sizeof(((struct sockaddr_un *)nullptr)->sun_path)) {
+        LOG_DEBUG("Daemon socket path is too long: %s", socket_path);
+        free(socket_path);
+        return nullptr;
+    }
+
+    return socket_path;
+}
+
+/* Worker: set up stdio, cwd and environment, then join the container and exec the command */
+static void __attribute__((__noreturn__)) run_worker(pid_t container_pid, const int fds[DAEMON_NUM_FDS],
+                                                     char **argv, char **envp) {
+    for (int i = 0; i < 3; i++) {
+        if (dup2(fds[i], i) < 0)
+            _exit(127);
+    }
+    if (fchdir(fds[3]) != 0)
+        _exit(127);
+    for (int i = 0; i < DAEMON_NUM_FDS; i++)
+        close(fds[i]);
+
+    /* Start from the container's environment, then apply the client's */
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/environ", container_pid);
+    autoclose FILE *fp = fopen(path, "re");
+    if (!fp)
+        _exit(127);
+
+    clearenv();
+    char *entry = nullptr;
+    size_t entry_size = 0;
+    while (getdelim(&entry, &entry_size, '\0', fp) > 0) {
+        if (strchr(entry, '='))
+            putenv(strdup(entry));
+    }
+
+    for (char **env = envp; *env; env++) {
+        bool managed = false;
+        for (const char *var : container_managed_vars)
+            managed |= (strncmp(*env, var, strlen(var)) == 0);
+        if (!managed)
+            putenv(*env);
+    }
+
+    /* Enter the container in the working directory we just changed into */
+    int argc = 0;
+    while (argv[argc])
+        argc++;
+
+    char **nsenter_argv = (char **)calloc(argc + 4, sizeof(char *));
+    nsenter_argv[0] = (char *)"nsenter";
+    nsenter_argv[1] = (char *)"--wd=.";
+    nsenter_argv[2] = (char *)"--";
+    for (int i = 0; i < argc; i++)
+        nsenter_argv[i + 3] = argv[i];
+
+    do_nsenter(argc + 3, nsenter_argv, container_pid, -1);
+    _exit(127);
+}
+
+/* Session: receive one request, run it and report the wait status */
+static int handle_session(int conn_fd, pid_t container_pid) {
+    struct daemon_request req;
+    int fds[DAEMON_NUM_FDS];
+    char control[CMSG_SPACE(sizeof(fds))] = {};
+    struct iovec iov = {.iov_base = &req, .iov_len = sizeof(req)};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(conn_fd, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL) != sizeof(req))
+        return 1;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+        return 1;
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    if (req.magic != DAEMON_MAGIC || req.argc == 0 || req.data_size == 0 || req.data_size > DAEMON_MAX_DATA)
+        return 1;
+
+    autofree char *data = (char *)malloc(req.data_size + 1);
+    autofree char **strings = (char **)calloc(req.argc + req.envc + 2, sizeof(char *));
+    if (!data || !strings || read_all(conn_fd, data, req.data_size) != 0)
+        return 1;
+    data[req.data_size] = '\0';
+
+    /* argv and envp share one array, separated by a nullptr */
+    char *p = data;
+    for (uint32_t i = 0; i < req.argc + req.envc; i++) {
+        if (p >= data + req.data_size)
+            return 1;
+        strings[i < req.argc ? i : i + 1] = p;
+        p += strlen(p) + 1;
+    }
+    char **argv = strings;
+    char **envp = strings + req.argc + 1;
+
+    pid_t worker = fork();
+    if (worker < 0)
+        return 1;
+    if (worker == 0) {
+        close(conn_fd);
+        run_worker(container_pid, fds, argv, envp);
+    }
+
+    for (int i = 0; i < DAEMON_NUM_FDS; i++)
+        close(fds[i]);
+
+    LOG_DEBUG("Daemon: running %s (pid %d)", argv[0], worker);
+
+    int status = 0;
+    bool client_gone = false;
+    for (;;) {
+        pid_t ret = waitpid(worker, &status, WNOHANG);
+        if (ret == worker || (ret < 0 && errno != EINTR))
+            break;
+
+        struct pollfd pfd = {.fd = conn_fd, .events = POLLIN, .revents = 0};
+        if (client_gone || poll(&pfd, 1, DAEMON_POLL_INTERVAL_MS) <= 0) {
+            if (client_gone)
+                poll(nullptr, 0, DAEMON_POLL_INTERVAL_MS);
+            continue;
+        }
+
+        uint32_t sig;
+        if (read_all(conn_fd, &sig, sizeof(sig)) == 0) {
+            if (sig > 0 && sig < NSIG)
+                kill(worker, (int)sig);
+        } else {
+            /* Same as a terminal going away */
+            kill(worker, SIGHUP);
+            client_gone = true;
+        }
+    }
+
+    int32_t wire_status = status;
+    if (!client_gone)
+        write_all(conn_fd, &wire_status, sizeof(wire_status));
+
+    return 0;
+}
+
+static void stop_container(pid_t entry_pid, pid_t container_pid) {
+    if (container_pid > 0)
+        kill(container_pid, SIGTERM);
+
+    /* Give pressure-vessel a bit of time to tear the container down */
+    for (int i = 0; i < 10000 / DAEMON_POLL_INTERVAL_MS; i++) {
+        if (waitpid(entry_pid, nullptr, WNOHANG) != 0)
+            return;
+        poll(nullptr, 0, DAEMON_POLL_INTERVAL_MS);
+    }
+
+    kill(entry_pid, SIGKILL);
+    waitpid(entry_pid, nullptr, 0);
+}
+
+static int daemon_main(const char *socket_path, const char *entry_point, unsigned idle_timeout, int ready_fd) {
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+
+    autoclosefd int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0)
+        return 1;
+
+    /* Anyone who can connect can run commands in the container, so the socket is ours alone from the start */
+    unlink(socket_path);
+    mode_t old_umask = umask(0177);
+    int bound = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_umask);
+    if (bound != 0 || listen(listen_fd, 16) != 0) {
+        LOG_ERROR("Daemon: failed to listen on %s: %s", socket_path, strerror(errno));
+        return 1;
+    }
+
+    const char *keepalive_argv[] = {entry_point, "--verb=waitforexitandrun", "--", "sleep", "infinity", nullptr};
+    pid_t entry_pid = fork();
+    if (entry_pid < 0) {
+        unlink(socket_path);
+        return 1;
+    }
+    if (entry_pid == 0) {
+        execv(keepalive_argv[0], (char *const *)keepalive_argv);
+        _exit(127);
+    }
+
+    /* Wait for the keepalive command to show up inside the container */
+    pid_t container_pid = 0;
+    for (int i = 0; i < DAEMON_CONTAINER_TIMEOUT * 1000 / DAEMON_POLL_INTERVAL_MS && !container_pid; i++) {
+        if (waitpid(entry_pid, nullptr, WNOHANG) != 0)
+            break;
+        container_pid = find_container_descendant(entry_pid, "sleep");
+        if (!container_pid)
+            poll(nullptr, 0, DAEMON_POLL_INTERVAL_MS);
+    }
+
+    if (!container_pid) {
+        LOG_ERROR("Daemon: the container didn't start");
+        unlink(socket_path);
+        stop_container(entry_pid, 0);
+        return 1;
+    }
+
+    LOG_INFO("Daemon: container ready (pid %d), listening on %s", container_pid, socket_path);
+    if (write_all(ready_fd, "1", 1) != 0) {
+    } /* the parent may be gone already, that's fine */
+    close(ready_fd);
+
+    unsigned active_sessions = 0;
+    time_t last_activity = time(nullptr);
+    bool container_alive = true;
+
+    while (container_alive) {
+        pid_t pid;
+        while ((pid = waitpid(-1, nullptr, WNOHANG)) > 0) {
+            if (pid == entry_pid)
+                container_alive = false;
+            else if (active_sessions > 0 && --active_sessions == 0)
+                last_activity = time(nullptr);
+        }
+        if (!container_alive) {
+            LOG_WARNING("Daemon: the container exited unexpectedly");
+            break;
+        }
+
+        if (active_sessions == 0 && time(nullptr) - last_activity >= (time_t)idle_timeout) {
+            LOG_INFO("Daemon: idle for %u seconds, shutting down", idle_timeout);
+            break;
+        }
+
+        struct pollfd pfd = {.fd = listen_fd, .events = POLLIN, .revents = 0};
+        if (poll(&pfd, 1, 1000) <= 0)
+            continue;
+
+        int conn_fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (conn_fd < 0)
+            continue;
+
+        /* In case the socket was made reachable anyway (e.g. chmod, or a shared run dir) */
+        struct ucred cred = {};
+        socklen_t cred_len = sizeof(cred);
+        if (getsockopt(conn_fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0 || cred.uid != getuid()) {
+            LOG_WARNING("Daemon: rejected a connection from uid %u (pid %d)", cred.uid, cred.pid);
+            close(conn_fd);
+            continue;
+        }
+
+        pid_t session = fork();
+        if (session == 0) {
+            close(listen_fd);
+            _exit(handle_session(conn_fd, container_pid));
+        }
+        close(conn_fd);
+        if (session > 0)
+            active_sessions++;
+        last_activity = time(nullptr);
+    }
+
+    unlink(socket_path);
+    if (container_alive)
+        stop_container(entry_pid, container_pid);
+
+    return 0;
+}
+
+RESULT daemon_start(const char *socket_path, const char *entry_point, unsigned idle_timeout) {
+    int fd = connect_socket(socket_path);
+    if (fd >= 0) {
+        close(fd);
+        LOG_INFO("A daemon is already running on %s", socket_path);
+        return MAKE_RESULT(SEV_INFO, CAT_CONTAINER, E_ALREADY_EXISTS);
+    }
+
+    autofree char *run_dir = strdup(socket_path);
+    char *last_slash = strrchr(run_dir, '/');
+    if (last_slash)
+        *last_slash = '\0';
+    RETURN_IF_FAILED(ensure_dir(run_dir));
+
+    int ready_pipe[2];
+    if (pipe2(ready_pipe, O_CLOEXEC) != 0)
+        return result_from_errno();
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(ready_pipe[0]);
+        close(ready_pipe[1]);
+        return result_from_errno();
+    }
+
+    if (pid == 0) {
+        close(ready_pipe[0]);
+
+        /* Double fork, so that the daemon is reparented away from the caller */
+        if (fork() != 0)
+            _exit(0);
+        setsid();
+
+        int null_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDIN_FILENO);
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+            close(null_fd);
+        }
+
+        _exit(daemon_main(socket_path, entry_point, idle_timeout, ready_pipe[1]));
+    }
+
+    close(ready_pipe[1]);
+    waitpid(pid, nullptr, 0);
+
+    /* EOF without a byte means the daemon exited before the container was ready */
+    char ready = 0;
+    ssize_t n;
+    do {
+        n = read(ready_pipe[0], &ready, 1);
+    } while (n < 0 && errno == EINTR);
+    close(ready_pipe[0]);
+
+    if (n != 1)
+        return MAKE_RESULT(SEV_ERROR, CAT_CONTAINER, E_NOT_READY);
+
+    return RESULT_OK;
+}
+
+static int client_fd = -1;
+
+static void forward_signal(int sig) {
+    int saved_errno = errno;
+    uint32_t wire_sig = sig;
+    if (write(client_fd, &wire_sig, sizeof(wire_sig)) < 0) {
+    } /* nothing we can do in a signal handler */
+    errno = saved_errno;
+}
+
+RESULT daemon_run(const char *socket_path, char *const argv[], int *exit_status) {
+    autoclosefd int fd = connect_socket(socket_path);
+    if (fd < 0) {
+        /* Left behind by a daemon that didn't exit cleanly */
+        if (errno == ECONNREFUSED)
+            unlink(socket_path);
+        return MAKE_RESULT(SEV_INFO, CAT_CONTAINER, E_NOT_FOUND);
+    }
+
+    autoclosefd int cwd_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cwd_fd < 0)
+        return result_from_errno();
+
+    std::string data;
+    struct daemon_request req = {.magic = DAEMON_MAGIC, .argc = 0, .envc = 0, .data_size = 0};
+    for (char *const *arg = argv; *arg; arg++, req.argc++)
+        data.append(*arg, strlen(*arg) + 1);
+    for (char **env = environ; *env; env++, req.envc++)
+        data.append(*env, strlen(*env) + 1);
+    req.data_size = data.size();
+
+    int fds[DAEMON_NUM_FDS] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, cwd_fd};
+    char control[CMSG_SPACE(sizeof(fds))] = {};
+    struct iovec iov = {.iov_base = &req, .iov_len = sizeof(req)};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(req) || write_all(fd, data.data(), data.size()) != 0) {
+        LOG_ERROR("Failed to send the launch request to the daemon: %s", strerror(errno));
+        return MAKE_RESULT(SEV_ERROR, CAT_CONTAINER, E_IO_ERROR);
+    }
+
+    /* The command runs in the daemon's session, so pass on what would have reached it from our terminal */
+    client_fd = fd;
+    struct sigaction sa = {};
+    sa.sa_handler = forward_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    for (int sig : {SIGINT, SIGTERM, SIGHUP, SIGQUIT, SIGUSR1, SIGUSR2})
+        sigaction(sig, &sa, nullptr);
+
+    int32_t status;
+    if (read_all(fd, &status, sizeof(status)) != 0) {
+        LOG_ERROR("Lost the connection to the daemon");
+        return MAKE_RESULT(SEV_ERROR, CAT_CONTAINER, E_IO_ERROR);
+    }
+
+    if (WIFEXITED(status))
+        *exit_status = WEXITSTATUS(status);
+    else if (WIFSIGNALED(status))
+        *exit_status = 128 + WTERMSIG(status);
+    else
+        *exit_status = 1;
+
+    return RESULT_OK;
+}
@@ -0,0 +1,34 @@
+/*
+ * Persistent container daemon
+ *
+ * A daemon keeps one Steam Runtime container alive for a config/prefix combination
+ * and runs launch requests inside it (through setns), so that later launches don't
+ * have to pay for the container setup again.
+ *
+ * Copyright (C) 2025 William Horvath
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ * See the full license text in the repository LICENSE file.
+ */
+
+#pragma once
+
+#include "result.hpp"
+
+#define DAEMON_RUN_DIR "run"
+#define DAEMON_DEFAULT_IDLE_TIMEOUT 600 /* seconds */
+
+/* Get the socket path for the daemon serving `name` and the current WINEPREFIX/STEAM_COMPAT_DATA_PATH
+ * Returns a newly allocated string that must be freed by the caller, or nullptr if the path is too long */
+char *daemon_socket_path(const char *name);
+
+/* Start a detached daemon listening on `socket_path`, running its container through `entry_point`.
+ * Only returns once the container is up (or failed to start).
+ * Returns RESULT_OK on success, error RESULT on failure */
+RESULT daemon_start(const char *socket_path, const char *entry_point, unsigned idle_timeout);
+
+/* Run the nullptr-terminated `argv` inside the container of the daemon listening on `socket_path`,
+ * with the current environment, working directory and stdio. Signals are forwarded until it exits.
+ * Returns RESULT_OK and sets `exit_status` (shell convention) if the daemon ran it,
+ * E_NOT_FOUND if no daemon is listening, error RESULT otherwise */
+RESULT daemon_run(const char *socket_path, char *const argv[], int *exit_status);
@@ -0,0 +1,486 @@
+/*
+ * Cross-prefix file deduplication
+ *
+ * Copyright (C) 2025 William Horvath
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ * See the full license text in the repository LICENSE file.
+ */
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "dedup.hpp"
+#include "log.hpp"
+#include "macros.hpp"
+#include "prefix.hpp"
+#include "trace.hpp"
+#include "util.hpp"
+#include "yawlconfig.hpp"
+
+#include "openssl/evp.h"
+
+/* From linux/fs.h, which doesn't get along with the libc headers */
+#ifndef FIDEDUPERANGE
+struct file_dedupe_range_info {
+    int64_t dest_fd;
+    uint64_t dest_offset;
+    uint64_t bytes_deduped;
+    int32_t status;
+    uint32_t reserved;
+};
+
+struct file_dedupe_range {
+    uint64_t src_offset;
+    uint64_t src_length;
+    uint16_t dest_count;
+    uint16_t reserved1;
+    uint32_t reserved2;
+    struct file_dedupe_range_info info[];
+};
+
+#define FIDEDUPERANGE _IOWR(0x94, 54, struct file_dedupe_range)
+#define FILE_DEDUPE_RANGE_SAME 0
+#define FILE_DEDUPE_RANGE_DIFFERS 1
+#endif
+
+/* btrfs won't take more than this per call */
+#define DEDUP_CHUNK (16ULL * 1024 * 1024)
+
+#define DEDUP_INDEX_MAGIC "YAWLDD01"
+
+/* One per inode, sorted by (dev, ino) so lookups can bsearch the mapped file */
+struct index_record {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t deduped_ino; /* Inode whose extents this one already shares (0 = none) */
+    unsigned char hash[32];
+};
+
+struct index_header {
+    char magic[8];
+    uint64_t count;
+};
+
+struct dedup_file {
+    char *path;
+    struct index_record rec;
+    bool hashed;
+};
+
+struct dedup_state {
+    struct dedup_file *files;
+    size_t count;
+    size_t capacity;
+    std::atomic<size_t> next;
+};
+
+static RESULT scan_tree(struct dedup_state *state, const char *path) {
+    autoclosedir DIR *dir = opendir(path);
+    if (!dir)
+        return errno == ENOENT || errno == EACCES ? RESULT_OK : result_from_errno();
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        if (STRING_EQUALS(entry->d_name, ".") || STRING_EQUALS(entry->d_name, ".."))
+            continue;
+
+        struct stat st;
+        if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+            continue;
+
+        autofree char *full_path = nullptr;
+        join_paths(full_path, path, entry->d_name);
+        if (!full_path)
+            return MAKE_RESULT(SEV_ERROR, CAT_SYSTEM, E_OUT_OF_MEMORY);
+
+        if (S_ISDIR(st.st_mode)) {
+            RETURN_IF_FAILED(scan_tree(state, full_path));
+            continue;
+        }
+        if (!S_ISREG(st.st_mode) || st.st_size < DEDUP_MIN_SIZE)
+            continue;
+
+        if (state->count == state->capacity) {
+            size_t capacity = state->capacity ? state->capacity * 2 : 4096;
+            void *files = realloc(state->files, capacity * sizeof(*state->files));
+            if (!files)
+                return MAKE_RESULT(SEV_ERROR, CAT_SYSTEM, E_OUT_OF_MEMORY);
+            state->files = (struct dedup_file *)files;
+            state->capacity = capacity;
+        }
+
+        struct dedup_file *file = &state->files[state->count++];
+        memset((void *)file, 0, sizeof(*file));
+        file->path = full_path;
+        full_path = nullptr;
+        file->rec.dev = st.st_dev;
+        file->rec.ino = st.st_ino;
+        file->rec.size = st.st_size;
+        file->rec.mtime_sec = st.st_mtim.tv_sec;
+        file->rec.mtime_nsec = st.st_mtim.tv_nsec;
+    }
+
+    return RESULT_OK;
+}
+
+static int compare_inode(const void *a, const void *b) {
+    const struct index_record *ra = (const struct index_record *)a;
+    const struct index_record *rb = (const struct index_record *)b;
+    if (ra->dev != rb->dev)
+        return ra->dev < rb->dev ? -1 : 1;
+    return ra->ino < rb->ino ? -1 : ra->ino > rb->ino;
+}
+
+/* Take hashes (and earlier results) over from the index for files that haven't changed since */
+static size_t apply_index(struct dedup_state *state, const char *index_path) {
+    autoclosefd int fd = open(index_path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct index_header))
+        return 0;
+
+    void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        return 0;
+
+    struct index_header header;
+    memcpy(&header, map, sizeof(header));
+    const struct index_record *records = (const struct index_record *)((const char *)map + sizeof(header));
+    size_t reused = 0;
+
+    if (memcmp(header.magic, DEDUP_INDEX_MAGIC, sizeof(header.magic)) == 0 &&
+        header.count == (st.st_size - sizeof(header)) / sizeof(struct index_record)) {
+        for (size_t i = 0; i < state->count; i++) {
+            struct index_record *rec = &state->files[i].rec;
+            const struct index_record *found =
+                (const struct index_record *)bsearch(rec, records, header.count, sizeof(*records), compare_inode);
+            if (!found || found->size != rec->size || found->mtime_sec != rec->mtime_sec ||
+                found->mtime_nsec != rec->mtime_nsec)
+                continue;
+
+            memcpy(rec->hash, found->hash, sizeof(rec->hash));
+            rec->deduped_ino = found->deduped_ino;
+            state->files[i].hashed = true;
+            reused++;
+        }
+    }
+
+    munmap(map, st.st_size);
+    return reused;
+}
+
+static bool hash_file(const char *path, unsigned char hash[32]) {
+    autoclosefd int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOATIME);
+    if (fd < 0)
+        fd = open(path, O_RDONLY | O_CLOEXEC); /* O_NOATIME is only allowed on our own files */
+    if (fd < 0)
+        return false;
+
+    EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
+    if (!mdctx || EVP_DigestInit_ex(mdctx, EVP_sha256(), nullptr) != 1) {
+        EVP_MD_CTX_free(mdctx);
+        return false;
+    }
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    bool ok = true;
+    unsigned char buffer[BUFFER_SIZE * 8];
+    for (;;) {
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            ok = n == 0;
+            break;
+        }
+        if (EVP_DigestUpdate(mdctx, buffer, n) != 1) {
+            ok = false;
+            break;
+        }
+    }
+
+    unsigned int len = 0;
+    ok = ok && EVP_DigestFinal_ex(mdctx, hash, &len) == 1 && len == 32;
+    EVP_MD_CTX_free(mdctx);
+    return ok;
+}
+
+static void *hash_worker(void *arg) {
+    struct dedup_state *state = (struct dedup_state *)arg;
+
+    for (size_t i; (i = state->next.fetch_add(1, std::memory_order_relaxed)) < state->count;) {
+        struct dedup_file *file = &state->files[i];
+        if (file->hashed)
+            continue;
+        file->hashed = hash_file(file->path, file->rec.hash);
+        if (!file->hashed)
+            LOG_DEBUG("Failed to hash %s: %s", file->path, strerror(errno));
+    }
+
+    return nullptr;
+}
+
+static void hash_files(struct dedup_state *state, size_t todo) {
+    TRACE_SCOPE("dedup_hash");
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nthreads = cpus > 1 ? (size_t)cpus - 1 : 0;
+    if (nthreads > DEDUP_MAX_THREADS - 1)
+        nthreads = DEDUP_MAX_THREADS - 1;
+    if (nthreads > todo / 16)
+        nthreads = todo / 16;
+
+    pthread_t threads[DEDUP_MAX_THREADS];
+    size_t started = 0;
+    for (; started < nthreads; started++) {
+        if (pthread_create(&threads[started], nullptr, hash_worker, state) != 0)
+            break;
+    }
+    hash_worker(state);
+    for (size_t i = 0; i < started; i++)
+        pthread_join(threads[i], nullptr);
+}
+
+/* Identical files end up next to each other, hardlinks of the same inode right after each other */
+static int compare_content(const void *a, const void *b) {
+    const struct dedup_file *fa = (const struct dedup_file *)a;
+    const struct dedup_file *fb = (const struct dedup_file *)b;
+    if (fa->hashed != fb->hashed)
+        return fa->hashed ? -1 : 1;
+    if (fa->rec.size != fb->rec.size)
+        return fa->rec.size < fb->rec.size ? -1 : 1;
+    int cmp = memcmp(fa->rec.hash, fb->rec.hash, sizeof(fa->rec.hash));
+    if (cmp)
+        return cmp;
+    return compare_inode(&fa->rec, &fb->rec);
+}
+
+/* Share the extents of `src_fd` with `dst_fd`. Returns the bytes deduplicated, or -1 with errno set
+ * (EOPNOTSUPP/EINVAL/EXDEV when the filesystem can't, EBADE when the contents differ after all) */
+static long long dedupe_range(int src_fd, int dst_fd, uint64_t size) {
+    alignas(struct file_dedupe_range) char
+        args_buf[sizeof(struct file_dedupe_range) + sizeof(struct file_dedupe_range_info)];
+    struct file_dedupe_range *range = (struct file_dedupe_range *)args_buf;
+    struct file_dedupe_range_info *info = &range->info[0];
+    long long total = 0;
+
+    for (uint64_t offset = 0; offset < size;) {
+        memset(args_buf, 0, sizeof(args_buf));
+        range->src_offset = offset;
+        range->src_length = size - offset < DEDUP_CHUNK ? size - offset : DEDUP_CHUNK;
+        range->dest_count = 1;
+        info->dest_fd = dst_fd;
+        info->dest_offset = offset;
+
+        if (ioctl(src_fd, FIDEDUPERANGE, range) != 0)
+            return -1;
+        if (info->status == FILE_DEDUPE_RANGE_DIFFERS) {
+            errno = EBADE;
+            return -1;
+        }
+        if (info->status < 0) {
+            errno = -info->status;
+            return -1;
+        }
+        if (!info->bytes_deduped)
+            break;
+
+        total += info->bytes_deduped;
+        offset += info->bytes_deduped;
+    }
+
+    return total;
+}
+
+/* Builtin and placeholder DLLs carry a marker in the DOS stub, right after the DOS header */
+static bool is_wine_builtin(int fd) {
+    char header[0x60];
+    if (pread(fd, header, sizeof(header), 0) != (ssize_t)sizeof(header) || header[0] != 'M' || header[1] != 'Z')
+        return false;
+    return memcmp(header + 0x40, "Wine builtin DLL", 16) == 0 || memcmp(header + 0x40, "Wine placeholder DLL", 20) == 0;
+}
+
+static bool same_contents(int fd_a, int fd_b) {
+    char buf_a[BUFFER_SIZE], buf_b[BUFFER_SIZE];
+    for (off_t offset = 0;; offset += sizeof(buf_a)) {
+        ssize_t n_a = pread(fd_a, buf_a, sizeof(buf_a), offset);
+        ssize_t n_b = pread(fd_b, buf_b, sizeof(buf_b), offset);
+        if (n_a < 0 || n_a != n_b || memcmp(buf_a, buf_b, n_a) != 0)
+            return false;
+        if (n_a == 0)
+            return true;
+    }
+}
+
+/* Replace `dst_path` with a hardlink to `src_path`. The shared inode loses its write permissions, so that
+ * wine can't update one prefix's copy in place and silently change all of them. */
+static bool hardlink_replace(const char *src_path, int src_fd, const char *dst_path) {
+    autofree char *tmp_path = nullptr;
+    append_sep(tmp_path, "", dst_path, ".yawl-dedup");
+    if (!tmp_path || link(src_path, tmp_path) != 0)
+        return false;
+    if (rename(tmp_path, dst_path) != 0) {
+        unlink(tmp_path);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(src_fd, &st) == 0)
+        fchmod(src_fd, st.st_mode & 07555);
+    return true;
+}
+
+struct dedup_stats {
+    size_t files;
+    size_t hardlinks;
+    uint64_t bytes;
+};
+
+/* Deduplicate every file in [first, last) against the first one */
+static void dedup_group(struct dedup_file *first, struct dedup_file *last, bool hardlink_builtins,
+                        struct dedup_stats *stats) {
+    autoclosefd int src_fd = open(first->path, O_RDONLY | O_CLOEXEC);
+    if (src_fd < 0)
+        return;
+
+    bool reflinks = true;
+    for (struct dedup_file *file = first + 1; file < last; file++) {
+        if (file->rec.ino == first->rec.ino || file->rec.dev != first->rec.dev ||
+            file->rec.deduped_ino == first->rec.ino)
+            continue;
+
+        /* FIDEDUPERANGE wants the destination open for writing (or to be its owner, in newer kernels) */
+        autoclosefd int dst_fd = open(file->path, O_RDWR | O_CLOEXEC);
+        if (dst_fd < 0)
+            dst_fd = open(file->path, O_RDONLY | O_CLOEXEC);
+        if (dst_fd < 0)
+            continue;
+
+        long long deduped = reflinks ? dedupe_range(src_fd, dst_fd, file->rec.size) : -1;
+        if (deduped >= 0) {
+            file->rec.deduped_ino = first->rec.ino;
+            stats->files++;
+            stats->bytes += deduped;
+            continue;
+        }
+
+        if (reflinks && errno != EOPNOTSUPP && errno != EINVAL && errno != EXDEV && errno != ENOTTY) {
+            LOG_DEBUG("Couldn't deduplicate %s: %s", file->path, strerror(errno));
+            continue;
+        }
+        reflinks = false;
+
+        if (!hardlink_builtins || !is_wine_builtin(dst_fd) || !same_contents(src_fd, dst_fd))
+            continue;
+        if (hardlink_replace(first->path, src_fd, file->path)) {
+            file->rec.ino = first->rec.ino;
+            stats->hardlinks++;
+            stats->bytes += file->rec.size;
+        }
+    }
+}
+
+static void write_index(const char *index_path, struct dedup_state *state) {
+    autofree struct index_record *records =
+        (struct index_record *)malloc((state->count ? state->count : 1) * sizeof(*records));
+    if (!records)
+        return;
+
+    size_t count = 0;
+    for (size_t i = 0; i < state->count; i++) {
+        if (state->files[i].hashed)
+            records[count++] = state->files[i].rec;
+    }
+    qsort(records, count, sizeof(*records), compare_inode);
+
+    /* Hardlinks are one inode */
+    size_t unique = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (!unique || compare_inode(&records[unique - 1], &records[i]) != 0)
+            records[unique++] = records[i];
+    }
+
+    struct index_header header = {};
+    memcpy(header.magic, DEDUP_INDEX_MAGIC, sizeof(header.magic));
+    header.count = unique;
+
+    autofree char *tmp_path = strdup(index_path);
+    append_sep(tmp_path, "", ".tmp");
+
+    autoclosefd int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    size_t records_size = unique * sizeof(*records);
+    if (fd < 0 || write(fd, &header, sizeof(header)) != (ssize_t)sizeof(header) ||
+        write(fd, records, records_size) != (ssize_t)records_size || rename(tmp_path, index_path) != 0) {
+        LOG_DEBUG("Couldn't write the dedup index %s: %s", index_path, strerror(errno));
+        unlink(tmp_path);
+    }
+}
+
+static uint64_t free_bytes(const char *path) {
+    struct statvfs vfs;
+    return statvfs(path, &vfs) == 0 ? (uint64_t)vfs.f_bavail * vfs.f_frsize : 0;
+}
+
+RESULT dedup_run(bool hardlink_builtins) {
+    TRACE_SCOPE("dedup_run");
+
+    autofree char *prefixes = nullptr;
+    autofree char *templates = nullptr;
+    autofree char *index_path = nullptr;
+    join_paths(prefixes, config::yawl_dir, PREFIX_DIR);
+    join_paths(templates, config::yawl_dir, PREFIX_TEMPLATE_DIR);
+    join_paths(index_path, config::yawl_dir, DEDUP_INDEX);
+
+    struct dedup_state state = {};
+    struct dedup_stats stats = {};
+    uint64_t free_before = free_bytes(config::yawl_dir);
+
+    RESULT result = scan_tree(&state, templates);
+    if (!FAILED(result))
+        result = scan_tree(&state, prefixes);
+
+    if (!FAILED(result)) {
+        size_t reused = apply_index(&state, index_path);
+        LOG_INFO("Hashing %zu files (%zu unchanged since the last run)...", state.count - reused, reused);
+        hash_files(&state, state.count - reused);
+
+        qsort(state.files, state.count, sizeof(*state.files), compare_content);
+        for (size_t start = 0, end; start < state.count; start = end) {
+            const struct dedup_file *first = &state.files[start];
+            for (end = start + 1; end < state.count; end++) {
+                const struct dedup_file *file = &state.files[end];
+                if (!file->hashed || file->rec.size != first->rec.size ||
+                    memcmp(file->rec.hash, first->rec.hash, sizeof(first->rec.hash)) != 0)
+                    break;
+            }
+            if (first->hashed && end - start > 1)
+                dedup_group(&state.files[start], &state.files[end], hardlink_builtins, &stats);
+        }
+
+        write_index(index_path, &state);
+
+        uint64_t free_after = free_bytes(config::yawl_dir);
+        LOG_INFO("Deduplicated %zu files and hardlinked %zu, %.1f MiB in total (%.1f MiB more free space)",
+                 stats.files, stats.hardlinks, (double)stats.bytes / (1024 * 1024),
+                 free_after > free_before ? (double)(free_after - free_before) / (1024 * 1024) : 0.0);
+    }
+
+    for (size_t i = 0; i < state.count; i++)
+        free(state.files[i].path);
+    free(state.files);
+
+    return result;
+}
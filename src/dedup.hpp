@@ -0,0 +1,28 @@
+/*
+ * Cross-prefix file deduplication
+ *
+ * Prefixes (and the templates they were cloned from) carry the same wine builtin DLLs and redistributables
+ * over and over. The 'dedup' verb hashes every file of a useful size under yawl_dir/prefixes and
+ * yawl_dir/templates on several threads, and shares the extents of identical files through FIDEDUPERANGE,
+ * which the kernel only does after comparing the data itself. On filesystems without reflinks, wine builtin
+ * DLLs can be hardlinked instead, if asked to. Hashes and previous results are kept in an index keyed by
+ * inode and stamps, so re-running it only reads what changed.
+ *
+ * Copyright (C) 2025 William Horvath
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ * See the full license text in the repository LICENSE file.
+ */
+
+#pragma once
+
+#include "result.hpp"
+
+#define DEDUP_INDEX "dedup.index"
+#define DEDUP_MIN_SIZE (16 * 1024) /* smaller files don't pay for the syscalls */
+#define DEDUP_MAX_THREADS 8
+
+/* Deduplicate the prefixes and templates, and report the space saved. With `hardlink_builtins`, wine builtin
+ * and placeholder DLLs on filesystems without reflink support are replaced with (read-only) hardlinks.
+ * Returns RESULT_OK on success, error RESULT on failure */
+RESULT dedup_run(bool hardlink_builtins);
@@ -0,0 +1,83 @@
+/*
+ * Minimal launcher front-end
+ *
+ * This binary only knows how to replay a launch plan written by the full yawl binary.
+ * It doesn't link curl, OpenSSL, libarchive or glib, so it maps and starts much faster.
+ * Anything else (no valid plan, installing/verifying the runtime, updates, notifications,
+ * one-shot verbs) is handed off to the full binary in the same directory.
+ *
+ * Copyright (C) 2025 William Horvath
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ * See the full license text in the repository LICENSE file.
+ */
+
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+
+#include "launchplan.hpp"
+#include "util.hpp"
+
+/* Same lookup order as config::setup_prog_dir(), minus the directory creation */
+static bool get_yawl_dir(char yawl_dir[PATH_MAX]) {
+    struct passwd *pw;
+    const char *temp_path = getenv("YAWL_INSTALL_DIR");
+
+    if (temp_path) {
+        /* Needs shell-style expansion, leave that to the full binary */
+        if (strpbrk(temp_path, "~$`"))
+            return false;
+        return snprintf(yawl_dir, PATH_MAX, "%s", temp_path) < PATH_MAX;
+    }
+    if ((temp_path = getenv("XDG_DATA_HOME")))
+        return snprintf(yawl_dir, PATH_MAX, "%s/" PROG_NAME, temp_path) < PATH_MAX;
+    if ((temp_path = getenv("HOME")) || ((pw = getpwuid(getuid())) && (temp_path = pw->pw_dir)))
+        return snprintf(yawl_dir, PATH_MAX, "%s/.local/share/" PROG_NAME, temp_path) < PATH_MAX;
+
+    return false;
+}
+
+/* Execute the full binary next to this one with the same arguments */
+static int hand_off(char *argv[]) {
+    char exec_dir[PATH_MAX];
+    static char full_path[PATH_MAX];
+
+    ssize_t len = readlink("/proc/self/exe", exec_dir, sizeof(exec_dir) - 1);
+    if (len <= 0) {
+        perror("Failed to get executable path");
+        return 1;
+    }
+    exec_dir[len] = '\0';
+
+    char *last_slash = strrchr(exec_dir, '/');
+    if (last_slash)
+        *last_slash = '\0';
+
+    if (snprintf(full_path, sizeof(full_path), "%s/" PROG_NAME_ARCH, exec_dir) >= (int)sizeof(full_path)) {
+        fprintf(stderr, "Executable path too long: %s\n", exec_dir);
+        return 1;
+    }
+
+    /* Wrapper symlinks select their config through argv[0], so only replace our own name */
+    if (STRING_EQUALS(program_invocation_short_name, PROG_NAME_ARCH LAUNCHER_SUFFIX))
+        argv[0] = full_path;
+
+    execv(full_path, argv);
+    fprintf(stderr, "Failed to execute %s: %s\n", full_path, strerror(errno));
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    char yawl_dir[PATH_MAX];
+    char plan_dir[PATH_MAX];
+    const char *plan_name = nullptr;
+
+    /* The full binary prints the error for root */
+    if (geteuid() != 0 && plan_verbs_eligible(&plan_name) && get_yawl_dir(yawl_dir) &&
+        snprintf(plan_dir, sizeof(plan_dir), "%s/" PLAN_DIR, yawl_dir) < (int)sizeof(plan_dir))
+        plan_exec(plan_dir, plan_name_for(plan_name), argc, argv);
+
+    return hand_off(argv);
+}
@@ -0,0 +1,484 @@
+/*
+ * Launch plan cache
+ *
+ * Plan file layout (native endianness, it's never shared between machines):
+ *   struct plan_header
+ *   struct plan_stamp   stamps[n_deps]
+ *   uint32_t            arg_offsets[n_args]  (into the string table)
+ *   uint32_t            env_offsets[n_env]   ("NAME=VALUE" to set, "NAME" to unset)
+ *   char                strings[strings_size]
+ *
+ * Copyright (C) 2025 William Horvath
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ * See the full license text in the repository LICENSE file.
+ */
+
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "launchplan.hpp"
+#include "macros.hpp"
+#include "registry.hpp"
+#include "util.hpp"
+
+#define PLAN_MAGIC "YAWLPLN1"
+#define PLAN_MAX_DEPS 64
+#define PLAN_MAX_ARGS 16
+#define PLAN_MAX_ENV 64
+#define PLAN_STATX_MASK (STATX_TYPE | STATX_MODE | STATX_INO | STATX_SIZE | STATX_MTIME)
+
+struct plan_header {
+    char magic[8];
+    uint64_t input_hash;
+    uint32_t n_deps;
+    uint32_t n_args;
+    uint32_t n_env;
+    uint32_t strings_size;
+};
+
+struct plan_stamp {
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint32_t mode; /* 0 = the path didn't exist */
+    uint32_t dev_major;
+    uint32_t dev_minor;
+    uint32_t path_off;
+    uint32_t flags; /* PLAN_STAMP_* */
+};
+
+/* A replay updates the path's access time, like the full launch did (atime isn't part of the stamp) */
+#define PLAN_STAMP_TOUCH 0x1
+
+/* Environment variables (besides YAWL_*) that influence what a full launch does */
+static constexpr const char *const plan_input_vars[] = {
+    "HOME",           "XDG_DATA_HOME",           "PATH",          "LD_LIBRARY_PATH",
+    "LIBGL_DRIVERS_PATH", "WINEPREFIX",          "STEAM_COMPAT_CLIENT_INSTALL_PATH",
+    "STEAM_COMPAT_SESSION_ID", "STEAM_COMPAT_APP_ID", "STEAM_COMPAT_DATA_PATH", "UMU_ID",
+};
+
+/* YAWL_* variables that don't change the launch itself */
+static constexpr const char *const plan_ignored_vars[] = {"YAWL_TRACE=",      "YAWL_LOG_FILE=",     "YAWL_LOG_LEVEL=",
+                                                          "YAWL_LOG_FORMAT=", "YAWL_LOG_MAX_SIZE=", "YAWL_LOG_COMPRESS="};
+
+static uint64_t fnv1a(uint64_t hash, const char *str) {
+    for (; *str; str++) {
+        hash ^= (unsigned char)*str;
+        hash *= 0x100000001b3ULL;
+    }
+    /* terminate each string so that "ab","c" and "a","bc" hash differently */
+    hash ^= 0xff;
+    hash *= 0x100000001b3ULL;
+    return hash;
+}
+
+static const char *env_lookup_len(char *const envp[], const char *name, size_t len) {
+    for (char *const *e = envp; *e; e++) {
+        if (strncmp(*e, name, len) == 0 && (*e)[len] == '=')
+            return *e + len + 1;
+    }
+    return nullptr;
+}
+
+static const char *env_lookup(char *const envp[], const char *name) { return env_lookup_len(envp, name, strlen(name)); }
+
+/* `env_offs` are the plan's environment deltas in `strings`: the values those variables had before the launch
+ * changed them are inputs too, since replaying the deltas would overwrite anything the user set there since */
+static uint64_t compute_input_hash(char *const envp[], const char *plan_name, const uint32_t *env_offs, uint32_t n_env,
+                                   const char *strings) {
+    /* No VERSION here: the front-end isn't updated together with the full binary, whose
+     * stamp already invalidates the plan, and format changes bump PLAN_MAGIC */
+    uint64_t hash = fnv1a(0xcbf29ce484222325ULL, plan_name);
+
+    for (const char *name : plan_input_vars) {
+        const char *value = env_lookup(envp, name);
+        hash = fnv1a(hash, value ? value : "\x01unset");
+    }
+
+    for (uint32_t i = 0; i < n_env; i++) {
+        const char *entry = strings + env_offs[i];
+        const char *value = env_lookup_len(envp, entry, strcspn(entry, "="));
+        hash = fnv1a(hash, value ? value : "\x01unset");
+    }
+
+    /* YAWL_* variables are summed, so that their order in the environment doesn't matter */
+    uint64_t yawl_vars = 0;
+    for (char *const *e = envp; *e; e++) {
+        if (!STRING_PREFIX(*e, "YAWL_"))
+            continue;
+        bool ignored = false;
+        for (const char *ignore : plan_ignored_vars)
+            ignored |= (strncmp(*e, ignore, strlen(ignore)) == 0);
+        if (!ignored)
+            yawl_vars += fnv1a(0xcbf29ce484222325ULL, *e);
+    }
+
+    return hash ^ yawl_vars;
+}
+
+static bool stamp_path(const char *path, struct plan_stamp *stamp) {
+    struct statx stx;
+
+    memset(stamp, 0, sizeof(*stamp));
+    if (statx(AT_FDCWD, path, AT_STATX_SYNC_AS_STAT, PLAN_STATX_MASK, &stx) != 0)
+        return errno == ENOENT || errno == ENOTDIR; /* missing paths are valid stamps too */
+
+    stamp->ino = stx.stx_ino;
+    stamp->size = stx.stx_size;
+    stamp->mtime_sec = stx.stx_mtime.tv_sec;
+    stamp->mtime_nsec = stx.stx_mtime.tv_nsec;
+    stamp->mode = stx.stx_mode;
+    stamp->dev_major = stx.stx_dev_major;
+    stamp->dev_minor = stx.stx_dev_minor;
+    return true;
+}
+
+static bool stamp_matches(const struct plan_stamp *a, const struct plan_stamp *b) {
+    return a->ino == b->ino && a->size == b->size && a->mtime_sec == b->mtime_sec &&
+           a->mtime_nsec == b->mtime_nsec && a->mode == b->mode && a->dev_major == b->dev_major &&
+           a->dev_minor == b->dev_minor;
+}
+
+bool plan_verbs_eligible(const char **config_name) {
+    static char *verbs_copy = nullptr;
+
+    if (config_name)
+        *config_name = nullptr;
+
+    /* Someone debugging a launch wants to see what it does */
+    const char *level = getenv("YAWL_LOG_LEVEL");
+    if (level && LCSTRING_EQUALS(level, "debug"))
+        return false;
+
+    const char *verbs = getenv("YAWL_VERBS");
+    if (!verbs || !*verbs)
+        return true;
+
+    free(verbs_copy);
+    verbs_copy = strdup(verbs);
+    if (!verbs_copy)
+        return false;
+
+    char *saveptr = nullptr;
+    for (char *token = strtok_r(verbs_copy, ";", &saveptr); token; token = strtok_r(nullptr, ";", &saveptr)) {
+        if (LCSTRING_PREFIX(token, "config=")) {
+            if (config_name)
+                *config_name = STRING_AFTER_PREFIX(token, "config=");
+        } else if (!LCSTRING_PREFIX(token, "exec=") && !LCSTRING_PREFIX(token, "proton=") &&
+                   !LCSTRING_PREFIX(token, "proton_verb=") && !LCSTRING_PREFIX(token, "wineserver=")) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+const char *plan_name_for(const char *config_name) {
+    if (config_name)
+        return config_name;
+
+    /* Same rules as the wrapper symlinks, but the front-end's own name isn't a config */
+    const char *suffix = strchr(program_invocation_short_name, '-');
+    if (suffix && suffix[1] && !STRING_EQUALS(suffix + 1, "aarch64") && !STRING_EQUALS(suffix, LAUNCHER_SUFFIX))
+        return suffix + 1;
+
+    return "default";
+}
+
+static void plan_file_path(char path[PATH_MAX], const char *plan_dir, const char *plan_name, const char *suffix) {
+    /* config= can be a full path, keep the plan name a single path component */
+    char name[NAME_MAX - 16];
+    snprintf(name, sizeof(name), "%s", plan_name);
+    for (char *c = name; *c; c++) {
+        if (*c == '/')
+            *c = '_';
+    }
+    snprintf(path, PATH_MAX, "%s/%s" PLAN_EXTENSION "%s", plan_dir, name, suffix);
+}
+
+RESULT plan_exec(const char *plan_dir, const char *plan_name, int argc, char *argv[]) {
+    char path[PATH_MAX];
+    struct stat st;
+
+    plan_file_path(path, plan_dir, plan_name, "");
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return MAKE_RESULT(SEV_INFO, CAT_CONFIG, E_NOT_FOUND);
+
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct plan_header)) {
+        close(fd);
+        return MAKE_RESULT(SEV_WARNING, CAT_CONFIG, E_PARSE_ERROR);
+    }
+
+    size_t size = st.st_size;
+    void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return MAKE_RESULT(SEV_WARNING, CAT_CONFIG, E_IO_ERROR);
+
+    RESULT result = MAKE_RESULT(SEV_WARNING, CAT_CONFIG, E_PARSE_ERROR);
+    const char *base = (const char *)map;
+    const struct plan_header *hdr = (const struct plan_header *)map;
+
+    if (memcmp(hdr->magic, PLAN_MAGIC, sizeof(hdr->magic)) != 0 || hdr->n_deps > PLAN_MAX_DEPS ||
+        hdr->n_args == 0 || hdr->n_args > PLAN_MAX_ARGS || hdr->n_env > PLAN_MAX_ENV || hdr->strings_size == 0)
+        goto out;
+
+    {
+        size_t tables_off = sizeof(*hdr) + hdr->n_deps * sizeof(struct plan_stamp);
+        size_t strings_off = tables_off + (hdr->n_args + hdr->n_env) * sizeof(uint32_t);
+        if (strings_off + hdr->strings_size != size)
+            goto out;
+
+        const struct plan_stamp *stamps = (const struct plan_stamp *)(base + sizeof(*hdr));
+        const uint32_t *arg_offs = (const uint32_t *)(base + tables_off);
+        const uint32_t *env_offs = arg_offs + hdr->n_args;
+        const char *strings = base + strings_off;
+
+        if (strings[hdr->strings_size - 1] != '\0')
+            goto out;
+        for (uint32_t i = 0; i < hdr->n_deps; i++)
+            if (stamps[i].path_off >= hdr->strings_size)
+                goto out;
+        for (uint32_t i = 0; i < hdr->n_args + hdr->n_env; i++)
+            if (arg_offs[i] >= hdr->strings_size)
+                goto out;
+
+        /* Now the actual validation: same inputs, same files */
+        result = MAKE_RESULT(SEV_INFO, CAT_CONFIG, E_NOT_READY);
+        if (hdr->input_hash != compute_input_hash(environ, plan_name, env_offs, hdr->n_env, strings))
+            goto out;
+
+        for (uint32_t i = 0; i < hdr->n_deps; i++) {
+            struct plan_stamp now;
+            if (!stamp_path(strings + stamps[i].path_off, &now) || !stamp_matches(&now, &stamps[i]))
+                goto out;
+        }
+
+        /* Only the access time: the modification time is part of the stamp */
+        static const struct timespec touch_times[2] = {{0, UTIME_NOW}, {0, UTIME_OMIT}};
+        for (uint32_t i = 0; i < hdr->n_deps; i++) {
+            if (stamps[i].flags & PLAN_STAMP_TOUCH)
+                utimensat(AT_FDCWD, strings + stamps[i].path_off, touch_times, 0);
+        }
+
+        const char **new_argv = (const char **)calloc(hdr->n_args + argc + 1, sizeof(char *));
+        char **saved_env = (char **)calloc(hdr->n_env + 1, sizeof(char *));
+        if (!new_argv || !saved_env) {
+            free(new_argv);
+            free(saved_env);
+            result = MAKE_RESULT(SEV_ERROR, CAT_GENERAL, E_OUT_OF_MEMORY);
+            goto out;
+        }
+
+        int n = 0;
+        for (uint32_t i = 0; i < hdr->n_args; i++)
+            new_argv[n++] = strings + arg_offs[i];
+        for (int i = 1; i < argc; i++)
+            new_argv[n++] = argv[i];
+
+        /* Apply the environment deltas, remembering the old values in case execv fails */
+        for (uint32_t i = 0; i < hdr->n_env; i++) {
+            const char *entry = strings + env_offs[i];
+            const char *eq = strchr(entry, '=');
+            std::string name(entry, eq ? (size_t)(eq - entry) : strlen(entry));
+            const char *old = getenv(name.c_str());
+
+            if (old)
+                saved_env[i] = strdup((name + "=" + old).c_str());
+            if (eq)
+                setenv(name.c_str(), eq + 1, 1);
+            else
+                unsetenv(name.c_str());
+        }
+
+        /* Register the container we're about to start, like a full launch would (plan_dir is yawl_dir/PLAN_DIR) */
+        std::string yawl_dir(plan_dir);
+        size_t last_slash = yawl_dir.rfind('/');
+        if (last_slash != std::string::npos) {
+            yawl_dir.resize(last_slash);
+            registry_add(yawl_dir.c_str(), plan_name);
+        }
+
+        execv(new_argv[0], (char *const *)new_argv);
+        result = MAKE_RESULT(SEV_ERROR, CAT_RUNTIME, E_NOT_FOUND);
+
+        for (uint32_t i = 0; i < hdr->n_env; i++) {
+            const char *entry = strings + env_offs[i];
+            const char *eq = strchr(entry, '=');
+            std::string name(entry, eq ? (size_t)(eq - entry) : strlen(entry));
+
+            if (saved_env[i])
+                setenv(name.c_str(), strchr(saved_env[i], '=') + 1, 1);
+            else
+                unsetenv(name.c_str());
+            free(saved_env[i]);
+        }
+        free(saved_env);
+        free(new_argv);
+    }
+
+out:
+    munmap(map, size);
+    return result;
+}
+
+/* Recording state for the plan of the current launch */
+static bool recording = false;
+static char **env_snapshot = nullptr;
+static char *dep_paths[PLAN_MAX_DEPS];
+static struct plan_stamp dep_stamps[PLAN_MAX_DEPS];
+static uint32_t n_deps = 0;
+
+/* Dependencies get added from the startup tasks' threads */
+static pthread_mutex_t deps_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void plan_record_begin(void) {
+    size_t count = 0;
+    for (char **e = environ; *e; e++)
+        count++;
+
+    env_snapshot = (char **)calloc(count + 1, sizeof(char *));
+    if (!env_snapshot)
+        return;
+
+    for (size_t i = 0; i < count; i++)
+        env_snapshot[i] = strdup(environ[i]);
+
+    recording = true;
+}
+
+void plan_record_cancel(void) { recording = false; }
+
+void plan_add_dependency(const char *path) {
+    if (!recording || !path)
+        return;
+
+    pthread_mutex_lock(&deps_lock);
+
+    for (uint32_t i = 0; i < n_deps; i++) {
+        if (STRING_EQUALS(dep_paths[i], path))
+            goto out;
+    }
+
+    /* Too many dependencies or an unstattable path: don't trust a plan for this launch */
+    if (n_deps >= PLAN_MAX_DEPS || !stamp_path(path, &dep_stamps[n_deps])) {
+        recording = false;
+        goto out;
+    }
+
+    dep_paths[n_deps++] = strdup(path);
+
+out:
+    pthread_mutex_unlock(&deps_lock);
+}
+
+void plan_add_touch(const char *path) {
+    plan_add_dependency(path);
+
+    pthread_mutex_lock(&deps_lock);
+    for (uint32_t i = 0; recording && i < n_deps; i++) {
+        if (STRING_EQUALS(dep_paths[i], path))
+            dep_stamps[i].flags |= PLAN_STAMP_TOUCH;
+    }
+    pthread_mutex_unlock(&deps_lock);
+}
+
+static void append_string(std::string &strings, uint32_t *offset, const char *str) {
+    *offset = strings.size();
+    strings.append(str);
+    strings.push_back('\0');
+}
+
+RESULT plan_write(const char *plan_dir, const char *plan_name, const char *const prefix_argv[], int prefix_argc) {
+    if (!recording)
+        return MAKE_RESULT(SEV_INFO, CAT_CONFIG, E_CANCELED);
+    if (prefix_argc <= 0 || prefix_argc > PLAN_MAX_ARGS)
+        return MAKE_RESULT(SEV_WARNING, CAT_CONFIG, E_INVALID_ARG);
+
+    std::string strings;
+    uint32_t arg_offs[PLAN_MAX_ARGS];
+    uint32_t env_offs[PLAN_MAX_ENV];
+    uint32_t n_env = 0;
+
+    for (uint32_t i = 0; i < n_deps; i++)
+        append_string(strings, &dep_stamps[i].path_off, dep_paths[i]);
+
+    for (int i = 0; i < prefix_argc; i++)
+        append_string(strings, &arg_offs[i], prefix_argv[i]);
+
+    /* Variables that were added or changed during this launch */
+    for (char **e = environ; *e; e++) {
+        bool unchanged = false;
+        for (char **s = env_snapshot; *s && !unchanged; s++)
+            unchanged = STRING_EQUALS(*e, *s);
+        if (unchanged)
+            continue;
+        if (n_env >= PLAN_MAX_ENV)
+            return MAKE_RESULT(SEV_WARNING, CAT_CONFIG, E_INVALID_ARG);
+        append_string(strings, &env_offs[n_env++], *e);
+    }
+
+    /* Variables that were removed */
+    for (char **s = env_snapshot; *s; s++) {
+        const char *eq = strchr(*s, '=');
+        if (!eq)
+            continue;
+        std::string name(*s, eq - *s);
+        if (getenv(name.c_str()))
+            continue;
+        if (n_env >= PLAN_MAX_ENV)
+            return MAKE_RESULT(SEV_WARNING, CAT_CONFIG, E_INVALID_ARG);
+        append_string(strings, &env_offs[n_env++], name.c_str());
+    }
+
+    struct plan_header hdr = {};
+    memcpy(hdr.magic, PLAN_MAGIC, sizeof(hdr.magic));
+    hdr.input_hash = compute_input_hash(env_snapshot, plan_name, env_offs, n_env, strings.data());
+    hdr.n_deps = n_deps;
+    hdr.n_args = prefix_argc;
+    hdr.n_env = n_env;
+    hdr.strings_size = strings.size();
+
+    std::string blob((const char *)&hdr, sizeof(hdr));
+    blob.append((const char *)dep_stamps, n_deps * sizeof(struct plan_stamp));
+    blob.append((const char *)arg_offs, prefix_argc * sizeof(uint32_t));
+    blob.append((const char *)env_offs, n_env * sizeof(uint32_t));
+    blob.append(strings);
+
+    if (mkdir(plan_dir, 0755) != 0 && errno != EEXIST)
+        return MAKE_RESULT(SEV_WARNING, CAT_FILESYSTEM, E_ACCESS_DENIED);
+
+    char path[PATH_MAX], temp_path[PATH_MAX];
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".tmp.%d", (int)getpid());
+    plan_file_path(path, plan_dir, plan_name, "");
+    plan_file_path(temp_path, plan_dir, plan_name, suffix);
+
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return MAKE_RESULT(SEV_WARNING, CAT_FILESYSTEM, E_ACCESS_DENIED);
+
+    bool written = write(fd, blob.data(), blob.size()) == (ssize_t)blob.size();
+    close(fd);
+
+    /* Readers mmap the file, so always replace it atomically */
+    if (!written || rename(temp_path, path) != 0) {
+        unlink(temp_path);
+        return MAKE_RESULT(SEV_WARNING, CAT_FILESYSTEM, E_IO_ERROR);
+    }
+
+    return RESULT_OK;
+}
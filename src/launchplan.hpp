@@ -0,0 +1,55 @@
+/*
+ * Launch plan cache
+ *
+ * A launch plan is the compiled result of a full startup for one configuration:
+ * the final argv prefix for the entry point, the environment changes yawl made,
+ * and the stamps of every file/directory those decisions depended on. If all the
+ * stamps still match, a later launch can skip straight to execv().
+ *
+ * This file must not depend on the logging or network code, since the minimal
+ * front-end binary links it on its own.
+ *
+ * Copyright (C) 2025 William Horvath
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ * See the full license text in the repository LICENSE file.
+ */
+
+#pragma once
+
+#include "result.hpp"
+
+#define PLAN_DIR "plans"
+#define PLAN_EXTENSION ".plan"
+
+/* Name of the minimal front-end binary, which only replays plans */
+#define LAUNCHER_SUFFIX "-launch"
+
+/* Check whether the current YAWL_VERBS only contain verbs that a plan can reproduce
+ * (config=, exec=, proton=, proton_verb=, wineserver=). If `config_name` is non-null,
+ * it receives a pointer to a static copy of the config= value (or nullptr). */
+bool plan_verbs_eligible(const char **config_name);
+
+/* The plan name for a launch: the config= value if given, otherwise the wrapper suffix of the
+ * program name (yawl-<config>), otherwise "default" */
+const char *plan_name_for(const char *config_name);
+
+/* Try to run the plan named `plan_name` in `plan_dir`, appending argv[1..argc) to its argv.
+ * Only returns if the plan is missing, stale or couldn't be executed; the environment is left untouched then. */
+RESULT plan_exec(const char *plan_dir, const char *plan_name, int argc, char *argv[]);
+
+/* Start recording a new plan: snapshots the environment so that the changes made
+ * during this launch can be stored as deltas. */
+void plan_record_begin(void);
+
+/* Stop recording (e.g. because an option was used that a plan can't reproduce) */
+void plan_record_cancel(void);
+
+/* Record `path` as a dependency of the plan being recorded (missing paths are recorded too) */
+void plan_add_dependency(const char *path);
+
+/* Like plan_add_dependency(), and replays of the plan update the access time of `path` */
+void plan_add_touch(const char *path);
+
+/* Write the recorded plan. `prefix_argv` is the argv for the entry point, without the user's arguments. */
+RESULT plan_write(const char *plan_dir, const char *plan_name, const char *const prefix_argv[], int prefix_argc);
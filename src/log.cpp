@@ -7,23 +7,34 @@
  * See the full license text in the repository LICENSE file.
  */
 
+#include <atomic>
 #include <cassert>
 #include <cerrno>
+#include <climits>
+#include <csignal>
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <zstd.h>
 
 #define G_LOG_DOMAIN "libnotify"
 #include "libnotify/notify.h"
 
 #include "log.hpp"
+#include "macros.hpp"
+#include "trace.hpp"
 #include "util.hpp"
 #include "yawlconfig.hpp"
 
 #include "fmt/printf.h"
 
 static FILE *log_file = nullptr;
-static Level current_log_level = Level::Info;
+Level current_log_level = Level::Info;
 static bool terminal_output = false;
 static gboolean notify_initialized = FALSE;
 
@@ -42,6 +53,567 @@ static constexpr const char *const level_colors[] = {"\0",        COLOR_SYSTEM,
 
 static_assert(sizeof(level_strings) == sizeof(level_colors), "each log level string should have a corresponding color");
 
+/* File output is asynchronous: callers only format their message into a slot of a bounded lock-free
+ * queue (Vyukov's bounded MPMC queue, used with a single consumer), and a writer thread adds the
+ * timestamps and writes the lines out in batches. */
+#define LOG_RING_SIZE 128 /* must be a power of two */
+#define LOG_MSG_MAX 1024
+#define LOG_BATCH_SIZE (64 * 1024)
+#define LOG_FULL_RETRIES 1000 /* yields while the queue is full before writing synchronously */
+
+/* Size-capped rotation: yawl.log -> yawl.log.1[.zst] -> ... -> yawl.log.LOG_ROTATE_KEEP[.zst] */
+#define LOG_DEFAULT_MAX_SIZE (16ULL * 1024 * 1024)
+#define LOG_ROTATE_KEEP 3
+#define LOG_ZSTD_LEVEL 3
+#define LOG_ZSTD_BUFFER_SIZE (64 * 1024)
+
+#define NS_PER_SEC 1000000000ULL
+
+static_assert((LOG_RING_SIZE & (LOG_RING_SIZE - 1)) == 0, "LOG_RING_SIZE must be a power of two");
+
+/* Everything about a message except its text */
+struct log_record {
+    uint64_t wall_ns;
+    uint64_t mono_ns;
+    Level level;
+    const char *file;
+    int line;
+    bool has_result;
+    RESULT result;
+};
+
+struct log_slot {
+    std::atomic<size_t> seq;
+    struct log_record rec;
+    char *long_text; /* heap copy for messages that don't fit into text */
+    char text[LOG_MSG_MAX];
+};
+
+static char *log_path = nullptr;
+static bool log_json = false;
+static uint64_t log_max_size = LOG_DEFAULT_MAX_SIZE;
+static bool log_compress = false;
+
+static log_slot log_ring[LOG_RING_SIZE];
+static std::atomic<size_t> enqueue_pos = 0;
+static std::atomic<size_t> written_pos = 0;
+static std::atomic<uint32_t> writer_wake = 0;
+static std::atomic<bool> writer_stop = false;
+static std::atomic<bool> async_active = false;
+static pthread_t writer_thread;
+
+/* Consumer state, only touched by whoever holds consumer_busy (the writer thread, or a crash handler) */
+static std::atomic<bool> consumer_busy = false;
+static size_t dequeue_pos = 0;
+static char batch[LOG_BATCH_SIZE];
+static time_t cached_sec = -1;
+static int crash_fd = -1; /* fileno(log_file), for the crash handler */
+static char cached_timestamp[32];
+
+static uint64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * NS_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+static const char *base_filename(const char *file) {
+    /* Get just the filename without the path */
+    const char *filename = strrchr(file, '/');
+    return filename ? filename + 1 : file;
+}
+
+static void format_timestamp(time_t now, char timestamp[32]) {
+    struct tm tm_info;
+    localtime_r(&now, &tm_info);
+    strftime(timestamp, 32, "%Y-%m-%d %H:%M:%S", &tm_info);
+}
+
+/* Bounded appender with snprintf() semantics: `len` keeps counting past `size`, so the caller can tell
+ * how much space the whole line needs */
+struct line_buf {
+    char *buf;
+    size_t size;
+    size_t len;
+};
+
+[[gnu::format(printf, 2, 3)]] static void line_printf(struct line_buf *lb, const char *format, ...) {
+    size_t off = lb->len < lb->size ? lb->len : lb->size;
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(lb->buf + off, lb->size - off, format, args);
+    va_end(args);
+    if (n > 0)
+        lb->len += n;
+}
+
+static void line_putc(struct line_buf *lb, char c) {
+    if (lb->len + 1 < lb->size) {
+        lb->buf[lb->len] = c;
+        lb->buf[lb->len + 1] = '\0';
+    }
+    lb->len++;
+}
+
+static void line_json_string(struct line_buf *lb, const char *str) {
+    line_putc(lb, '"');
+    for (const unsigned char *p = (const unsigned char *)str; *p; p++) {
+        switch (*p) {
+        case '"':
+        case '\\':
+            line_putc(lb, '\\');
+            line_putc(lb, (char)*p);
+            break;
+        case '\n':
+            line_printf(lb, "\\n");
+            break;
+        case '\t':
+            line_printf(lb, "\\t");
+            break;
+        case '\r':
+            line_printf(lb, "\\r");
+            break;
+        default:
+            if (*p < 0x20)
+                line_printf(lb, "\\u%04x", *p);
+            else
+                line_putc(lb, (char)*p);
+        }
+    }
+    line_putc(lb, '"');
+}
+
+/* Format one log line (text, or a JSON object with YAWL_LOG_FORMAT=json) into `buf`, including the newline.
+ * Returns the length of the whole line, which is >= size if it didn't fit (like snprintf()) */
+static size_t format_line(char *buf, size_t size, const char *timestamp, const struct log_record *rec,
+                          const char *text) {
+    struct line_buf lb = {buf, size, 0};
+    if (size)
+        buf[0] = '\0';
+
+    if (!log_json) {
+        line_printf(&lb, "[%s] %s %s:%d: %s\n", level_strings[(size_t)(rec->level)], timestamp,
+                    base_filename(rec->file), rec->line, text);
+        return lb.len;
+    }
+
+    line_printf(&lb, "{\"time_ns\":%llu,\"mono_ns\":%llu,\"pid\":%d,\"level\":\"%s\",\"file\":",
+                (unsigned long long)rec->wall_ns, (unsigned long long)rec->mono_ns, (int)getpid(),
+                level_strings[(size_t)(rec->level)]);
+    line_json_string(&lb, base_filename(rec->file));
+    line_printf(&lb, ",\"line\":%d,\"msg\":", rec->line);
+    line_json_string(&lb, text);
+    if (rec->has_result)
+        line_printf(&lb, ",\"result\":{\"value\":\"0x%08X\",\"severity\":%d,\"category\":%d,\"code\":%d}",
+                    (unsigned)rec->result, (int)RESULT_SEVERITY(rec->result), (int)RESULT_CATEGORY(rec->result),
+                    (int)RESULT_CODE(rec->result));
+    line_printf(&lb, "}\n");
+
+    return lb.len;
+}
+
+/* Session start/end markers */
+static void write_marker(const char *event) {
+    uint64_t wall_ns = clock_ns(CLOCK_REALTIME);
+    char line[256];
+
+    if (log_json) {
+        snprintf(line, sizeof(line), "{\"time_ns\":%llu,\"mono_ns\":%llu,\"pid\":%d,\"event\":\"session_%s\"}\n",
+                 (unsigned long long)wall_ns, (unsigned long long)clock_ns(CLOCK_MONOTONIC), (int)getpid(), event);
+    } else {
+        char time_str[32];
+        format_timestamp((time_t)(wall_ns / NS_PER_SEC), time_str);
+        snprintf(line, sizeof(line), "=== Log session %s at %s ===\n%s", event, time_str,
+                 STRING_EQUALS(event, "ended") ? "\n" : "");
+    }
+
+    write_all(fileno(log_file), line, strlen(line));
+}
+
+/* Compress a rotated segment to `path`.zst and remove the original */
+static void compress_segment(const char *path) {
+    static char in_buf[LOG_ZSTD_BUFFER_SIZE];
+    static char out_buf[LOG_ZSTD_BUFFER_SIZE];
+    char zst_path[PATH_MAX], tmp_path[PATH_MAX];
+
+    snprintf(zst_path, sizeof(zst_path), "%s.zst", path);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.zst.tmp", path);
+
+    autoclosefd int in_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (in_fd < 0)
+        return;
+    autoclosefd int out_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out_fd < 0)
+        return;
+
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    if (!cctx) {
+        unlink(tmp_path);
+        return;
+    }
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, LOG_ZSTD_LEVEL);
+
+    bool ok = true;
+    for (bool eof = false; ok && !eof;) {
+        ssize_t n = read(in_fd, in_buf, sizeof(in_buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            ok = false;
+            break;
+        }
+        eof = (n == 0);
+
+        ZSTD_inBuffer input = {in_buf, (size_t)n, 0};
+        ZSTD_EndDirective mode = eof ? ZSTD_e_end : ZSTD_e_continue;
+        for (;;) {
+            ZSTD_outBuffer output = {out_buf, sizeof(out_buf), 0};
+            size_t remaining = ZSTD_compressStream2(cctx, &output, &input, mode);
+            if (ZSTD_isError(remaining)) {
+                ok = false;
+                break;
+            }
+            write_all(out_fd, out_buf, output.pos);
+            if (eof ? remaining == 0 : input.pos == input.size)
+                break;
+        }
+    }
+    ZSTD_freeCCtx(cctx);
+
+    if (ok && rename(tmp_path, zst_path) == 0)
+        unlink(path);
+    else
+        unlink(tmp_path);
+}
+
+/* Point the log file's descriptor at a fresh file at log_path. The FILE stays the same, so nothing
+ * else has to know about it. */
+static void reopen_log_file(void) {
+    int fd = open(log_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return;
+    dup2(fd, fileno(log_file));
+    close(fd);
+}
+
+/* Rotate the log once it grows past log_max_size. Other yawl processes may be appending to the same
+ * file: the rotation itself happens under flock(), and a process that finds its file was rotated
+ * away just reopens the path. Only called by the writer thread. */
+static void rotate_if_needed(void) {
+    int fd = fileno(log_file);
+    struct stat fd_st, path_st;
+
+    if (fstat(fd, &fd_st) < 0)
+        return;
+    if (stat(log_path, &path_st) < 0 || path_st.st_ino != fd_st.st_ino || path_st.st_dev != fd_st.st_dev) {
+        reopen_log_file();
+        return;
+    }
+    if ((uint64_t)fd_st.st_size < log_max_size)
+        return;
+
+    /* If someone else holds it, they're rotating and we'll notice next time */
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0)
+        return;
+
+    if (stat(log_path, &path_st) == 0 && path_st.st_ino == fd_st.st_ino && path_st.st_dev == fd_st.st_dev) {
+        char from[PATH_MAX], to[PATH_MAX];
+
+        for (int i = LOG_ROTATE_KEEP; i >= 1; i--) {
+            for (const char *suffix : {"", ".zst"}) {
+                snprintf(from, sizeof(from), "%s.%d%s", log_path, i, suffix);
+                if (i == LOG_ROTATE_KEEP) {
+                    unlink(from);
+                    continue;
+                }
+                snprintf(to, sizeof(to), "%s.%d%s", log_path, i + 1, suffix);
+                rename(from, to);
+            }
+        }
+
+        snprintf(to, sizeof(to), "%s.1", log_path);
+        if (rename(log_path, to) == 0) {
+            flock(fd, LOCK_UN);
+            reopen_log_file();
+            if (log_compress)
+                compress_segment(to);
+            return;
+        }
+    }
+
+    flock(fd, LOCK_UN);
+}
+
+/* Write out everything that's been published so far. Returns false if `wait` is false and
+ * someone else is already consuming. */
+static bool log_drain(bool wait) {
+    while (consumer_busy.exchange(true, std::memory_order_acquire)) {
+        if (!wait)
+            return false;
+        sched_yield();
+    }
+
+    int fd = fileno(log_file);
+    size_t used = 0;
+
+    for (;;) {
+        log_slot *slot = &log_ring[dequeue_pos & (LOG_RING_SIZE - 1)];
+        if (slot->seq.load(std::memory_order_acquire) != dequeue_pos + 1)
+            break; /* empty, or the next message is still being formatted */
+
+        /* Messages come in bursts within the same second, so localtime_r/strftime rarely run */
+        time_t sec = (time_t)(slot->rec.wall_ns / NS_PER_SEC);
+        if (!log_json && sec != cached_sec) {
+            format_timestamp(sec, cached_timestamp);
+            cached_sec = sec;
+        }
+
+        const char *text = slot->long_text ? slot->long_text : slot->text;
+        for (int attempt = 0; attempt < 2; attempt++) {
+            size_t avail = sizeof(batch) - used;
+            size_t n = format_line(batch + used, avail, cached_timestamp, &slot->rec, text);
+            if (n < avail) {
+                used += n;
+                break;
+            }
+            if (used == 0) {
+                /* Longer than a whole batch, write it truncated */
+                batch[sizeof(batch) - 2] = '\n';
+                used = sizeof(batch) - 1;
+                break;
+            }
+            write_all(fd, batch, used);
+            used = 0;
+        }
+
+        free(slot->long_text);
+        slot->long_text = nullptr;
+        slot->seq.store(dequeue_pos + LOG_RING_SIZE, std::memory_order_release);
+        dequeue_pos++;
+    }
+
+    if (used)
+        write_all(fd, batch, used);
+
+    written_pos.store(dequeue_pos, std::memory_order_release);
+    written_pos.notify_all();
+    consumer_busy.store(false, std::memory_order_release);
+    return true;
+}
+
+static void wake_writer(void) {
+    writer_wake.fetch_add(1, std::memory_order_release);
+    writer_wake.notify_one();
+}
+
+static void *log_writer(void *) {
+    for (;;) {
+        uint32_t wake = writer_wake.load(std::memory_order_acquire);
+        log_drain(true);
+        if (log_max_size)
+            rotate_if_needed();
+        if (writer_stop.load(std::memory_order_acquire) &&
+            written_pos.load(std::memory_order_acquire) == enqueue_pos.load(std::memory_order_acquire))
+            break;
+        writer_wake.wait(wake, std::memory_order_acquire);
+    }
+    return nullptr;
+}
+
+/* Format a message into the next free slot. Returns false if the queue stayed full. */
+static bool log_enqueue(const struct log_record *rec, const char *format, va_list args) {
+    log_slot *slot;
+    size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+
+    for (int retries = 0;;) {
+        slot = &log_ring[pos & (LOG_RING_SIZE - 1)];
+        size_t seq = slot->seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            /* Full: let the writer catch up */
+            if (++retries > LOG_FULL_RETRIES)
+                return false;
+            wake_writer();
+            sched_yield();
+            pos = enqueue_pos.load(std::memory_order_relaxed);
+        } else {
+            pos = enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+
+    va_list args_copy;
+    va_copy(args_copy, args);
+    int len = vsnprintf(slot->text, sizeof(slot->text), format, args);
+    if (len >= (int)sizeof(slot->text) && vasprintf(&slot->long_text, format, args_copy) < 0)
+        slot->long_text = nullptr;
+    va_end(args_copy);
+
+    slot->rec = *rec;
+
+    slot->seq.store(pos + 1, std::memory_order_release);
+    wake_writer();
+    return true;
+}
+
+static void log_write_sync(const struct log_record *rec, const char *format, va_list args) {
+    autofree char *text = nullptr;
+    if (vasprintf(&text, format, args) < 0)
+        return;
+
+    char timestamp[32];
+    format_timestamp((time_t)(rec->wall_ns / NS_PER_SEC), timestamp);
+
+    char line[LOG_MSG_MAX + 256];
+    size_t len = format_line(line, sizeof(line), timestamp, rec, text);
+    if (len < sizeof(line)) {
+        write_all(fileno(log_file), line, len);
+        return;
+    }
+
+    autofree char *long_line = (char *)malloc(len + 1);
+    if (!long_line)
+        return;
+    format_line(long_line, len + 1, timestamp, rec, text);
+    write_all(fileno(log_file), long_line, len);
+}
+
+void log_flush(void) {
+    if (!async_active.load(std::memory_order_acquire))
+        return;
+
+    size_t target = enqueue_pos.load(std::memory_order_acquire);
+    wake_writer();
+
+    size_t done;
+    while ((done = written_pos.load(std::memory_order_acquire)) < target)
+        written_pos.wait(done, std::memory_order_acquire);
+}
+
+/* Write a queued message as "[LEVEL] file:line: text" with nothing but write(2): no timestamp (localtime_r
+ * and snprintf aren't async-signal-safe), and the same plain format in JSON mode */
+static void crash_write_slot(int fd, const log_slot *slot) {
+    char digits[12];
+    size_t pos = sizeof(digits);
+    unsigned line = (unsigned)slot->rec.line;
+    do {
+        digits[--pos] = (char)('0' + line % 10);
+        line /= 10;
+    } while (line && pos > 0);
+
+    const char *level = level_strings[(size_t)(slot->rec.level)];
+    const char *file = base_filename(slot->rec.file);
+    const char *text = slot->long_text ? slot->long_text : slot->text;
+
+    write_all(fd, "[", 1);
+    write_all(fd, level, strlen(level));
+    write_all(fd, "] ", 2);
+    write_all(fd, file, strlen(file));
+    write_all(fd, ":", 1);
+    write_all(fd, digits + pos, sizeof(digits) - pos);
+    write_all(fd, ": ", 2);
+    write_all(fd, text, strlen(text));
+    write_all(fd, "\n", 1);
+}
+
+/* Get whatever is still queued to disk before dying. The writer could be the crashing thread (or in the
+ * middle of a batch), so only wait for it briefly. Everything here must be async-signal-safe: the slots are
+ * written out one by one and never freed, the process is about to die anyway. */
+static void log_crash_handler(int sig) {
+    if (async_active.load(std::memory_order_acquire)) {
+        static const struct timespec delay = {0, 1000000};
+        bool claimed = false;
+        for (int i = 0; i < 100 && !(claimed = !consumer_busy.exchange(true, std::memory_order_acquire)); i++)
+            nanosleep(&delay, nullptr);
+
+        if (claimed) {
+            for (;; dequeue_pos++) {
+                const log_slot *slot = &log_ring[dequeue_pos & (LOG_RING_SIZE - 1)];
+                if (slot->seq.load(std::memory_order_acquire) != dequeue_pos + 1)
+                    break;
+                crash_write_slot(crash_fd, slot);
+            }
+        }
+    }
+    /* SA_RESETHAND restored the default action */
+    raise(sig);
+}
+
+/* Don't fork while messages are in flight, and log synchronously in the child (the writer isn't there) */
+static void log_atfork_prepare(void) { log_flush(); }
+
+static void log_atfork_child(void) {
+    async_active.store(false, std::memory_order_release);
+    consumer_busy.store(false, std::memory_order_release);
+}
+
+static void log_start_writer(void) {
+    static bool registered = false;
+
+    for (size_t i = 0; i < LOG_RING_SIZE; i++)
+        log_ring[i].seq.store(i, std::memory_order_relaxed);
+    enqueue_pos.store(0, std::memory_order_relaxed);
+    written_pos.store(0, std::memory_order_relaxed);
+    writer_stop.store(false, std::memory_order_relaxed);
+    dequeue_pos = 0;
+    crash_fd = fileno(log_file);
+
+    /* The writer must never take signals meant for the main thread (e.g. the supervisor's sigwaitinfo()) */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int ret = pthread_create(&writer_thread, nullptr, log_writer, nullptr);
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+    if (ret != 0)
+        return; /* just stay synchronous */
+
+    async_active.store(true, std::memory_order_release);
+
+    if (!registered) {
+        registered = true;
+        pthread_atfork(log_atfork_prepare, nullptr, log_atfork_child);
+        atexit(log_flush);
+
+        struct sigaction sa = {};
+        sa.sa_handler = log_crash_handler;
+        sa.sa_flags = SA_RESETHAND | SA_NODEFER;
+        sigemptyset(&sa.sa_mask);
+        for (int sig : {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT})
+            sigaction(sig, &sa, nullptr);
+    }
+}
+
+/* Parse a size like "16M" (K/M/G suffixes, binary units) */
+static uint64_t parse_size(const char *str, uint64_t fallback) {
+    char *end = nullptr;
+    errno = 0;
+    unsigned long long value = strtoull(str, &end, 10);
+    if (errno || end == str)
+        return fallback;
+
+    switch (*end) {
+    case 'g':
+    case 'G':
+        value *= 1024;
+        [[fallthrough]];
+    case 'm':
+    case 'M':
+        value *= 1024;
+        [[fallthrough]];
+    case 'k':
+    case 'K':
+        value *= 1024;
+        end++;
+        break;
+    default:
+        break;
+    }
+
+    return *end ? fallback : value;
+}
+
 /* Parse log level from string */
 static Level parse_log_level(const char *level_str) {
     if (!level_str ||
@@ -65,7 +637,7 @@ static Level parse_log_level(const char *level_str) {
 }
 
 RESULT log_init(void) {
-    char *log_file_path = nullptr;
+    TRACE_SCOPE("log_init");
     terminal_output = !!isatty(STDOUT_FILENO);
 
     /* From the ctime(3) docs:
@@ -78,58 +650,79 @@ RESULT log_init(void) {
     if (log_level_env)
         log_set_level(parse_log_level(log_level_env));
 
-    notify_initialized = notify_init(PROG_NAME);
+    {
+        TRACE_SCOPE("notify_init");
+        notify_initialized = notify_init(PROG_NAME);
+    }
 
     if (current_log_level == Level::None)
         return MAKE_RESULT(SEV_SUCCESS, CAT_CONFIG, E_CANCELED);
 
+    const char *log_format_env = getenv("YAWL_LOG_FORMAT");
+    log_json = log_format_env && LCSTRING_EQUALS(log_format_env, "json");
+
+    const char *log_max_size_env = getenv("YAWL_LOG_MAX_SIZE");
+    if (log_max_size_env)
+        log_max_size = parse_size(log_max_size_env, LOG_DEFAULT_MAX_SIZE);
+
+    const char *log_compress_env = getenv("YAWL_LOG_COMPRESS");
+    log_compress = log_compress_env && LCSTRING_EQUALS(log_compress_env, "zstd");
+
+    free(log_path);
+    log_path = nullptr;
+
     const char *log_file_env = getenv("YAWL_LOG_FILE");
     if (log_file_env)
-        log_file_path = strdup(log_file_env);
+        log_path = strdup(log_file_env);
     else
-        join_paths(log_file_path, config::yawl_dir, PROG_NAME ".log");
+        join_paths(log_path, config::yawl_dir, PROG_NAME ".log");
 
-    if (log_file_path || !terminal_output) {
-        log_file = fopen(log_file_path, "a");
+    if (log_path || !terminal_output) {
+        log_file = fopen(log_path, "a");
         if (!log_file) {
             /* Fall back to stderr if file can't be opened */
             fmt::fprintf(stderr, "Failed to open log file: %s\n", strerror(errno));
-            free(log_file_path);
+            free(log_path);
+            log_path = nullptr;
 
             RESULT result = result_from_errno();
             LOG_RESULT(Level::Error, result, "Failed to open log file");
             return result;
         }
 
-        time_t now = time(nullptr);
-        struct tm tm_info;
-        localtime_r(&now, &tm_info);
-        char time_str[64];
-        strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", &tm_info);
-
-        fmt::fprintf(log_file, "=== Log session started at %s ===\n", time_str);
-        fflush(log_file);
+        write_marker("started");
     }
 
-    free(log_file_path);
     return RESULT_OK;
 }
 
-void log_cleanup(void) {
-    if (log_file) {
-        /* Write session end marker */
-        time_t now = time(nullptr);
-        struct tm tm_info;
-        localtime_r(&now, &tm_info);
-        char time_str[64];
-        strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", &tm_info);
+void log_start_async(void) {
+    if (log_file && !async_active.load(std::memory_order_acquire))
+        log_start_writer();
+}
+
+static void log_stop_writer(void) {
+    if (!async_active.load(std::memory_order_acquire))
+        return;
 
-        fmt::fprintf(log_file, "=== Log session ended at %s ===\n\n", time_str);
-        fflush(log_file);
+    log_flush();
+    writer_stop.store(true, std::memory_order_release);
+    wake_writer();
+    pthread_join(writer_thread, nullptr);
+    async_active.store(false, std::memory_order_release);
+}
 
+void log_cleanup(void) {
+    log_stop_writer();
+
+    if (log_file) {
+        write_marker("ended");
         fclose(log_file);
         log_file = nullptr;
     }
+
+    free(log_path);
+    log_path = nullptr;
 }
 
 void log_set_level(Level level) {
@@ -141,20 +734,21 @@ Level log_get_level(void) { return current_log_level; }
 
 bool log_get_terminal_output(void) { return terminal_output; }
 
-void _log_message(Level level, const char *file, int line, const char *format, ...) {
+static void log_messagev(Level level, const char *file, int line, const RESULT *result, const char *format,
+                         va_list args) {
     if (level > current_log_level && level != Level::System)
         return;
 
-    va_list args;
+    va_list args_copy;
 
     if (level == Level::System && notify_initialized) {
         NotifyNotification *notif;
         char *message = nullptr;
 
-        va_start(args, format);
-        if (!vasprintf(&message, format, args)) {
+        va_copy(args_copy, args);
+        if (!vasprintf(&message, format, args_copy)) {
         } /* glibc compatibility */
-        va_end(args);
+        va_end(args_copy);
 
         notif = notify_notification_new(PROG_NAME, message, "dialog-information");
 
@@ -174,43 +768,58 @@ void _log_message(Level level, const char *file, int line, const char *format, .
     if (terminal_output) {
         FILE *output = (level <= Level::Warning) ? stderr : stdout;
 
+        /* Keep lines from the startup tasks' threads in one piece */
+        flockfile(output);
         fmt::fprintf(output, "%s[%s]%s ", level_colors[(size_t)(level)],
                      level_strings[(size_t)(level)], COLOR_RESET);
 
-        va_start(args, format);
-        vfprintf(output, format, args);
-        va_end(args);
+        va_copy(args_copy, args);
+        vfprintf(output, format, args_copy);
+        va_end(args_copy);
 
         fmt::fprintf(output, "\n");
+        funlockfile(output);
     }
 
     if (log_file && level != Level::System && level != Level::Progress) {
-        char timestamp[32];
-        time_t now = time(nullptr);
-
-        /* Create timestamp */
-        struct tm tm_info;
-        localtime_r(&now, &tm_info);
-        strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", &tm_info);
-
-        /* Get just the filename without the path */
-        const char *filename = strrchr(file, '/');
-        if (filename)
-            filename++; /* Skip the slash */
-        else
-            filename = file;
-
-        fmt::fprintf(log_file, "[%s] %s %s:%d: ", level_strings[(size_t)(level)], timestamp, filename, line);
+        struct log_record rec = {clock_ns(CLOCK_REALTIME), clock_ns(CLOCK_MONOTONIC), level, file, line,
+                                 result != nullptr, result ? *result : RESULT_OK};
+        bool queued = false;
+
+        if (async_active.load(std::memory_order_acquire)) {
+            va_copy(args_copy, args);
+            queued = log_enqueue(&rec, format, args_copy);
+            va_end(args_copy);
+        }
 
-        va_start(args, format);
-        vfprintf(log_file, format, args);
-        va_end(args);
+        if (!queued) {
+            va_copy(args_copy, args);
+            log_write_sync(&rec, format, args_copy);
+            va_end(args_copy);
+        }
 
-        fmt::fprintf(log_file, "\n");
-        fflush(log_file);
+        /* Errors often come right before an exit or exec, make sure they hit the file */
+        if (queued && level == Level::Error)
+            log_flush();
     }
 }
 
+void _log_message(Level level, const char *file, int line, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    log_messagev(level, file, line, nullptr, format, args);
+    va_end(args);
+}
+
+/* Like _log_message(), but the structured log also gets the decoded RESULT */
+[[gnu::format(printf, 5, 6)]] static void log_result_message(Level level, const char *file, int line, RESULT result,
+                                                             const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    log_messagev(level, file, line, &result, format, args);
+    va_end(args);
+}
+
 void _log_result(Level level, const char *file, int line, RESULT result, const char *context) {
     if (SUCCEEDED(result) && level < Level::Debug)
         return;
@@ -221,11 +830,12 @@ void _log_result(Level level, const char *file, int line, RESULT result, const c
 
     /* Provide context */
     if (context && context[0] != '\0')
-        _log_message(level, file, line, "%s: %s (0x%08X)", context, result_str, (unsigned)result);
+        log_result_message(level, file, line, result, "%s: %s (0x%08X)", context, result_str, (unsigned)result);
     else
-        _log_message(level, file, line, "Result: %s (0x%08X)", result_str, (unsigned)result);
+        log_result_message(level, file, line, result, "Result: %s (0x%08X)", result_str, (unsigned)result);
 
-    if (current_log_level == Level::Debug) {
+    /* The JSON log has these in the "result" object already */
+    if (current_log_level == Level::Debug && !log_json) {
         const int severity = RESULT_SEVERITY(result);
         const int category = RESULT_CATEGORY(result);
         const int code = RESULT_CODE(result);
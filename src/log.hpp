@@ -11,6 +11,7 @@
 
 #include <unistd.h>
 
+#include "config.h"
 #include "result.hpp"
 
 enum class Level : uint8_t {
@@ -23,12 +24,37 @@ enum class Level : uint8_t {
     Progress = 6 /* Terminal-only progress display */
 };
 
+/* Most verbose level compiled in (configure --with-max-log-level), messages above it compile to nothing */
+#ifndef YAWL_MAX_LOG_LEVEL
+#define YAWL_MAX_LOG_LEVEL 5 /* Level::Debug */
+#endif
+
+static constexpr Level log_max_compiled_level = (Level)YAWL_MAX_LOG_LEVEL;
+
+/* Current runtime level (for internal use, see log_get_level()) */
+extern Level current_log_level;
+
+static constexpr inline bool log_level_compiled(Level level) {
+    return level == Level::System || level <= log_max_compiled_level;
+}
+
+static inline bool log_level_enabled(Level level) {
+    return level == Level::System || level <= current_log_level;
+}
+
 /* Initialize the logging subsystem */
 RESULT log_init(void); /* Changed return type from int to RESULT */
 
-/* Cleanup logging resources */
+/* Cleanup logging resources (flushes and stops the log writer thread, call it before execv) */
 void log_cleanup(void);
 
+/* Wait until everything logged so far has been written to the log file */
+void log_flush(void);
+
+/* Hand the log file writes to a background writer thread from now on. Until then, log_init() writes
+ * synchronously, so that main() stays single-threaded for as long as it needs to (e.g. unshare(CLONE_NEWUSER)) */
+void log_start_async(void);
+
 /* Set the maximum log level to display */
 void log_set_level(Level level);
 
@@ -50,12 +76,27 @@ void log_progress(const char *operation, double percentage, int bytes_done, int
 /* Finish progress display with newline */
 void log_progress_end(void);
 
-/* Convenience macros that include file and line information */
-#define LOG_SYSTEM(...) _log_message(Level::System, __FILE__, __LINE__, __VA_ARGS__)
-#define LOG_ERROR(...) _log_message(Level::Error, __FILE__, __LINE__, __VA_ARGS__)
-#define LOG_WARNING(...) _log_message(Level::Warning, __FILE__, __LINE__, __VA_ARGS__)
-#define LOG_INFO(...) _log_message(Level::Info, __FILE__, __LINE__, __VA_ARGS__)
-#define LOG_DEBUG(...) _log_message(Level::Debug, __FILE__, __LINE__, __VA_ARGS__)
+/* Convenience macros that include file and line information.
+ * The arguments are only evaluated if the message is going to be shown, and messages above
+ * YAWL_MAX_LOG_LEVEL are discarded at compile time (along with their format strings). */
+#define _LOG_AT(level, ...)                                                                                            \
+    do {                                                                                                               \
+        if constexpr (log_level_compiled(level)) {                                                                     \
+            if (log_level_enabled(level))                                                                              \
+                _log_message(level, __FILE__, __LINE__, __VA_ARGS__);                                                  \
+        }                                                                                                              \
+    } while (0)
+
+#define LOG_SYSTEM(...) _LOG_AT(Level::System, __VA_ARGS__)
+#define LOG_ERROR(...) _LOG_AT(Level::Error, __VA_ARGS__)
+#define LOG_WARNING(...) _LOG_AT(Level::Warning, __VA_ARGS__)
+#define LOG_INFO(...) _LOG_AT(Level::Info, __VA_ARGS__)
+#define LOG_DEBUG(...) _LOG_AT(Level::Debug, __VA_ARGS__)
 
-#define LOG_RESULT(level, result, context) _log_result(level, __FILE__, __LINE__, result, context)
-#define LOG_DEBUG_RESULT(result, context) _log_result(Level::Debug, __FILE__, __LINE__, result, context)
+/* `level` doesn't have to be a constant here, the compiler still drops the call if it is one */
+#define LOG_RESULT(level, result, context)                                                                             \
+    do {                                                                                                               \
+        if (log_level_compiled(level) && log_level_enabled(level))                                                     \
+            _log_result(level, __FILE__, __LINE__, result, context);                                                   \
+    } while (0)
+#define LOG_DEBUG_RESULT(result, context) LOG_RESULT(Level::Debug, result, context)
@@ -11,6 +11,7 @@
 
 #include <cstdio>
 #include <cstdlib>
+#include <dirent.h>
 #include <unistd.h>
 
 
@@ -46,9 +47,29 @@ static forceinline void cleanup_unlink_and_free(void *p) {
     *path = nullptr;
 }
 
+/* Cleanup function for DIR pointers */
+static forceinline void cleanup_dir(void *p) {
+    DIR **dp = (DIR **)p;
+    if (dp && *dp) {
+        closedir(*dp);
+        *dp = nullptr;
+    }
+}
+
+/* Cleanup function for file descriptors */
+static forceinline void cleanup_fd(void *p) {
+    int *fd = (int *)p;
+    if (fd && *fd >= 0) {
+        close(*fd);
+        *fd = -1;
+    }
+}
+
 #define autofree [[gnu::cleanup(cleanup_pointer)]]
 #define autoclose [[gnu::cleanup(cleanup_file)]]
 #define autofree_del [[gnu::cleanup(cleanup_unlink_and_free)]]
+#define autoclosedir [[gnu::cleanup(cleanup_dir)]]
+#define autoclosefd [[gnu::cleanup(cleanup_fd)]]
 
 #define nonnull_charp [[gnu::nonnull]] const char *_Nonnull
 
@@ -40,6 +40,7 @@
 #include <ctime>
 #include <unistd.h>
 
+#include <poll.h>
 #include <sys/ioctl.h>
 #include <sys/prctl.h>
 #include <sys/syscall.h>
@@ -142,6 +143,7 @@ static inline int pidfd_getfd(int pidfd __attribute__((unused)), int targetfd __
 #include "log.hpp"
 #include "nsenter.hpp"
 #include "macros.hpp"
+#include "util.hpp"
 
 #define LOG_ERROR_AND_RETURN(...)                                                                                      \
     do {                                                                                                               \
@@ -369,7 +371,7 @@ static int do_setns(int fd, int ns, const char *name, bool ignore_errors) {
 static void enter_namespaces(int pid_fd, int namespaces, bool ignore_errors) {
     struct namespace_file *n = NULL;
 
-    if (pid_fd) {
+    if (pid_fd >= 0) {
         int ns = 0;
         while ((n = next_enabled_nsfile(n, namespaces))) {
             if (n->fd < 0)
@@ -388,6 +390,37 @@ static void enter_namespaces(int pid_fd, int namespaces, bool ignore_errors) {
     }
 }
 
+/* yawl: enter every namespace that wasn't given as a file with a single setns() on the pidfd (Linux 5.8+).
+ * The kernel switches all of them at once and enters the user namespace in the right order by itself,
+ * so there's no need for the two passes below. Returns false if the kernel doesn't accept a pidfd here. */
+static bool enter_namespaces_pidfd(int pid_fd, int namespaces) {
+    struct namespace_file *n = NULL;
+    int ns = 0;
+
+    while ((n = next_enabled_nsfile(n, namespaces))) {
+        if (n->fd < 0)
+            ns |= n->nstype;
+    }
+    if (!ns)
+        return true;
+
+    if (setns(pid_fd, ns) == 0) {
+        disable_namespaces(ns);
+        return true;
+    }
+
+    if (errno != EINVAL)
+        err(EXIT_FAILURE, "reassociate to namespaces failed");
+    return false;
+}
+
+/* yawl: whether the process behind `pid_fd` is gone, i.e. anything opened through /proc/PID since could
+ * belong to a different process that reused its PID */
+static bool pidfd_exited(int pid_fd) {
+    struct pollfd pfd = {pid_fd, POLLIN, 0};
+    return poll(&pfd, 1, 0) > 0;
+}
+
 static void open_parent_user_ns_fd(int pid_fd) {
     struct namespace_file *user = NULL;
     int fd = -1, parent_fd = -1;
@@ -476,24 +509,6 @@ static int get_ns_ino(const char *path, ino_t *ino) {
     return 0;
 }
 
-static inline int write_all(int fd, const void *buf, size_t count) {
-    while (count) {
-        ssize_t tmp;
-
-        errno = 0;
-        tmp = write(fd, buf, count);
-        if (tmp > 0) {
-            count -= tmp;
-            if (count)
-                buf = (const void *)((const char *)buf + tmp);
-        } else if (errno != EINTR && errno != EAGAIN)
-            return -1;
-        if (errno == EAGAIN) /* Try later, *sigh* */
-            nanosleep(&smallwaittime, NULL);
-    }
-    return 0;
-}
-
 static inline ssize_t read_all(int fd, char *buf, size_t count) {
     ssize_t ret;
     ssize_t c = 0;
@@ -1117,7 +1132,7 @@ static void cap_permitted_to_ambient(void) {
     }
 }
 
-int do_nsenter(int argc, char *argv[], unsigned long pid_to_enter) {
+int do_nsenter(int argc, char *argv[], unsigned long pid_to_enter, int pid_to_enter_fd) {
     enum {
         OPT_PRESERVE_CRED = CHAR_MAX + 1,
         OPT_KEEPCAPS,
@@ -1162,7 +1177,7 @@ int do_nsenter(int argc, char *argv[], unsigned long pid_to_enter) {
     gid_t gid = 0;
     int keepcaps = 0;
     int sock_fd = -1;
-    int pid_fd = -1;
+    int pid_fd = pid_to_enter_fd;
 
     /* yawl: do --preserve-credentials --user --mount by default (unless `enter=1` is specified) */
     if (pid_to_enter > 1) {
@@ -1284,6 +1299,10 @@ int do_nsenter(int argc, char *argv[], unsigned long pid_to_enter) {
         if (!namespace_target_pid)
             LOG_ERROR_RET_MINUSONE("no target PID specified");
 
+        /* Pin the target, so it can't be replaced by a reused PID while we're entering it (Linux 5.3+) */
+        if (pid_fd < 0)
+            pid_fd = pidfd_open(namespace_target_pid, 0);
+
         if (pid_fd < 0 && namespaces)
             open_namespaces(namespaces); /* fallback */
     }
@@ -1311,6 +1330,10 @@ int do_nsenter(int argc, char *argv[], unsigned long pid_to_enter) {
     if (sock_fd >= 0)
         open_target_sk_netns(pid_fd, sock_fd);
 
+    /* The root/cwd/environ files above still come from /proc, make sure they belong to the pinned process */
+    if (pid_fd >= 0 && pidfd_exited(pid_fd))
+        LOG_ERROR_RET_MINUSONE("target process exited");
+
     /* All initialized, get final set of namespaces */
     namespaces = get_namespaces();
     if (!namespaces)
@@ -1330,6 +1353,15 @@ int do_nsenter(int argc, char *argv[], unsigned long pid_to_enter) {
             setgroups_nerrs++;
     }
 
+    /* yawl: everything not given as a file goes through one atomic setns() on the pidfd, with the
+     * per-file /proc/PID/ns path as a fallback for kernels before 5.8 */
+    if (pid_fd >= 0 && !enter_namespaces_pidfd(pid_fd, namespaces)) {
+        open_namespaces(get_namespaces_without_fd());
+        if (pidfd_exited(pid_fd))
+            LOG_ERROR_RET_MINUSONE("target process exited");
+    }
+    namespaces = get_namespaces();
+
     /*
      * Now that we know which namespaces we want to enter, enter them.  Do
      * this in two passes, not entering the user namespace on the first
@@ -1337,11 +1369,12 @@ int do_nsenter(int argc, char *argv[], unsigned long pid_to_enter) {
      * namespace last and if we're privileging it then we enter the user
      * namespace first (because the initial setns will fail).
      */
-    enter_namespaces(pid_fd, namespaces & ~CLONE_NEWUSER, 1); /* ignore errors */
+    if (namespaces)
+        enter_namespaces(-1, namespaces & ~CLONE_NEWUSER, 1); /* ignore errors */
 
     namespaces = get_namespaces();
     if (namespaces)
-        enter_namespaces(pid_fd, namespaces, 0); /* report errors */
+        enter_namespaces(-1, namespaces, 0); /* report errors */
 
     if (pid_fd >= 0)
         close(pid_fd);
@@ -13,7 +13,9 @@
 
 
 
-int do_nsenter(int argc, char *argv[], unsigned long pid_to_enter);
+/* Run argv (nsenter(1) options, then the command) in the namespaces of `pid_to_enter`.
+ * `pid_to_enter_fd` is an optional pidfd for it (-1 = open one here), which is consumed. */
+int do_nsenter(int argc, char *argv[], unsigned long pid_to_enter, int pid_to_enter_fd);
 
 /* Convert a string to an unsigned long in the specified base */
 unsigned long str2unum(const char *str, int base);
@@ -0,0 +1,453 @@
+/*
+ * Prefix provisioning
+ *
+ * Copyright (C) 2025 William Horvath
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ * See the full license text in the repository LICENSE file.
+ */
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/file.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include "arena.hpp"
+#include "log.hpp"
+#include "macros.hpp"
+#include "prefix.hpp"
+#include "trace.hpp"
+#include "util.hpp"
+#include "yawlconfig.hpp"
+
+#include "fmt/printf.h"
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static uint64_t hash_stamp(uint64_t hash, const char *path) {
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return hash;
+
+    hash = fnv1a(hash, path, strlen(path));
+    hash = fnv1a(hash, &st.st_ino, sizeof(st.st_ino));
+    hash = fnv1a(hash, &st.st_size, sizeof(st.st_size));
+    hash = fnv1a(hash, &st.st_mtim.tv_sec, sizeof(st.st_mtim.tv_sec));
+    return fnv1a(hash, &st.st_mtim.tv_nsec, sizeof(st.st_mtim.tv_nsec));
+}
+
+char *prefix_template_path(const char *exec_path) {
+    autofree char *real_exec = realpath(exec_path, nullptr);
+    if (!real_exec)
+        return nullptr;
+
+    uint64_t hash = hash_stamp(0xcbf29ce484222325ULL, real_exec);
+
+    /* Proton keeps its build identity in a 'version' file next to the script */
+    autofree char *exec_dir = strdup(real_exec);
+    char *last_slash = strrchr(exec_dir, '/');
+    if (last_slash) {
+        *last_slash = '\0';
+        autofree char *version_path = nullptr;
+        join_paths(version_path, exec_dir, "version");
+        hash = hash_stamp(hash, version_path);
+    }
+
+    char key[17];
+    snprintf(key, sizeof(key), "%016llx", (unsigned long long)hash);
+
+    char *template_path = nullptr;
+    join_paths(template_path, config::yawl_dir, PREFIX_TEMPLATE_DIR, key);
+    return template_path;
+}
+
+/* wineboot writes the registry last, so a template without one is still being made (or failed) */
+static bool template_ready(const char *template_path) {
+    autofree char *wine_reg = nullptr;
+    autofree char *proton_reg = nullptr;
+    join_paths(wine_reg, template_path, "system.reg");
+    join_paths(proton_reg, template_path, "pfx", "system.reg");
+    return access(wine_reg, F_OK) == 0 || access(proton_reg, F_OK) == 0;
+}
+
+/* Missing or empty directories can be replaced by a clone */
+static bool needs_provisioning(const char *prefix_path) {
+    autoclosedir DIR *dir = opendir(prefix_path);
+    if (!dir)
+        return errno == ENOENT;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        if (!STRING_EQUALS(entry->d_name, ".") && !STRING_EQUALS(entry->d_name, ".."))
+            return false;
+    }
+    return true;
+}
+
+/* Overlay state lives next to the prefix, which itself is only the mount point:
+ *   PREFIX.overlay/base   path of the template used as the lower layer
+ *   PREFIX.overlay/upper  the prefix's own files
+ *   PREFIX.overlay/work   overlayfs scratch space
+ *   PREFIX.overlay/lock   held by the launch that has it mounted */
+static char *overlay_path(const char *prefix_path, const char *name) {
+    char *path = nullptr;
+    append_sep(path, "", prefix_path, PREFIX_OVERLAY_SUFFIX);
+    if (path && name) {
+        char *full_path = nullptr;
+        join_paths(full_path, path, name);
+        free(path);
+        path = full_path;
+    }
+    return path;
+}
+
+bool prefix_is_overlay(const char *prefix_path) {
+    autofree char *base_path = overlay_path(prefix_path, "base");
+    return base_path && access(base_path, F_OK) == 0;
+}
+
+static char *overlay_base(const char *prefix_path) {
+    autofree char *base_path = overlay_path(prefix_path, "base");
+    autoclose FILE *fp = base_path ? fopen(base_path, "re") : nullptr;
+    char line[PATH_MAX];
+    if (!fp || !fgets(line, sizeof(line), fp))
+        return nullptr;
+    line[strcspn(line, "\n")] = '\0';
+    return line[0] ? strdup(line) : nullptr;
+}
+
+static RESULT overlay_create(const char *prefix_path, const char *template_path) {
+    autofree char *final_dir = overlay_path(prefix_path, nullptr);
+    autofree char *tmp_dir = nullptr;
+    autofree char *upper_dir = nullptr;
+    autofree char *work_dir = nullptr;
+    autofree char *base_path = nullptr;
+    char suffix[32];
+
+    snprintf(suffix, sizeof(suffix), ".tmp-%d", getpid());
+    append_sep(tmp_dir, "", final_dir, suffix);
+    join_paths(upper_dir, tmp_dir, "upper");
+    join_paths(work_dir, tmp_dir, "work");
+    join_paths(base_path, tmp_dir, "base");
+
+    RESULT result = ensure_dir(upper_dir);
+    if (!FAILED(result))
+        result = ensure_dir(work_dir);
+    if (!FAILED(result)) {
+        autoclose FILE *fp = fopen(base_path, "we");
+        if (!fp || fmt::fprintf(fp, "%s\n", template_path) < 0)
+            result = result_from_errno();
+    }
+
+    /* Like the clones, the state only appears once it's complete, and whoever renames it first wins */
+    if (FAILED(result) || rename(tmp_dir, final_dir) != 0) {
+        remove_dir(tmp_dir);
+        if (!prefix_is_overlay(prefix_path))
+            return FAILED(result) ? result : result_from_errno();
+    }
+
+    RETURN_IF_FAILED(ensure_dir(prefix_path));
+    LOG_INFO("Created overlay prefix %s on top of %s", prefix_path, template_path);
+    return RESULT_OK;
+}
+
+RESULT prefix_provision(const char *prefix_path, const char *exec_path, bool overlay) {
+    TRACE_SCOPE("prefix_provision");
+
+    /* Outside of its launch, an overlay prefix is just an empty mount point */
+    if (prefix_is_overlay(prefix_path))
+        return RESULT_OK;
+
+    if (!needs_provisioning(prefix_path)) {
+        if (overlay)
+            LOG_DEBUG("%s already exists, keeping it a standalone prefix", prefix_path);
+        return RESULT_OK;
+    }
+
+    autofree char *template_path = exec_path ? prefix_template_path(exec_path) : nullptr;
+    if (!template_path || !template_ready(template_path)) {
+        if (overlay)
+            LOG_WARNING("No prefix template for %s yet (see 'make_template'), creating a standalone prefix", exec_path);
+        else
+            LOG_DEBUG("No prefix template for %s, the prefix will be initialized from scratch", exec_path);
+        return ensure_dir(prefix_path);
+    }
+
+    if (overlay) {
+        RESULT result = overlay_create(prefix_path, template_path);
+        if (!FAILED(result))
+            return result;
+        LOG_RESULT(Level::Warning, result, "Failed to create an overlay prefix, cloning the template instead");
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* Clone next to the destination first, so that an interrupted clone never looks like a real prefix */
+    autofree char *parent = strdup(prefix_path);
+    char *last_slash = strrchr(parent, '/');
+    if (last_slash && last_slash != parent) {
+        *last_slash = '\0';
+        RETURN_IF_FAILED(ensure_dir(parent));
+    }
+
+    autofree char *tmp_path = nullptr;
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".clone-%d", getpid());
+    append_sep(tmp_path, "", prefix_path, suffix);
+
+    RESULT result = clone_tree(template_path, tmp_path);
+    if (FAILED(result)) {
+        LOG_RESULT(Level::Warning, result, "Failed to clone the prefix template, initializing from scratch");
+        remove_dir(tmp_path);
+        return ensure_dir(prefix_path);
+    }
+
+    /* An empty directory may be in the way, a non-empty one means someone else won the race */
+    rmdir(prefix_path);
+    if (rename(tmp_path, prefix_path) != 0) {
+        LOG_DEBUG("Couldn't move the cloned prefix into place: %s", strerror(errno));
+        remove_dir(tmp_path);
+        return ensure_dir(prefix_path);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    LOG_INFO("Created prefix %s from template in %.0f ms", prefix_path,
+             (double)(end.tv_sec - start.tv_sec) * 1e3 + (double)(end.tv_nsec - start.tv_nsec) / 1e6);
+
+    return RESULT_OK;
+}
+
+static RESULT write_proc_file(const char *path, const char *content) {
+    autoclosefd int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        return result_from_errno();
+    if (write(fd, content, strlen(content)) < 0)
+        return result_from_errno();
+    return RESULT_OK;
+}
+
+/* overlayfs splits its options on ',' and lowerdir on ':', a backslash escapes them */
+static void append_mount_path(char *buf, size_t size, size_t *len, const char *path) {
+    for (; *path && *len + 2 < size; path++) {
+        if (*path == ',' || *path == ':' || *path == '\\')
+            buf[(*len)++] = '\\';
+        buf[(*len)++] = *path;
+    }
+    buf[*len] = '\0';
+}
+
+/* Keep the prefix to a single launch at a time, two overlay mounts sharing an upper layer corrupt it.
+ * The descriptor is deliberately inherited, so the lock lasts as long as anything from the launch holds it.
+ * Returns the descriptor, or -1 with errno set (EWOULDBLOCK if the prefix is in use) */
+static int overlay_lock(const char *prefix_path, bool inherit) {
+    autofree char *lock_path = overlay_path(prefix_path, "lock");
+    int fd = lock_path ? open(lock_path, O_RDWR | O_CREAT | (inherit ? 0 : O_CLOEXEC), 0644) : -1;
+    if (fd < 0)
+        return -1;
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    return fd;
+}
+
+RESULT prefix_overlay_enter(void) {
+    TRACE_SCOPE("prefix_overlay_enter");
+
+    /* Map ourselves to the same IDs, so that files keep their owner and wine's prefix ownership check passes */
+    uid_t uid = getuid();
+    gid_t gid = getgid();
+    if (unshare(CLONE_NEWUSER | CLONE_NEWNS) != 0) {
+        RESULT result = result_from_errno();
+        LOG_RESULT(Level::Error, result, "Couldn't create a user namespace for the overlay prefix");
+        return result;
+    }
+
+    char map[64];
+    snprintf(map, sizeof(map), "%u %u 1\n", uid, uid);
+    RESULT result = write_proc_file("/proc/self/setgroups", "deny");
+    if (!FAILED(result))
+        result = write_proc_file("/proc/self/uid_map", map);
+    if (!FAILED(result)) {
+        snprintf(map, sizeof(map), "%u %u 1\n", gid, gid);
+        result = write_proc_file("/proc/self/gid_map", map);
+    }
+    if (FAILED(result))
+        LOG_RESULT(Level::Error, result, "Couldn't set up the user namespace for the overlay prefix");
+    return result;
+}
+
+RESULT prefix_overlay_mount(const char *prefix_path) {
+    TRACE_SCOPE("prefix_overlay_mount");
+
+    autofree char *lower_dir = overlay_base(prefix_path);
+    autofree char *upper_dir = overlay_path(prefix_path, "upper");
+    autofree char *work_dir = overlay_path(prefix_path, "work");
+    if (!lower_dir || !upper_dir || !work_dir)
+        return MAKE_RESULT(SEV_ERROR, CAT_FILESYSTEM, E_NOT_FOUND);
+
+    if (!template_ready(lower_dir)) {
+        LOG_ERROR("The template %s under the overlay prefix %s is gone", lower_dir, prefix_path);
+        return MAKE_RESULT(SEV_ERROR, CAT_FILESYSTEM, E_NOT_FOUND);
+    }
+
+    if (overlay_lock(prefix_path, true) < 0)
+        return errno == EWOULDBLOCK ? MAKE_RESULT(SEV_ERROR, CAT_FILESYSTEM, E_NOT_READY) : result_from_errno();
+
+    char options[3 * PATH_MAX + 64];
+    size_t len = 0;
+    options[0] = '\0';
+    const char *keys[] = {"lowerdir=", ",upperdir=", ",workdir="};
+    const char *paths[] = {lower_dir, upper_dir, work_dir};
+    for (size_t i = 0; i < 3; i++) {
+        len += (size_t)snprintf(options + len, sizeof(options) - len, "%s", keys[i]);
+        append_mount_path(options, sizeof(options), &len, paths[i]);
+    }
+    /* Unprivileged overlays keep their whiteouts and opaque markers in user.* xattrs */
+    snprintf(options + len, sizeof(options) - len, ",userxattr");
+
+    RESULT result;
+    if (mount("overlay", prefix_path, "overlay", 0, options) != 0) {
+        result = result_from_errno();
+        LOG_RESULT(Level::Error, result, "Couldn't mount the overlay prefix (needs Linux 5.11 or later)");
+        return result;
+    }
+
+    LOG_DEBUG("Mounted overlay prefix %s (lower: %s)", prefix_path, lower_dir);
+    return RESULT_OK;
+}
+
+static RESULT remove_path(const char *path) {
+    struct stat st;
+    if (lstat(path, &st) != 0)
+        return errno == ENOENT ? RESULT_OK : result_from_errno();
+    if (S_ISDIR(st.st_mode))
+        return remove_dir(path);
+    return unlink(path) == 0 ? RESULT_OK : result_from_errno();
+}
+
+/* Apply an overlayfs upper layer to a copy of its lower layer: whiteouts (0:0 character devices) delete,
+ * opaque directories replace, everything else overwrites. Paths come from `paths` and only live for one
+ * entry, so the whole walk reuses the memory of a single directory chain. */
+static RESULT merge_upper(struct arena *paths, const char *upper, const char *dst) {
+    autoclosedir DIR *dir = opendir(upper);
+    if (!dir)
+        return result_from_errno();
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        if (STRING_EQUALS(entry->d_name, ".") || STRING_EQUALS(entry->d_name, ".."))
+            continue;
+
+        struct stat st;
+        if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+            return result_from_errno();
+
+        ARENA_SCOPE(paths);
+        char *src_path = arena_path(paths, upper, entry->d_name);
+        char *dst_path = arena_path(paths, dst, entry->d_name);
+        if (!src_path || !dst_path)
+            return MAKE_RESULT(SEV_ERROR, CAT_SYSTEM, E_OUT_OF_MEMORY);
+
+        if (S_ISCHR(st.st_mode) && st.st_rdev == 0) {
+            RETURN_IF_FAILED(remove_path(dst_path));
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            char opaque = 0;
+            struct stat dst_st;
+            bool exists = lstat(dst_path, &dst_st) == 0;
+            if (exists && (!S_ISDIR(dst_st.st_mode) ||
+                           (lgetxattr(src_path, "user.overlay.opaque", &opaque, 1) == 1 && opaque == 'y'))) {
+                RETURN_IF_FAILED(remove_path(dst_path));
+                exists = false;
+            }
+            if (!exists && mkdir(dst_path, (st.st_mode & 07777) | S_IRWXU) != 0)
+                return result_from_errno();
+            RETURN_IF_FAILED(merge_upper(paths, src_path, dst_path));
+            chmod(dst_path, st.st_mode & 07777);
+            continue;
+        }
+
+        RETURN_IF_FAILED(remove_path(dst_path));
+        if (S_ISLNK(st.st_mode)) {
+            char target[PATH_MAX];
+            ssize_t len = readlinkat(dirfd(dir), entry->d_name, target, sizeof(target) - 1);
+            if (len < 0)
+                return result_from_errno();
+            target[len] = '\0';
+            if (symlink(target, dst_path) != 0)
+                return result_from_errno();
+        } else if (S_ISREG(st.st_mode)) {
+            RETURN_IF_FAILED(clone_file(src_path, dst_path));
+        }
+    }
+
+    return RESULT_OK;
+}
+
+RESULT prefix_flatten(const char *prefix_path) {
+    TRACE_SCOPE("prefix_flatten");
+
+    if (!prefix_is_overlay(prefix_path))
+        return MAKE_RESULT(SEV_WARNING, CAT_FILESYSTEM, E_NOT_FOUND);
+
+    autoclosefd int lock_fd = overlay_lock(prefix_path, false);
+    if (lock_fd < 0)
+        return errno == EWOULDBLOCK ? MAKE_RESULT(SEV_ERROR, CAT_FILESYSTEM, E_NOT_READY) : result_from_errno();
+
+    autofree char *lower_dir = overlay_base(prefix_path);
+    autofree char *upper_dir = overlay_path(prefix_path, "upper");
+    autofree char *state_dir = overlay_path(prefix_path, nullptr);
+    if (!lower_dir || !upper_dir || !state_dir)
+        return MAKE_RESULT(SEV_ERROR, CAT_FILESYSTEM, E_NOT_FOUND);
+
+    autofree char *tmp_path = nullptr;
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".flatten-%d", getpid());
+    append_sep(tmp_path, "", prefix_path, suffix);
+
+    autoarena struct arena paths = {};
+    RESULT result = clone_tree(lower_dir, tmp_path);
+    if (!FAILED(result))
+        result = merge_upper(&paths, upper_dir, tmp_path);
+    if (FAILED(result)) {
+        remove_dir(tmp_path);
+        return result;
+    }
+
+    /* The mount point is empty out here, swap the flattened copy in and only then drop the layers */
+    if (rmdir(prefix_path) != 0 || rename(tmp_path, prefix_path) != 0) {
+        result = result_from_errno();
+        remove_dir(tmp_path);
+        return result;
+    }
+
+    /* overlayfs leaves its work/work directory inaccessible */
+    autofree char *work_work = overlay_path(prefix_path, "work/work");
+    chmod(work_work, S_IRWXU);
+
+    result = remove_dir(state_dir);
+    if (FAILED(result))
+        LOG_RESULT(Level::Warning, result, "Failed to remove the old overlay layers");
+
+    LOG_INFO("Flattened %s into a standalone prefix", prefix_path);
+    return RESULT_OK;
+}
@@ -0,0 +1,56 @@
+/*
+ * Prefix provisioning
+ *
+ * New prefixes are cloned from a template prefix that was initialized once for the same wine/proton
+ * build (with the 'make_template' verb), instead of waiting for wineboot to build each one from
+ * scratch. The clone reflinks files where the filesystem supports it, so it usually takes milliseconds.
+ *
+ * With 'overlay_prefix', new prefixes aren't copied at all: the template stays the read-only lower layer of
+ * an overlayfs, and only the files the program changes end up in the prefix's own upper layer (kept next to
+ * it, in PREFIX.overlay). The overlay is mounted in a user and mount namespace of the launch, so it's only
+ * visible to the processes of that launch; shared DLLs are read from the template's page cache by every
+ * running game. 'flatten_prefix' turns an overlay prefix back into a standalone one.
+ *
+ * Copyright (C) 2025 William Horvath
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ * See the full license text in the repository LICENSE file.
+ */
+
+#pragma once
+
+#include "result.hpp"
+
+#define PREFIX_DIR "prefixes"
+#define PREFIX_TEMPLATE_DIR "templates"
+#define PREFIX_OVERLAY_SUFFIX ".overlay"
+
+/* Template directory for the wine/proton build at `exec_path`. Templates are keyed by the build's path and
+ * file stamps, so an upgraded build gets a new template.
+ * Returns a malloc'd path, or nullptr if `exec_path` doesn't exist */
+char *prefix_template_path(const char *exec_path);
+
+/* Make sure the prefix (or Proton compat data directory) at `prefix_path` exists. If it doesn't exist yet or
+ * is empty, and an initialized template for `exec_path` is available, it's cloned from the template, or with
+ * `overlay`, set up as an overlay prefix on top of it.
+ * Returns RESULT_OK on success, error RESULT on failure */
+RESULT prefix_provision(const char *prefix_path, const char *exec_path, bool overlay);
+
+/* Whether `prefix_path` is an overlay prefix */
+bool prefix_is_overlay(const char *prefix_path);
+
+/* Enter a new user and mount namespace for prefix_overlay_mount(), which the calling process's children inherit.
+ * unshare(CLONE_NEWUSER) needs a single-threaded process, and the kernel can still count a thread for a moment
+ * after it was joined, so call this before anything starts one (the startup tasks, the log writer, clone_tree()).
+ * Returns RESULT_OK on success, error RESULT on failure (already logged) */
+RESULT prefix_overlay_enter(void);
+
+/* Mount the overlay prefix at `prefix_path`, after prefix_overlay_enter()
+ * Returns RESULT_OK on success, E_NOT_READY if another launch is using the prefix, error RESULT on failure */
+RESULT prefix_overlay_mount(const char *prefix_path);
+
+/* Turn the overlay prefix at `prefix_path` into a standalone prefix, by cloning its template and applying
+ * the upper layer (including deletions) on top.
+ * Returns RESULT_OK on success, E_NOT_FOUND if it isn't an overlay prefix, E_NOT_READY if it's in use,
+ * error RESULT on failure */
+RESULT prefix_flatten(const char *prefix_path);
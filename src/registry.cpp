@@ -0,0 +1,437 @@
+/*
+ * Container registry
+ *
+ * Copyright (C) 2025 William Horvath
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ * See the full license text in the repository LICENSE file.
+ */
+
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <ctime>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "macros.hpp"
+#include "registry.hpp"
+#include "util.hpp"
+
+/* Upper bound on processes visited below an entry when looking for its container */
+#define REGISTRY_MAX_WALK 4096
+/* WINEPREFIX, STEAM_COMPAT_DATA_PATH and STEAM_COMPAT_DATA_PATH/pfx */
+#define REGISTRY_MAX_PREFIXES 3
+/* How often to look for the container below a registered entry while it's starting up (no event for that) */
+#define REGISTRY_STARTUP_POLL_MS 50
+
+struct registry_entry {
+    pid_t pid;
+    unsigned long long starttime;
+};
+
+/* Start time of `pid` in clock ticks since boot (field 22 of /proc/PID/stat), or 0 if it doesn't exist */
+static unsigned long long process_starttime(pid_t pid) {
+    char path[64], buf[1024];
+    unsigned long long starttime = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    autoclose FILE *fp = fopen(path, "re");
+    if (!fp || !fgets(buf, sizeof(buf), fp))
+        return 0;
+
+    /* comm can contain spaces and parentheses, so start after the last ')' */
+    const char *after_comm = strrchr(buf, ')');
+    if (!after_comm || sscanf(after_comm + 1,
+                              " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d %*d %*d %*d %llu",
+                              &starttime) != 1)
+        return 0;
+
+    return starttime;
+}
+
+static bool entry_alive(const struct registry_entry *entry) {
+    return entry->starttime && process_starttime(entry->pid) == entry->starttime;
+}
+
+static bool read_entry(const char *path, struct registry_entry *entry) {
+    autoclose FILE *fp = fopen(path, "re");
+    return fp && fscanf(fp, "%d %llu", &entry->pid, &entry->starttime) == 2 && entry->pid > 0;
+}
+
+/* Prefixes are keyed by a hash of their canonical path, so that any spelling of the same directory matches */
+static void prefix_key(char key[17], const char *prefix) {
+    char canonical[PATH_MAX];
+
+    if (!realpath(prefix, canonical)) {
+        snprintf(canonical, sizeof(canonical), "%s", prefix);
+        size_t len = strlen(canonical);
+        while (len > 1 && canonical[len - 1] == '/')
+            canonical[--len] = '\0';
+    }
+
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const char *c = canonical; *c; c++) {
+        hash ^= (unsigned char)*c;
+        hash *= 0x100000001b3ULL;
+    }
+    snprintf(key, 17, "%016llx", (unsigned long long)hash);
+}
+
+static bool entry_path(char path[PATH_MAX], const char *yawl_dir, const char *kind, const char *key) {
+    /* config= can be a full path, keep the name a single path component */
+    char name[NAME_MAX - 16];
+    snprintf(name, sizeof(name), "%s", key);
+    for (char *c = name; *c; c++) {
+        if (*c == '/')
+            *c = '_';
+    }
+    return snprintf(path, PATH_MAX, "%s/" REGISTRY_DIR "/%s/%s", yawl_dir, kind, name) < PATH_MAX;
+}
+
+static void prune_dir(const char *yawl_dir, const char *kind) {
+    char dir_path[PATH_MAX];
+    if (snprintf(dir_path, sizeof(dir_path), "%s/" REGISTRY_DIR "/%s", yawl_dir, kind) >= (int)sizeof(dir_path))
+        return;
+
+    autoclosedir DIR *dir = opendir(dir_path);
+    if (!dir)
+        return;
+
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+        if (ent->d_name[0] == '.')
+            continue;
+
+        char path[PATH_MAX];
+        struct registry_entry entry;
+        if (snprintf(path, sizeof(path), "%s/%s", dir_path, ent->d_name) >= (int)sizeof(path))
+            continue;
+        /* Half-written entries (".tmp.PID") belong to the process that's writing them */
+        if (strstr(ent->d_name, ".tmp."))
+            continue;
+        if (!read_entry(path, &entry) || !entry_alive(&entry))
+            unlinkat(dirfd(dir), ent->d_name, 0);
+    }
+}
+
+static RESULT write_entry(const char *path, const struct registry_entry *entry, const char *name, const char *appid,
+                          const char *prefix) {
+    char temp_path[PATH_MAX];
+    if (snprintf(temp_path, sizeof(temp_path), "%s.tmp.%d", path, entry->pid) >= (int)sizeof(temp_path))
+        return MAKE_RESULT(SEV_ERROR, CAT_FILESYSTEM, E_INVALID_ARG);
+
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return MAKE_RESULT(SEV_ERROR, CAT_FILESYSTEM, E_IO_ERROR);
+
+    int written = dprintf(fd, "%d %llu\n%s\n%s\n%s\n", entry->pid, entry->starttime, name, appid, prefix);
+    close(fd);
+
+    /* Lookups only ever see complete entries */
+    if (written < 0 || rename(temp_path, path) != 0) {
+        unlink(temp_path);
+        return MAKE_RESULT(SEV_ERROR, CAT_FILESYSTEM, E_IO_ERROR);
+    }
+
+    return RESULT_OK;
+}
+
+/* mkdir -p, without pulling in the rest of util.cpp */
+static RESULT make_registry_dirs(const char *yawl_dir) {
+    static constexpr const char *const subdirs[] = {"", "/" REGISTRY_BY_NAME, "/" REGISTRY_BY_PREFIX};
+    char path[PATH_MAX];
+
+    for (const char *subdir : subdirs) {
+        if (snprintf(path, sizeof(path), "%s/" REGISTRY_DIR "%s", yawl_dir, subdir) >= (int)sizeof(path))
+            return MAKE_RESULT(SEV_ERROR, CAT_FILESYSTEM, E_INVALID_ARG);
+        if (mkdir(path, 0755) != 0 && errno != EEXIST)
+            return MAKE_RESULT(SEV_ERROR, CAT_FILESYSTEM, E_ACCESS_DENIED);
+    }
+
+    return RESULT_OK;
+}
+
+RESULT registry_add(const char *yawl_dir, const char *name) {
+    char path[PATH_MAX];
+    const char *prefixes[REGISTRY_MAX_PREFIXES] = {};
+    char compat_pfx[PATH_MAX] = {};
+    char default_prefix[PATH_MAX] = {};
+    int n_prefixes = 0;
+
+    if (!yawl_dir || !name)
+        return MAKE_RESULT(SEV_ERROR, CAT_CONTAINER, E_INVALID_ARG);
+
+    struct registry_entry entry = {getpid(), 0};
+    entry.starttime = process_starttime(entry.pid);
+    if (!entry.starttime)
+        return MAKE_RESULT(SEV_ERROR, CAT_CONTAINER, E_NOT_FOUND);
+
+    const char *wineprefix = getenv("WINEPREFIX");
+    const char *compat_data = getenv("STEAM_COMPAT_DATA_PATH");
+    const char *appid = getenv("STEAM_COMPAT_APP_ID");
+    const char *home = getenv("HOME");
+
+    if (wineprefix && *wineprefix)
+        prefixes[n_prefixes++] = wineprefix;
+    if (compat_data && *compat_data) {
+        prefixes[n_prefixes++] = compat_data;
+        if (snprintf(compat_pfx, sizeof(compat_pfx), "%s/pfx", compat_data) < (int)sizeof(compat_pfx))
+            prefixes[n_prefixes++] = compat_pfx;
+    }
+    if (!n_prefixes && home && snprintf(default_prefix, sizeof(default_prefix), "%s/.wine", home) < PATH_MAX)
+        prefixes[n_prefixes++] = default_prefix;
+
+    RETURN_IF_FAILED(make_registry_dirs(yawl_dir));
+
+    prune_dir(yawl_dir, REGISTRY_BY_NAME);
+    prune_dir(yawl_dir, REGISTRY_BY_PREFIX);
+
+    const char *main_prefix = n_prefixes ? prefixes[0] : "";
+    if (!appid)
+        appid = "";
+
+    RESULT result = RESULT_OK;
+    if (!entry_path(path, yawl_dir, REGISTRY_BY_NAME, name))
+        return MAKE_RESULT(SEV_ERROR, CAT_FILESYSTEM, E_INVALID_ARG);
+    result = write_entry(path, &entry, name, appid, main_prefix);
+
+    for (int i = 0; i < n_prefixes && SUCCEEDED(result); i++) {
+        char key[17];
+        prefix_key(key, prefixes[i]);
+        if (entry_path(path, yawl_dir, REGISTRY_BY_PREFIX, key))
+            result = write_entry(path, &entry, name, appid, main_prefix);
+    }
+
+    return result;
+}
+
+bool registry_app_running(const char *yawl_dir, const char *appid) {
+    char dir_path[PATH_MAX];
+    if (!appid || !*appid)
+        return false;
+    int len = snprintf(dir_path, sizeof(dir_path), "%s/" REGISTRY_DIR "/" REGISTRY_BY_NAME, yawl_dir);
+    if (len < 0 || len >= (int)sizeof(dir_path))
+        return false;
+
+    autoclosedir DIR *dir = opendir(dir_path);
+    if (!dir)
+        return false;
+
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+        if (ent->d_name[0] == '.' || strstr(ent->d_name, ".tmp."))
+            continue;
+
+        char path[PATH_MAX], name[PATH_MAX], entry_appid[PATH_MAX];
+        if (snprintf(path, sizeof(path), "%s/%s", dir_path, ent->d_name) >= (int)sizeof(path))
+            continue;
+
+        /* "PID STARTTIME", then the name, the app ID and the prefix on their own lines */
+        autoclose FILE *fp = fopen(path, "re");
+        struct registry_entry entry;
+        if (!fp || fscanf(fp, "%d %llu\n", &entry.pid, &entry.starttime) != 2 || !fgets(name, sizeof(name), fp) ||
+            !fgets(entry_appid, sizeof(entry_appid), fp))
+            continue;
+        entry_appid[strcspn(entry_appid, "\n")] = '\0';
+
+        bool same = true;
+        for (size_t i = 0; same && (appid[i] || entry_appid[i]); i++)
+            same = appid[i] == entry_appid[i] || (appid[i] == '_' && entry_appid[i] == '/');
+        if (same && entry_alive(&entry))
+            return true;
+    }
+
+    return false;
+}
+
+static ino_t mnt_ino(pid_t pid) {
+    char path[64];
+    struct stat st;
+    snprintf(path, sizeof(path), "/proc/%d/ns/mnt", pid);
+    return stat(path, &st) == 0 ? st.st_ino : 0;
+}
+
+static bool in_container(pid_t pid, ino_t root_ino) {
+    char path[64], comm[32] = {};
+    struct stat st;
+
+    snprintf(path, sizeof(path), "/proc/%d/ns/mnt", pid);
+    if (stat(path, &st) != 0 || st.st_ino == root_ino)
+        return false;
+
+    /* bwrap itself sets the namespaces up, the processes below it are the ones actually inside */
+    snprintf(path, sizeof(path), "/proc/%d/comm", pid);
+    autoclose FILE *fp = fopen(path, "re");
+    if (fp && fgets(comm, sizeof(comm), fp))
+        comm[strcspn(comm, "\n")] = '\0';
+    return !STRING_EQUALS(comm, "bwrap");
+}
+
+/* Breadth-first walk over the process tree below `root` through /proc/PID/task/TID/children,
+ * returning the first process inside a container. That's judged against the root's own mount namespace
+ * rather than ours, since overlay prefixes give the root process a namespace of its own. */
+static pid_t container_child(pid_t root, ino_t root_ino) {
+    if (!root_ino)
+        return 0;
+
+    autofree pid_t *queue = (pid_t *)malloc(REGISTRY_MAX_WALK * sizeof(pid_t));
+    if (!queue)
+        return 0;
+
+    size_t head = 0, tail = 0;
+    queue[tail++] = root;
+
+    while (head < tail) {
+        pid_t pid = queue[head++];
+        if (pid != root && in_container(pid, root_ino))
+            return pid;
+
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/%d/task", pid);
+        autoclosedir DIR *tasks = opendir(path);
+        if (!tasks)
+            continue;
+
+        struct dirent *ent;
+        while ((ent = readdir(tasks))) {
+            if (!isdigit((unsigned char)ent->d_name[0]))
+                continue;
+
+            char children_path[96];
+            snprintf(children_path, sizeof(children_path), "/proc/%d/task/%s/children", pid, ent->d_name);
+            autoclose FILE *fp = fopen(children_path, "re");
+            if (!fp)
+                continue;
+
+            pid_t child;
+            while (tail < REGISTRY_MAX_WALK && fscanf(fp, "%d", &child) == 1)
+                queue[tail++] = child;
+        }
+    }
+
+    return 0;
+}
+
+RESULT registry_lookup(const char *yawl_dir, const char *spec, pid_t *container_pid, int *container_pidfd) {
+    char path[PATH_MAX];
+    struct registry_entry entry;
+    bool path_ok;
+
+    if (!yawl_dir || !spec || !container_pid)
+        return MAKE_RESULT(SEV_ERROR, CAT_CONTAINER, E_INVALID_ARG);
+
+    if (STRING_PREFIX(spec, "name:")) {
+        path_ok = entry_path(path, yawl_dir, REGISTRY_BY_NAME, STRING_AFTER_PREFIX(spec, "name:"));
+    } else if (STRING_PREFIX(spec, "prefix:")) {
+        char key[17];
+        prefix_key(key, STRING_AFTER_PREFIX(spec, "prefix:"));
+        path_ok = entry_path(path, yawl_dir, REGISTRY_BY_PREFIX, key);
+    } else {
+        return MAKE_RESULT(SEV_ERROR, CAT_CONTAINER, E_INVALID_ARG);
+    }
+
+    if (!path_ok || !read_entry(path, &entry))
+        return MAKE_RESULT(SEV_ERROR, CAT_CONTAINER, E_NOT_FOUND);
+
+    /* Pin the process before checking its start time, so it can't be swapped out under us while we walk its tree */
+    autoclosefd int pid_fd = -1;
+#ifdef SYS_pidfd_open
+    pid_fd = (int)syscall(SYS_pidfd_open, entry.pid, 0);
+#endif
+
+    if (!entry_alive(&entry)) {
+        unlink(path);
+        return MAKE_RESULT(SEV_ERROR, CAT_CONTAINER, E_NOT_FOUND);
+    }
+
+    ino_t root_ino = mnt_ino(entry.pid);
+    pid_t child = container_child(entry.pid, root_ino);
+
+    /* A pidfd becomes readable once the process exits: the tree we walked may have belonged to a reused PID */
+    struct pollfd pfd = {pid_fd, POLLIN, 0};
+    if (pid_fd >= 0 && poll(&pfd, 1, 0) > 0) {
+        unlink(path);
+        return MAKE_RESULT(SEV_ERROR, CAT_CONTAINER, E_NOT_FOUND);
+    }
+
+    if (!child)
+        return MAKE_RESULT(SEV_WARNING, CAT_CONTAINER, E_NOT_READY);
+
+    if (container_pidfd) {
+        *container_pidfd = -1;
+#ifdef SYS_pidfd_open
+        /* The process could have exited between the walk and pidfd_open(), check it again once it's pinned */
+        int child_fd = (int)syscall(SYS_pidfd_open, child, 0);
+        if (child_fd >= 0 && !in_container(child, root_ino)) {
+            close(child_fd);
+            return MAKE_RESULT(SEV_WARNING, CAT_CONTAINER, E_NOT_READY);
+        }
+        *container_pidfd = child_fd;
+#endif
+    }
+
+    *container_pid = child;
+    return RESULT_OK;
+}
+
+static long long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+RESULT registry_wait(const char *yawl_dir, const char *spec, long timeout_ms, pid_t *container_pid,
+                     int *container_pidfd) {
+    char dir_path[PATH_MAX];
+    const char *kind = STRING_PREFIX(spec, "prefix:") ? REGISTRY_BY_PREFIX : REGISTRY_BY_NAME;
+
+    if (!yawl_dir || !spec)
+        return MAKE_RESULT(SEV_ERROR, CAT_CONTAINER, E_INVALID_ARG);
+
+    RETURN_IF_FAILED(make_registry_dirs(yawl_dir));
+    if (snprintf(dir_path, sizeof(dir_path), "%s/" REGISTRY_DIR "/%s", yawl_dir, kind) >= (int)sizeof(dir_path))
+        return MAKE_RESULT(SEV_ERROR, CAT_FILESYSTEM, E_INVALID_ARG);
+
+    /* Watch before looking, so an entry written in between still wakes us up.
+     * Entries are renamed into place, which shows up as IN_MOVED_TO. */
+    autoclosefd int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0 || inotify_add_watch(inotify_fd, dir_path, IN_MOVED_TO | IN_CREATE) < 0)
+        return MAKE_RESULT(SEV_ERROR, CAT_CONTAINER, E_NOT_SUPPORTED);
+
+    long long deadline = timeout_ms > 0 ? monotonic_ms() + timeout_ms : 0;
+
+    for (;;) {
+        RESULT result = registry_lookup(yawl_dir, spec, container_pid, container_pidfd);
+        if (RESULT_CODE(result) != E_NOT_FOUND && RESULT_CODE(result) != E_NOT_READY)
+            return result;
+
+        int wait_ms = -1;
+        if (deadline) {
+            long long remaining = deadline - monotonic_ms();
+            if (remaining <= 0)
+                return MAKE_RESULT(SEV_ERROR, CAT_CONTAINER, E_TIMEOUT);
+            wait_ms = remaining > INT_MAX ? INT_MAX : (int)remaining;
+        }
+
+        /* The entry exists but its container isn't up yet: nothing to wait on but the clock */
+        if (RESULT_CODE(result) == E_NOT_READY && (wait_ms < 0 || wait_ms > REGISTRY_STARTUP_POLL_MS))
+            wait_ms = REGISTRY_STARTUP_POLL_MS;
+
+        struct pollfd pfd = {inotify_fd, POLLIN, 0};
+        if (poll(&pfd, 1, wait_ms) < 0 && errno != EINTR)
+            return MAKE_RESULT(SEV_ERROR, CAT_CONTAINER, E_IO_ERROR);
+
+        /* Any event in the directory is a reason to look again, just drain them */
+        char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        while (read(inotify_fd, events, sizeof(events)) > 0) {
+        }
+    }
+}
@@ -0,0 +1,49 @@
+/*
+ * Container registry
+ *
+ * Every launch records the process that becomes the runtime entry point under
+ * yawl_dir/containers, keyed by wrapper/config name and by prefix, so that
+ * 'enter=name:NAME' and 'enter=prefix:PATH' can find the container without
+ * scanning /proc. Entries store the process start time as well, so a reused
+ * PID never matches a stale entry.
+ *
+ * This file must not depend on the logging or network code, since the minimal
+ * front-end binary registers the containers it starts too.
+ *
+ * Copyright (C) 2025 William Horvath
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ * See the full license text in the repository LICENSE file.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+#include "result.hpp"
+
+#define REGISTRY_DIR "containers"
+#define REGISTRY_BY_NAME "by-name"
+#define REGISTRY_BY_PREFIX "by-prefix"
+
+/* Register the calling process, which is about to execv() the runtime entry point, as the container for `name`
+ * and the current WINEPREFIX/STEAM_COMPAT_DATA_PATH. Entries of exited containers are pruned along the way.
+ * Returns RESULT_OK on success, error RESULT on failure */
+RESULT registry_add(const char *yawl_dir, const char *name);
+
+/* Whether a container for `appid` is running. The app ID may have '/' replaced by '_', the way it's used
+ * in file names. */
+bool registry_app_running(const char *yawl_dir, const char *appid);
+
+/* Resolve `spec` ("name:NAME" or "prefix:PATH") to a process running inside that container.
+ * If `container_pidfd` is non-null, it receives a pidfd for that process (or -1 if pidfds aren't supported).
+ * Returns RESULT_OK and sets `container_pid`, E_NOT_FOUND if no such container is running,
+ * E_NOT_READY if it's registered but its container isn't up yet, error RESULT otherwise */
+RESULT registry_lookup(const char *yawl_dir, const char *spec, pid_t *container_pid, int *container_pidfd);
+
+/* Like registry_lookup(), but if the container isn't running yet, wait for it to be registered
+ * (through inotify on the registry) and started. `timeout_ms` <= 0 waits forever.
+ * Returns RESULT_OK and sets `container_pid` (and `container_pidfd`), E_TIMEOUT if it didn't show up in time,
+ * error RESULT otherwise */
+RESULT registry_wait(const char *yawl_dir, const char *spec, long timeout_ms, pid_t *container_pid,
+                     int *container_pidfd);
@@ -53,7 +53,7 @@ RESULT result_from_errno(void) {
 }
 
 static const char *generic_code_to_string(const char *prefix, int rescode) {
-    static const std::string out = {};
+    static thread_local const std::string out = {};
     /* Handle other error codes */
     if (strlen(prefix) < 128)
     {
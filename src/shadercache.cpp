@@ -0,0 +1,251 @@
+/*
+ * Managed shader caches
+ *
+ * Copyright (C) 2025 William Horvath
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ * See the full license text in the repository LICENSE file.
+ */
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "launchplan.hpp"
+#include "log.hpp"
+#include "macros.hpp"
+#include "registry.hpp"
+#include "shadercache.hpp"
+#include "trace.hpp"
+#include "util.hpp"
+#include "yawlconfig.hpp"
+
+#define SHADERCACHE_GC_STAMP ".gc"
+
+/* Variable, subdirectory. Variables the user already set are left alone. */
+static constexpr const char *const cache_vars[][2] = {
+    {"DXVK_STATE_CACHE_PATH", "dxvk"},
+    {"VKD3D_SHADER_CACHE_PATH", "vkd3d"},
+    {"MESA_SHADER_CACHE_DIR", "mesa"},
+    {"__GL_SHADER_DISK_CACHE_PATH", "nvidia"},
+};
+
+/* App IDs end up as directory names */
+static char *app_dir(const char *appid) {
+    if (!appid || !appid[0] || STRING_EQUALS(appid, ".") || STRING_EQUALS(appid, ".."))
+        return nullptr;
+
+    autofree char *name = strdup(appid);
+    if (!name)
+        return nullptr;
+    for (char *c = name; *c; c++) {
+        if (*c == '/')
+            *c = '_';
+    }
+
+    char *path = nullptr;
+    join_paths(path, config::yawl_dir, SHADERCACHE_DIR, name);
+    return path;
+}
+
+RESULT shadercache_setup(const char *appid) {
+    TRACE_SCOPE("shadercache_setup");
+
+    autofree char *dir = app_dir(appid);
+    if (!dir)
+        return MAKE_RESULT(SEV_ERROR, CAT_FILESYSTEM, E_INVALID_ARG);
+
+    for (const auto &var : cache_vars) {
+        if (getenv(var[0]))
+            continue;
+
+        autofree char *path = nullptr;
+        join_paths(path, dir, var[1]);
+        RETURN_IF_FAILED(ensure_dir(path));
+        setenv(var[0], path, 1);
+    }
+
+    /* The budget is ours to enforce, don't let the NVIDIA driver trim its cache on its own */
+    setenv("__GL_SHADER_DISK_CACHE_SKIP_CLEANUP", "1", 0);
+
+    /* Eviction goes by last use, and noatime mounts wouldn't tell us. Only the access time, which isn't part of
+     * the plan's stamp of the directory, and which replays of the plan update the same way. */
+    static const struct timespec times[2] = {{0, UTIME_NOW}, {0, UTIME_OMIT}};
+    utimensat(AT_FDCWD, dir, times, 0);
+
+    /* A plan would otherwise keep pointing at a cache directory that was evicted in the meantime */
+    plan_add_touch(dir);
+    return RESULT_OK;
+}
+
+struct cache_app {
+    char *name;
+    uint64_t bytes;
+    time_t last_used;
+};
+
+/* Add up the disk usage below `dir_fd` (which is consumed) and find the latest access or modification time */
+static void measure_tree(int dir_fd, uint64_t *bytes, time_t *last_used) {
+    autoclosedir DIR *dir = fdopendir(dir_fd);
+    if (!dir) {
+        close(dir_fd);
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        if (STRING_EQUALS(entry->d_name, ".") || STRING_EQUALS(entry->d_name, ".."))
+            continue;
+
+        struct stat st;
+        if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+            continue;
+
+        *bytes += (uint64_t)st.st_blocks * 512;
+        if (st.st_atime > *last_used)
+            *last_used = st.st_atime;
+        if (st.st_mtime > *last_used)
+            *last_used = st.st_mtime;
+
+        if (S_ISDIR(st.st_mode)) {
+            int child_fd = openat(dirfd(dir), entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (child_fd >= 0)
+                measure_tree(child_fd, bytes, last_used);
+        }
+    }
+}
+
+static int compare_last_used(const void *a, const void *b) {
+    time_t ta = ((const struct cache_app *)a)->last_used;
+    time_t tb = ((const struct cache_app *)b)->last_used;
+    return ta < tb ? -1 : ta > tb;
+}
+
+/* Only one launch at a time, and not on every launch: measuring big caches isn't free */
+static int gc_claim(const char *cache_root) {
+    autofree char *stamp_path = nullptr;
+    join_paths(stamp_path, cache_root, SHADERCACHE_GC_STAMP);
+
+    int fd = open(stamp_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+
+    struct stat st;
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &st) != 0 ||
+        (st.st_size > 0 && time(nullptr) - st.st_mtime < SHADERCACHE_GC_INTERVAL)) {
+        close(fd);
+        return -1;
+    }
+
+    /* Any write moves the mtime, and a non-empty stamp means a check has happened */
+    if (pwrite(fd, "1", 1, 0) != 1) {
+        close(fd);
+        return -1;
+    }
+    futimens(fd, nullptr);
+    return fd;
+}
+
+static RESULT gc_run(const char *cache_root, const char *keep_dir, uint64_t max_bytes) {
+    autoclosedir DIR *root = opendir(cache_root);
+    if (!root)
+        return result_from_errno();
+
+    struct cache_app *apps = nullptr;
+    size_t count = 0, capacity = 0;
+    uint64_t total = 0;
+    RESULT result = RESULT_OK;
+
+    struct dirent *entry;
+    while ((entry = readdir(root)) != nullptr) {
+        if (entry->d_name[0] == '.')
+            continue;
+
+        int app_fd = openat(dirfd(root), entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (app_fd < 0)
+            continue;
+
+        struct cache_app app = {nullptr, 0, 0};
+        struct stat st;
+        if (fstat(app_fd, &st) == 0)
+            app.last_used = st.st_atime > st.st_mtime ? st.st_atime : st.st_mtime;
+        measure_tree(app_fd, &app.bytes, &app.last_used);
+        total += app.bytes;
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 32;
+            void *new_apps = realloc(apps, capacity * sizeof(*apps));
+            if (!new_apps) {
+                result = MAKE_RESULT(SEV_ERROR, CAT_SYSTEM, E_OUT_OF_MEMORY);
+                break;
+            }
+            apps = (struct cache_app *)new_apps;
+        }
+        app.name = strdup(entry->d_name);
+        apps[count++] = app;
+    }
+
+    if (!FAILED(result) && total > max_bytes) {
+        qsort(apps, count, sizeof(*apps), compare_last_used);
+
+        for (size_t i = 0; i < count && total > max_bytes; i++) {
+            autofree char *path = nullptr;
+            join_paths(path, cache_root, apps[i].name);
+            if (!path || (keep_dir && STRING_EQUALS(path, keep_dir)))
+                continue;
+
+            /* Another app that's running right now is using its cache */
+            if (registry_app_running(config::yawl_dir, apps[i].name))
+                continue;
+
+            char when[32];
+            struct tm tm;
+            strftime(when, sizeof(when), "%Y-%m-%d", localtime_r(&apps[i].last_used, &tm));
+            LOG_INFO("Evicting the shader cache of %s (%.1f MiB, last used %s)", apps[i].name,
+                     (double)apps[i].bytes / (1024 * 1024), when);
+
+            if (!FAILED(remove_dir(path)))
+                total -= apps[i].bytes;
+        }
+
+        if (total > max_bytes)
+            LOG_DEBUG("Shader caches still take %.1f MiB after eviction", (double)total / (1024 * 1024));
+    }
+
+    for (size_t i = 0; i < count; i++)
+        free(apps[i].name);
+    free(apps);
+
+    return result;
+}
+
+RESULT shadercache_gc(const char *keep_appid, uint64_t max_bytes) {
+    TRACE_SCOPE("shadercache_gc");
+
+    autofree char *cache_root = nullptr;
+    join_paths(cache_root, config::yawl_dir, SHADERCACHE_DIR);
+
+    /* Claimed here, so that launches in between don't even fork. The detached process shares the lock. */
+    autoclosefd int lock_fd = gc_claim(cache_root);
+    if (lock_fd < 0)
+        return RESULT_OK;
+
+    /* Measuring and deleting gigabytes of caches mustn't hold up the launch */
+    pid_t pid = fork_detached(10);
+    if (pid < 0)
+        return result_from_errno();
+
+    if (pid == 0) {
+        autofree char *keep_dir = app_dir(keep_appid);
+        RESULT result = gc_run(cache_root, keep_dir, max_bytes);
+        if (FAILED(result))
+            LOG_DEBUG_RESULT(result, "Couldn't check the shader cache budget");
+        _exit(0);
+    }
+
+    return RESULT_OK;
+}
@@ -0,0 +1,33 @@
+/*
+ * Managed shader caches
+ *
+ * DXVK, vkd3d-proton, Mesa and the NVIDIA driver each keep their shader caches wherever their defaults
+ * put them, which is often inside the prefix (lost on every prefix reset) or a directory that grows forever.
+ * Launches that set up a Proton compat data path point all of them at yawl_dir/shadercache/APPID instead,
+ * and the whole directory is kept under a size budget by evicting the least recently used apps' caches.
+ *
+ * Copyright (C) 2025 William Horvath
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ * See the full license text in the repository LICENSE file.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "result.hpp"
+
+#define SHADERCACHE_DIR "shadercache"
+#define SHADERCACHE_DEFAULT_MAX_MB (10 * 1024)
+#define SHADERCACHE_GC_INTERVAL (60 * 60) /* seconds between budget checks */
+
+/* Create the cache directories for `appid` and point the cache variables at them (unless they're set already).
+ * Returns RESULT_OK on success, error RESULT on failure */
+RESULT shadercache_setup(const char *appid);
+
+/* Evict the least recently used apps' caches until everything fits in `max_bytes`, in a detached process.
+ * The caches of `keep_appid` and of apps with a running container are never evicted. Does nothing if another
+ * launch is already at it, or if the last check was less than SHADERCACHE_GC_INTERVAL seconds ago.
+ * Returns RESULT_OK on success (including when there's nothing to do), error RESULT on failure */
+RESULT shadercache_gc(const char *keep_appid, uint64_t max_bytes);
@@ -0,0 +1,266 @@
+/*
+ * Resident supervisor for the runtime entry point
+ *
+ * Instead of replacing itself with the entry point, yawl forks it and stays around as
+ * PR_SET_CHILD_SUBREAPER, so that wine processes orphaned by their parents are reparented
+ * to (and reaped by) us. Since the kernel folds the rusage and I/O accounting of every reaped
+ * process into its parent, RUSAGE_CHILDREN and the /proc/self/io delta then cover the whole tree.
+ *
+ * Copyright (C) 2025 William Horvath
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ * See the full license text in the repository LICENSE file.
+ */
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "log.hpp"
+#include "macros.hpp"
+#include "supervisor.hpp"
+#include "trace.hpp"
+#include "util.hpp"
+
+#include "fmt/printf.h"
+
+/* Signals passed on to the child (unless they came from the terminal, which sends them to the whole group) */
+static constexpr int forwarded_signals[] = {SIGINT, SIGTERM, SIGHUP, SIGQUIT, SIGUSR1, SIGUSR2, SIGWINCH};
+
+struct io_counters {
+    unsigned long long rchar, wchar, syscr, syscw, read_bytes, write_bytes, cancelled_write_bytes;
+};
+
+static bool read_self_io(struct io_counters *io) {
+    autoclose FILE *fp = fopen("/proc/self/io", "re");
+    if (!fp)
+        return false;
+
+    memset(io, 0, sizeof(*io));
+    char key[64];
+    unsigned long long value;
+    while (fscanf(fp, "%63[^:]: %llu\n", key, &value) == 2) {
+        if (STRING_EQUALS(key, "rchar"))
+            io->rchar = value;
+        else if (STRING_EQUALS(key, "wchar"))
+            io->wchar = value;
+        else if (STRING_EQUALS(key, "syscr"))
+            io->syscr = value;
+        else if (STRING_EQUALS(key, "syscw"))
+            io->syscw = value;
+        else if (STRING_EQUALS(key, "read_bytes"))
+            io->read_bytes = value;
+        else if (STRING_EQUALS(key, "write_bytes"))
+            io->write_bytes = value;
+        else if (STRING_EQUALS(key, "cancelled_write_bytes"))
+            io->cancelled_write_bytes = value;
+    }
+
+    return true;
+}
+
+static double timespec_diff(const struct timespec *end, const struct timespec *start) {
+    return (double)(end->tv_sec - start->tv_sec) + (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void deadline_after_ms(struct timespec *deadline, long ms) {
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += ms / 1000;
+    deadline->tv_nsec += (ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+static double timeval_secs(const struct timeval *tv) { return (double)tv->tv_sec + (double)tv->tv_usec / 1e6; }
+
+/* Send `sig` to our direct children (orphans end up here), returns how many there were */
+static int signal_children(int sig) {
+    char path[64];
+    int count = 0;
+
+    snprintf(path, sizeof(path), "/proc/self/task/%d/children", getpid());
+    autoclose FILE *fp = fopen(path, "re");
+    if (!fp)
+        return 0;
+
+    int pid;
+    while (fscanf(fp, "%d", &pid) == 1) {
+        if (kill(pid, sig) == 0)
+            count++;
+    }
+
+    return count;
+}
+
+/* Reap everything that exited, returns false once there are no children left */
+static bool reap_children(pid_t main_pid, int *main_status, bool *main_exited) {
+    for (;;) {
+        int status;
+        pid_t pid = waitpid(-1, &status, WNOHANG);
+        if (pid > 0) {
+            if (pid == main_pid) {
+                *main_status = status;
+                *main_exited = true;
+            } else {
+                LOG_DEBUG("Supervisor: reaped orphan %d", pid);
+            }
+            continue;
+        }
+        return !(pid < 0 && errno == ECHILD);
+    }
+}
+
+/* Wait for children to exit until `deadline`, returns false once there are none left */
+static bool wait_children_until(const struct timespec *deadline, const sigset_t *sigchld, pid_t main_pid,
+                                int *main_status, bool *main_exited) {
+    for (;;) {
+        if (!reap_children(main_pid, main_status, main_exited))
+            return false;
+
+        struct timespec now, timeout;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (timespec_diff(deadline, &now) <= 0)
+            return true;
+
+        timeout = {.tv_sec = 0, .tv_nsec = 100 * 1000 * 1000};
+        sigtimedwait(sigchld, nullptr, &timeout);
+    }
+}
+
+static void report_usage(const struct timespec *start, const struct io_counters *io_start, bool have_io) {
+    struct timespec end;
+    struct rusage ru;
+    struct io_counters io_end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_CHILDREN, &ru);
+
+    fmt::fprintf(stderr,
+                 PROG_NAME ": wall %.2fs, user %.2fs, sys %.2fs, max RSS %ld KiB, "
+                           "major faults %ld, minor faults %ld, context switches %ld voluntary/%ld involuntary\n",
+                 timespec_diff(&end, start), timeval_secs(&ru.ru_utime), timeval_secs(&ru.ru_stime), ru.ru_maxrss,
+                 ru.ru_majflt, ru.ru_minflt, ru.ru_nvcsw, ru.ru_nivcsw);
+
+    if (have_io && read_self_io(&io_end)) {
+        fmt::fprintf(stderr,
+                     PROG_NAME ": I/O read %llu bytes (%llu from storage, %llu syscalls), "
+                               "written %llu bytes (%llu to storage, %llu cancelled, %llu syscalls)\n",
+                     io_end.rchar - io_start->rchar, io_end.read_bytes - io_start->read_bytes,
+                     io_end.syscr - io_start->syscr, io_end.wchar - io_start->wchar,
+                     io_end.write_bytes - io_start->write_bytes,
+                     io_end.cancelled_write_bytes - io_start->cancelled_write_bytes, io_end.syscw - io_start->syscw);
+    }
+}
+
+int supervise(char *const argv[], unsigned grace_secs, const struct capture_config *capture) {
+    struct timespec start;
+    struct io_counters io_start;
+    bool have_io = read_self_io(&io_start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (prctl(PR_SET_CHILD_SUBREAPER, 1UL) == -1)
+        LOG_WARNING("Failed to set child subreaper status: %s", strerror(errno));
+
+    /* Handle everything synchronously with sigwaitinfo(), the child gets the original mask back */
+    sigset_t handled, sigchld, old_mask;
+    sigemptyset(&handled);
+    sigemptyset(&sigchld);
+    sigaddset(&handled, SIGCHLD);
+    sigaddset(&sigchld, SIGCHLD);
+    for (int sig : forwarded_signals)
+        sigaddset(&handled, sig);
+    sigprocmask(SIG_BLOCK, &handled, &old_mask);
+
+    /* Without a capture, the child just keeps our stdout/stderr */
+    int capture_fds[2] = {-1, -1};
+    if (capture && FAILED(capture_start(capture, capture_fds)))
+        capture = nullptr;
+
+    uint64_t child_start_ns = trace_now_ns();
+    pid_t main_pid = fork();
+    if (main_pid < 0) {
+        LOG_ERROR("Failed to start the runtime: %s", strerror(errno));
+        if (capture) {
+            close(capture_fds[0]);
+            close(capture_fds[1]);
+            capture_stop(false);
+        }
+        return 1;
+    }
+    if (main_pid == 0) {
+        sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+        if (capture) {
+            dup2(capture_fds[0], STDOUT_FILENO);
+            dup2(capture_fds[1], STDERR_FILENO);
+        }
+        execv(argv[0], argv);
+        perror("Failed to execute runtime");
+        _exit(127);
+    }
+
+    /* Only the child (and its descendants) may hold the write ends, or the capture never sees EOF */
+    if (capture) {
+        close(capture_fds[0]);
+        close(capture_fds[1]);
+    }
+
+    LOG_DEBUG("Supervisor: started %s (pid %d)", argv[0], main_pid);
+
+    int main_status = 0;
+    bool main_exited = false;
+    while (!main_exited) {
+        siginfo_t info;
+        int sig = sigwaitinfo(&handled, &info);
+        if (sig < 0)
+            continue;
+
+        if (sig == SIGCHLD) {
+            reap_children(main_pid, &main_status, &main_exited);
+        } else if (info.si_code != SI_KERNEL) {
+            LOG_DEBUG("Supervisor: forwarding signal %d", sig);
+            kill(main_pid, sig);
+        }
+    }
+
+    if (child_start_ns)
+        trace_process(argv[0], main_pid, child_start_ns, trace_now_ns(), main_status);
+
+    /* Bounded teardown of whatever is left over (wineserver, stray helpers) */
+    if (grace_secs && signal_children(SIGTERM) > 0) {
+        struct timespec deadline;
+        deadline_after_ms(&deadline, grace_secs * 1000L);
+
+        LOG_DEBUG("Supervisor: waiting up to %u seconds for leftover processes", grace_secs);
+        if (wait_children_until(&deadline, &sigchld, main_pid, &main_status, &main_exited)) {
+            LOG_INFO("Supervisor: killing leftover processes after %u seconds", grace_secs);
+
+            /* Killed processes can leave more orphans behind, so repeat for a little while */
+            for (int i = 0; i < 20; i++) {
+                signal_children(SIGKILL);
+                deadline_after_ms(&deadline, 100);
+                if (!wait_children_until(&deadline, &sigchld, main_pid, &main_status, &main_exited))
+                    break;
+            }
+        }
+    } else {
+        reap_children(main_pid, &main_status, &main_exited);
+    }
+
+    if (capture)
+        capture_stop(!WIFEXITED(main_status) || WEXITSTATUS(main_status) != 0);
+
+    report_usage(&start, &io_start, have_io);
+
+    if (WIFEXITED(main_status))
+        return WEXITSTATUS(main_status);
+    if (WIFSIGNALED(main_status))
+        return 128 + WTERMSIG(main_status);
+    return 1;
+}
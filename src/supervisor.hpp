@@ -0,0 +1,20 @@
+/*
+ * Resident supervisor for the runtime entry point
+ *
+ * Copyright (C) 2025 William Horvath
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ * See the full license text in the repository LICENSE file.
+ */
+
+#pragma once
+
+#include "capture.hpp"
+
+/* Run the nullptr-terminated `argv` as a child, staying resident as the subreaper for the whole process tree:
+ * orphans are reaped, signals are forwarded to the child, and resource usage is reported once it exits.
+ * If `grace_secs` is non-zero, processes still left after the child exits get SIGTERM, and SIGKILL
+ * after `grace_secs` seconds.
+ * If `capture` is non-null, the child's stdout/stderr go through the output capture instead (see capture.hpp).
+ * Returns the child's exit status (shell convention, 128+N for signals) */
+int supervise(char *const argv[], unsigned grace_secs, const struct capture_config *capture);
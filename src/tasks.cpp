@@ -0,0 +1,168 @@
+/*
+ * Startup task graph
+ *
+ * Copyright (C) 2025 William Horvath
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ * See the full license text in the repository LICENSE file.
+ */
+
+#include <cstring>
+
+#include "log.hpp"
+#include "tasks.hpp"
+#include "trace.hpp"
+
+/* musl only gives threads 128KiB by default, which is too tight for curl/libarchive and our stack buffers */
+#define TASK_STACK_SIZE (1024 * 1024)
+
+/* The graph the calling thread is running a task for */
+static thread_local struct task_graph *current_graph = nullptr;
+
+int task_add(struct task_graph *graph, const char *name, task_fn fn, void *data, uint32_t deps, unsigned flags) {
+    if (!graph || !fn || graph->count >= TASK_MAX)
+        return -1;
+
+    /* Only allowing earlier tasks as dependencies keeps the graph acyclic */
+    if (deps & ~(TASK_DEP(graph->count) - 1))
+        return -1;
+
+    struct task *task = &graph->tasks[graph->count];
+    memset((void *)task, 0, sizeof(*task));
+    task->name = name;
+    task->fn = fn;
+    task->data = data;
+    task->deps = deps;
+    task->flags = flags;
+    task->result = MAKE_RESULT(SEV_ERROR, CAT_GENERAL, E_CANCELED);
+    task->graph = graph;
+
+    return (int)graph->count++;
+}
+
+bool task_canceled(void) {
+    for (struct task_graph *graph = current_graph; graph; graph = graph->parent) {
+        if (graph->canceled.load(std::memory_order_relaxed))
+            return true;
+    }
+    return false;
+}
+
+static RESULT task_execute(struct task *task) {
+    struct task_graph *prev_graph = current_graph;
+    current_graph = task->graph;
+
+    uint64_t start_ns = trace_now_ns();
+    RESULT result = task->fn(task->data);
+    if (start_ns)
+        trace_end(task->name, start_ns);
+
+    current_graph = prev_graph;
+    return result;
+}
+
+static void *task_thread(void *arg) {
+    struct task *task = (struct task *)arg;
+    RESULT result = task_execute(task);
+
+    pthread_mutex_lock(&task->graph->lock);
+    task->result = result;
+    task->finished = true;
+    pthread_cond_signal(&task->graph->cond);
+    pthread_mutex_unlock(&task->graph->lock);
+
+    return nullptr;
+}
+
+RESULT task_graph_run(struct task_graph *graph) {
+    if (!graph)
+        return MAKE_RESULT(SEV_ERROR, CAT_GENERAL, E_INVALID_ARG);
+
+    TRACE_SCOPE("task_graph_run");
+
+    graph->parent = current_graph;
+    pthread_mutex_init(&graph->lock, nullptr);
+    pthread_cond_init(&graph->cond, nullptr);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, TASK_STACK_SIZE);
+
+    uint32_t all_mask = TASK_DEP(graph->count) - 1;
+    uint32_t started_mask = 0, done_mask = 0, failed_mask = 0;
+    RESULT result = RESULT_OK;
+
+    pthread_mutex_lock(&graph->lock);
+
+    while (done_mask != all_mask) {
+        bool progress = false;
+
+        /* Collect finished tasks */
+        for (unsigned i = 0; i < graph->count; i++) {
+            struct task *task = &graph->tasks[i];
+            if (!task->finished || (done_mask & TASK_DEP(i)))
+                continue;
+
+            done_mask |= TASK_DEP(i);
+            progress = true;
+            if (!FAILED(task->result))
+                continue;
+
+            failed_mask |= TASK_DEP(i);
+            if ((task->flags & TASK_FATAL) && !FAILED(result)) {
+                LOG_DEBUG("Task %s failed, canceling the remaining startup tasks", task->name);
+                result = task->result;
+                graph->canceled.store(true, std::memory_order_relaxed);
+            }
+        }
+
+        /* Start (or skip) everything that became ready */
+        for (unsigned i = 0; i < graph->count; i++) {
+            struct task *task = &graph->tasks[i];
+            if (started_mask & TASK_DEP(i))
+                continue;
+
+            if ((task->deps & failed_mask) || task_canceled() || graph->canceled.load(std::memory_order_relaxed)) {
+                /* Never ran, task->result stays E_CANCELED */
+                started_mask |= TASK_DEP(i);
+                task->finished = true;
+                progress = true;
+                continue;
+            }
+
+            if (task->deps & ~done_mask)
+                continue;
+
+            started_mask |= TASK_DEP(i);
+            progress = true;
+            if (pthread_create(&task->thread, &attr, task_thread, task) == 0) {
+                task->threaded = true;
+                continue;
+            }
+
+            /* Couldn't get a thread, just run it here */
+            LOG_DEBUG("Failed to create a thread for task %s, running it inline", task->name);
+            pthread_mutex_unlock(&graph->lock);
+            RESULT task_result = task_execute(task);
+            pthread_mutex_lock(&graph->lock);
+            task->result = task_result;
+            task->finished = true;
+        }
+
+        if (!progress)
+            pthread_cond_wait(&graph->cond, &graph->lock);
+    }
+
+    pthread_mutex_unlock(&graph->lock);
+
+    for (unsigned i = 0; i < graph->count; i++) {
+        if (graph->tasks[i].threaded)
+            pthread_join(graph->tasks[i].thread, nullptr);
+    }
+
+    pthread_attr_destroy(&attr);
+    pthread_cond_destroy(&graph->cond);
+    pthread_mutex_destroy(&graph->lock);
+
+    return result;
+}
@@ -0,0 +1,72 @@
+/*
+ * Startup task graph
+ *
+ * A tiny dependency-aware executor for the independent parts of startup (update checks,
+ * runtime verification, environment construction). Every task whose dependencies have
+ * completed runs on its own thread; the first failing fatal task cancels the rest.
+ *
+ * Copyright (C) 2025 William Horvath
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ * See the full license text in the repository LICENSE file.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <pthread.h>
+
+#include "result.hpp"
+
+#define TASK_MAX 16
+
+/* Dependency mask for the task index returned by task_add() */
+#define TASK_DEP(idx) (1u << (idx))
+
+/* Task flags */
+#define TASK_FATAL (1u << 0) /* A failure cancels the whole graph and is returned by task_graph_run() */
+
+typedef RESULT (*task_fn)(void *data);
+
+struct task_graph;
+
+struct task {
+    const char *name;
+    task_fn fn;
+    void *data;
+    uint32_t deps;
+    unsigned flags;
+    RESULT result; /* Valid after task_graph_run(); E_CANCELED if the task never ran */
+
+    /* Internal */
+    struct task_graph *graph;
+    pthread_t thread;
+    bool threaded;
+    bool finished;
+};
+
+struct task_graph {
+    struct task tasks[TASK_MAX];
+    unsigned count;
+    std::atomic<bool> canceled;
+
+    /* Internal */
+    struct task_graph *parent;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/* Add a task to `graph`, to be run once all tasks in the `deps` mask (built with TASK_DEP) have succeeded.
+ * Tasks can only depend on tasks that were added before them.
+ * Returns the task index, or -1 if the graph is full or `deps` is invalid */
+int task_add(struct task_graph *graph, const char *name, task_fn fn, void *data, uint32_t deps, unsigned flags);
+
+/* Run all tasks in `graph` and wait for them. Tasks whose dependencies failed are skipped.
+ * Graphs can be nested: a graph run from inside a task is canceled along with its parent.
+ * Returns RESULT_OK, or the result of the first fatal task that failed */
+RESULT task_graph_run(struct task_graph *graph);
+
+/* Whether the graph (or any parent graph) the calling thread is running a task for has been canceled.
+ * Long-running work (downloads, extraction) should poll this and bail out early. */
+bool task_canceled(void);
@@ -0,0 +1,194 @@
+/*
+ * Startup tracing (Chrome trace-event JSON)
+ *
+ * Events are kept in a fixed-size table and appended to the YAWL_TRACE file in the
+ * JSON array format, which allows the closing bracket to be omitted. That way every
+ * process in a launch (restarts, helpers, daemons) can append to the same file, and
+ * the result can be loaded directly in Perfetto or chrome://tracing.
+ *
+ * Copyright (C) 2025 William Horvath
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ * See the full license text in the repository LICENSE file.
+ */
+
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "trace.hpp"
+#include "util.hpp"
+
+#include "fmt/format.h"
+
+#define TRACE_MAX_EVENTS 512
+
+/* Slots are reserved before they're filled in, so trace_finish() only reads the ones marked ready */
+enum trace_slot_state : uint8_t {
+    TRACE_SLOT_WRITING = 0,
+    TRACE_SLOT_READY,
+    TRACE_SLOT_FLUSHED,
+};
+
+struct trace_event {
+    std::atomic<uint8_t> state;
+    char name[64];
+    uint64_t start_ns;
+    uint64_t end_ns;
+    pid_t pid;
+    pid_t tid;
+    char phase; /* 'X' = complete span, 'i' = instant */
+    int exit_status;
+};
+
+static trace_event events[TRACE_MAX_EVENTS];
+static std::atomic<unsigned> event_count = 0;
+static unsigned flushed_count = 0; /* every slot below this one is flushed */
+static bool header_written = false;
+static const char *trace_path = nullptr;
+
+static forceinline uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void trace_init(void) {
+    const char *path = getenv("YAWL_TRACE");
+    if (!path || !*path)
+        return;
+
+    trace_path = path;
+    atexit(trace_finish);
+}
+
+bool trace_enabled(void) { return trace_path != nullptr; }
+
+uint64_t trace_now_ns(void) { return trace_path ? monotonic_ns() : 0; }
+
+static trace_event *trace_reserve(void) {
+    unsigned idx = event_count.fetch_add(1, std::memory_order_relaxed);
+    if (idx >= TRACE_MAX_EVENTS)
+        return nullptr;
+    return &events[idx];
+}
+
+static void trace_record(char phase, const char *name, pid_t pid, pid_t tid, uint64_t start_ns, uint64_t end_ns,
+                         int exit_status) {
+    if (!trace_path)
+        return;
+
+    trace_event *ev = trace_reserve();
+    if (!ev)
+        return;
+
+    snprintf(ev->name, sizeof(ev->name), "%s", name);
+    ev->start_ns = start_ns;
+    ev->end_ns = end_ns;
+    ev->pid = pid;
+    ev->tid = tid;
+    ev->phase = phase;
+    ev->exit_status = exit_status;
+    ev->state.store(TRACE_SLOT_READY, std::memory_order_release);
+}
+
+void trace_end(const char *name, uint64_t start_ns) {
+    trace_record('X', name, getpid(), (pid_t)syscall(SYS_gettid), start_ns, monotonic_ns(), 0);
+}
+
+void trace_process(const char *name, pid_t pid, uint64_t start_ns, uint64_t end_ns, int exit_status) {
+    const char *base = strrchr(name, '/');
+    trace_record('X', base ? base + 1 : name, pid, pid, start_ns, end_ns, exit_status);
+}
+
+void trace_instant(const char *name) {
+    uint64_t now = trace_now_ns();
+    trace_record('i', name, getpid(), (pid_t)syscall(SYS_gettid), now, now, 0);
+}
+
+/* Minimal JSON string escaping, names are short and mostly plain ASCII */
+static void append_json_string(std::string &out, const char *str) {
+    out += '"';
+    for (const char *c = str; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            out += '\\';
+            out += *c;
+        } else if ((unsigned char)*c < 0x20) {
+            out += fmt::format("\\u{:04x}", (unsigned)*c);
+        } else {
+            out += *c;
+        }
+    }
+    out += '"';
+}
+
+/* Chrome traces use microseconds, keep the nanoseconds as the fractional part */
+static void append_us(std::string &out, uint64_t ns) { out += fmt::format("{}.{:03}", ns / 1000, ns % 1000); }
+
+void trace_finish(void) {
+    if (!trace_path)
+        return;
+
+    unsigned count = event_count.load(std::memory_order_acquire);
+    if (count > TRACE_MAX_EVENTS)
+        count = TRACE_MAX_EVENTS;
+    if (count <= flushed_count)
+        return;
+
+    std::string out;
+    for (unsigned i = flushed_count; i < count; i++) {
+        trace_event *ev = &events[i];
+        /* Still being written by another thread, it's picked up by the next call */
+        if (ev->state.load(std::memory_order_acquire) != TRACE_SLOT_READY)
+            continue;
+
+        if (!header_written) {
+            out += fmt::format(R"({{"name":"process_name","ph":"M","pid":{},"args":{{"name":)", getpid());
+            append_json_string(out, program_invocation_short_name);
+            out += "}},\n";
+            header_written = true;
+        }
+
+        out += R"({"name":)";
+        append_json_string(out, ev->name);
+        out += fmt::format(R"(,"cat":"{}","ph":"{}","pid":{},"tid":{},"ts":)", ev->pid == getpid() ? "yawl" : "process",
+                           ev->phase, ev->pid, ev->tid);
+        append_us(out, ev->start_ns);
+        if (ev->phase == 'X') {
+            out += R"(,"dur":)";
+            append_us(out, ev->end_ns - ev->start_ns);
+            out += fmt::format(R"(,"args":{{"dur_ns":{})", ev->end_ns - ev->start_ns);
+            if (ev->pid != getpid())
+                out += fmt::format(R"(,"exit_status":{})", ev->exit_status);
+            out += "}";
+        } else {
+            out += R"(,"s":"p")";
+        }
+        out += "},\n";
+        ev->state.store(TRACE_SLOT_FLUSHED, std::memory_order_relaxed);
+    }
+    while (flushed_count < count && events[flushed_count].state.load(std::memory_order_relaxed) == TRACE_SLOT_FLUSHED)
+        flushed_count++;
+    if (out.empty())
+        return;
+
+    int fd = open(trace_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return;
+
+    /* Start a new trace file with the array opener, otherwise keep appending */
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size == 0)
+        out.insert(0, "[\n");
+
+    /* One write() so that concurrent processes don't interleave their events */
+    if (write(fd, out.data(), out.size()) != (ssize_t)out.size()) {
+    } /* nothing useful to do here */
+    close(fd);
+}
@@ -0,0 +1,55 @@
+/*
+ * Startup tracing (Chrome trace-event JSON)
+ *
+ * Copyright (C) 2025 William Horvath
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ * See the full license text in the repository LICENSE file.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <unistd.h>
+
+#include "macros.hpp"
+
+/* Enable tracing if YAWL_TRACE=path is set. Must be called first thing in main(). */
+void trace_init(void);
+
+/* Whether YAWL_TRACE is active */
+bool trace_enabled(void);
+
+/* Monotonic clock in nanoseconds (0 if tracing is disabled) */
+uint64_t trace_now_ns(void);
+
+/* Record a completed span from start_ns until now, on the calling thread */
+void trace_end(const char *name, uint64_t start_ns);
+
+/* Record a completed span for a child process (shown on its own track in the viewer) */
+void trace_process(const char *name, pid_t pid, uint64_t start_ns, uint64_t end_ns, int exit_status);
+
+/* Record an instant event (e.g. the final execv) */
+void trace_instant(const char *name);
+
+/* Append all recorded events to the YAWL_TRACE file. Safe to call more than once. */
+void trace_finish(void);
+
+struct trace_scope {
+    const char *name;
+    uint64_t start_ns;
+};
+
+static forceinline trace_scope trace_scope_begin(const char *name) { return {name, trace_now_ns()}; }
+
+static forceinline void trace_scope_end(trace_scope *scope) {
+    if (scope->start_ns)
+        trace_end(scope->name, scope->start_ns);
+}
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+/* Trace the enclosing scope as a span named `name` (a string literal) */
+#define TRACE_SCOPE(name)                                                                                              \
+    [[gnu::cleanup(trace_scope_end)]] trace_scope TRACE_CONCAT(_trace_scope_, __LINE__) = trace_scope_begin(name)
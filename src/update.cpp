@@ -9,10 +9,15 @@
 
 #include "config.h"
 
+#include <cctype>
+#include <climits>
 #include <fcntl.h>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -21,16 +26,29 @@
 
 #include "log.hpp"
 #include "macros.hpp"
+#include "trace.hpp"
 #include "update.hpp"
 #include "util.hpp"
 #include "yawlconfig.hpp"
 
 #include "fmt/printf.h"
 
+#include <zstd.h>
+
 #define GITHUB_API_RELEASES_URL "https://api.github.com/repos/whrvt/" PROG_NAME "/releases/latest"
 #define GITHUB_RELEASES_PAGE_URL PACKAGE_URL "/releases/download"
 #define UPDATE_USER_AGENT PROG_NAME "-updater/" VERSION
 
+#define UPDATE_CACHE_FILE "update_check.cache"
+#define UPDATE_LOCK_FILE "update_check.lock"
+#define UPDATE_TAG_SUFFIX ".tag" /* next to a staged binary: the release tag it was downloaded from */
+
+/* Published next to each release binary: its SHA-256 (sha256sum format), and optionally a patch from the
+ * previous release made with `zstd --patch-from=OLD NEW -o NEW.patch-from-vOLD_VERSION.zst` */
+#define UPDATE_HASH_SUFFIX ".sha256"
+#define UPDATE_PATCH_SUFFIX ".patch-from-v" VERSION ".zst"
+#define UPDATE_PATCH_WINDOW_LOG_MAX 30
+
 /* json-glib specific cleanup */
 static forceinline void cleanup_json_parser(void *p) {
     JsonParser **parser = (JsonParser **)p;
@@ -118,121 +136,6 @@ static RESULT make_executable(const char *file_path) {
     return RESULT_OK;
 }
 
-static RESULT copy_file_raw(const char *source, const char *destination, int use_temp) {
-    autofree char *actual_dest = nullptr;
-
-    if (use_temp)
-        append_sep(actual_dest, "", destination, ".tmp");
-    else
-        actual_dest = strdup(destination);
-
-    /* Open source file (scoped) */
-    {
-        autoclose FILE *src = fopen(source, "rb");
-        if (!src)
-            return result_from_errno();
-
-        /* Open destination file in its own scope */
-        autoclose FILE *dst = fopen(actual_dest, "wb");
-        if (!dst)
-            return result_from_errno();
-
-        /* Copy the file contents in chunks */
-        char buffer[BUFFER_SIZE];
-        size_t bytes_read;
-        while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, src)) > 0) {
-            if (fwrite(buffer, 1, bytes_read, dst) != bytes_read) {
-                RESULT result = result_from_errno();
-                LOG_RESULT(Level::Error, result, "Failed to write to destination file");
-                unlink(actual_dest);
-                return result;
-            }
-        }
-
-        if (ferror(src)) {
-            RESULT result = result_from_errno();
-            LOG_RESULT(Level::Error, result, "Failed to read from source file");
-            unlink(actual_dest);
-            return result;
-        }
-
-        /* Ensure all data is written */
-        fflush(dst);
-
-        /* Preserve perms */
-        struct stat src_stat;
-        if (stat(source, &src_stat) == 0)
-            fchmod(fileno(dst), src_stat.st_mode);
-    }
-    /* Files are now closed */
-
-    /* If we're using a temp file, rename it to the actual destination */
-    if (use_temp) {
-        if (rename(actual_dest, destination) != 0) {
-            if (errno == EXDEV) {
-                LOG_DEBUG("Cross-device rename detected, trying direct copy");
-                RESULT result = copy_file_raw(actual_dest, destination, 0);
-                unlink(actual_dest);
-                return result;
-            } else {
-                RESULT result = result_from_errno();
-                LOG_RESULT(Level::Error, result, "Failed to rename temporary file");
-                unlink(actual_dest);
-                return result;
-            }
-        }
-    }
-
-    return RESULT_OK;
-}
-
-/* Fallback for when source and destination are on different filesystems (e.g. ext4->btrfs) */
-static RESULT copy_file(const char *source, const char *destination) {
-    RESULT result = RESULT_OK;
-
-    autofree char *backup_file = nullptr;
-    join_paths(backup_file, config::yawl_dir, PROG_NAME ".bak");
-
-    if (access(destination, F_OK) == 0) {
-        if (access(backup_file, F_OK) == 0)
-            unlink(backup_file);
-        if (rename(destination, backup_file) != 0) {
-            if (errno == EXDEV) {
-                LOG_DEBUG("Creating backup using copy (cross-device)");
-                result = copy_file_raw(destination, backup_file, 0);
-                if (FAILED(result)) {
-                    LOG_RESULT(Level::Error, result, "Failed to create backup copy");
-                    return result;
-                }
-            } else {
-                result = result_from_errno();
-                /* too dangerous to try continuing */
-                LOG_RESULT(Level::Error, result, "Failed to create backup");
-                return result;
-            }
-        }
-    }
-
-    result = copy_file_raw(source, destination, 1);
-    if (FAILED(result)) {
-        LOG_RESULT(Level::Error, result, "Failed to copy new binary");
-        if (access(backup_file, F_OK) == 0) {
-            LOG_INFO("Restoring from backup");
-            if (rename(backup_file, destination) != 0) {
-                if (errno == EXDEV) {
-                    RESULT restore_result = copy_file_raw(backup_file, destination, 0);
-                    if (FAILED(restore_result))
-                        LOG_RESULT(Level::Error, restore_result, "Failed to restore from backup");
-                }
-            }
-        }
-        return result;
-    }
-
-    LOG_DEBUG("Backup created at %s", backup_file);
-    return RESULT_OK;
-}
-
 /* This is required for musl, there's no wrapper for renameat2 like glibc */
 #define RENAME_NOREPLACE (1 << 0)
 #define RENAME_EXCHANGE (1 << 1)
@@ -253,46 +156,143 @@ static inline long renameat2(int, const char *, int, const char *, unsigned) {
 #endif
 #endif
 
+/* fsync() a file or directory by path, so that its data (or the renames in it) survive a crash */
+static void sync_path(const char *path, bool parent) {
+    autofree char *dir = parent ? strdup(path) : nullptr;
+    if (parent) {
+        char *last_slash = dir ? strrchr(dir, '/') : nullptr;
+        if (!last_slash)
+            return;
+        *last_slash = '\0';
+        path = dir[0] ? dir : "/";
+    }
+
+    autoclosefd int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0)
+        fsync(fd);
+}
+
+/* Put `new_name` in place of `name` (both in `dir_fd`), keeping the previous file as NAME.bak.
+ * With RENAME_EXCHANGE the swap is a single step; otherwise the old file is hardlinked to the backup name
+ * first and then atomically replaced, so `name` never stops existing either way. */
+static RESULT swap_into_place(int dir_fd, const char *new_name, const char *name) {
+    autofree char *backup_name = nullptr;
+    append_sep(backup_name, "", name, ".bak");
+
+    if (renameat2(dir_fd, new_name, dir_fd, name, RENAME_EXCHANGE) == 0) {
+        /* `new_name` holds the previous file now */
+        unlinkat(dir_fd, backup_name, 0);
+        if (renameat(dir_fd, new_name, dir_fd, backup_name) != 0)
+            unlinkat(dir_fd, new_name, 0);
+    } else {
+        if (errno != ENOENT && errno != ENOSYS && errno != EINVAL)
+            LOG_DEBUG_RESULT(result_from_errno(), "renameat2 failed");
+
+        unlinkat(dir_fd, backup_name, 0);
+        if (linkat(dir_fd, name, dir_fd, backup_name, 0) != 0 && errno != ENOENT)
+            return result_from_errno();
+        if (renameat(dir_fd, new_name, dir_fd, name) != 0)
+            return result_from_errno();
+    }
+
+    fsync(dir_fd);
+    LOG_DEBUG("Backup created at %s", backup_name);
+    return RESULT_OK;
+}
+
+/* Copy `source` next to `destination` and swap it in, for when they're on different filesystems.
+ * The copy is made in an O_TMPFILE, which only gets a name once it's complete and synced, so an
+ * interrupted update never leaves a half-written binary behind (filesystems without O_TMPFILE get a
+ * hidden temporary name instead). */
+static RESULT install_copy(const char *source, const char *destination) {
+    autofree char *dir = strdup(destination);
+    char *last_slash = dir ? strrchr(dir, '/') : nullptr;
+    if (!last_slash)
+        return MAKE_RESULT(SEV_ERROR, CAT_FILESYSTEM, E_INVALID_ARG);
+    *last_slash = '\0';
+    const char *name = last_slash + 1;
+
+    autoclosefd int dir_fd = open(dir[0] ? dir : "/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    autoclosefd int src_fd = open(source, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (dir_fd < 0 || src_fd < 0 || fstat(src_fd, &st) != 0)
+        return result_from_errno();
+
+    char tmp_name[NAME_MAX + 1];
+    snprintf(tmp_name, sizeof(tmp_name), ".%.200s.new-%d", name, getpid());
+    unlinkat(dir_fd, tmp_name, 0);
+
+    autoclosefd int out_fd = openat(dir_fd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, st.st_mode & 07777);
+    bool anonymous = out_fd >= 0;
+    if (!anonymous)
+        out_fd = openat(dir_fd, tmp_name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st.st_mode & 07777);
+    if (out_fd < 0)
+        return result_from_errno();
+
+    RESULT result = RESULT_OK;
+    if (!copy_fd_data(src_fd, out_fd) || fchmod(out_fd, st.st_mode & 07777) != 0 || fsync(out_fd) != 0) {
+        result = result_from_errno();
+        LOG_RESULT(Level::Error, result, "Failed to copy the new binary");
+    } else if (anonymous) {
+        /* linkat(AT_EMPTY_PATH) needs CAP_DAC_READ_SEARCH, going through /proc doesn't */
+        char fd_path[64];
+        snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", out_fd);
+        if (linkat(AT_FDCWD, fd_path, dir_fd, tmp_name, AT_SYMLINK_FOLLOW) != 0)
+            result = result_from_errno();
+    }
+
+    if (!FAILED(result))
+        result = swap_into_place(dir_fd, tmp_name, name);
+    if (FAILED(result))
+        unlinkat(dir_fd, tmp_name, 0);
+
+    return result;
+}
+
 /* Replace the current binary with the new one */
 static RESULT replace_binary(const char *new_binary, const char *current_binary) {
     struct stat src_stat, dst_stat;
 
-    /* Need to manually copy if new/current are on different filesystems */
     if (stat(new_binary, &src_stat) != 0 || stat(current_binary, &dst_stat) != 0)
         return result_from_errno();
 
-    if (src_stat.st_dev == dst_stat.st_dev) {
-        if (!renameat2(AT_FDCWD, new_binary, AT_FDCWD, current_binary, RENAME_EXCHANGE))
-            return RESULT_OK;
-        if (errno != ENOSYS && errno != EINVAL && errno != ENOTTY)
-            LOG_DEBUG_RESULT(result_from_errno(), "renameat2 failed");
+    /* Need to copy if new/current are on different filesystems */
+    if (src_stat.st_dev != dst_stat.st_dev) {
+        LOG_DEBUG("Files on different filesystems, using copy method");
+        return install_copy(new_binary, current_binary);
+    }
 
-        /* Fallback method: Create a backup and use rename */
-        autofree char *backup_file = nullptr;
-        append_sep(backup_file, "", current_binary, ".bak");
+    /* The new binary has to be on disk before anything points at it */
+    sync_path(new_binary, false);
 
-        /* Step 1: Backup the current binary */
-        if (access(backup_file, F_OK) == 0)
-            if (unlink(backup_file) != 0)
-                return result_from_errno();
+    if (!renameat2(AT_FDCWD, new_binary, AT_FDCWD, current_binary, RENAME_EXCHANGE)) {
+        sync_path(current_binary, true);
+        sync_path(new_binary, true);
+        return RESULT_OK;
+    }
+    if (errno != ENOSYS && errno != EINVAL && errno != ENOTTY)
+        LOG_DEBUG_RESULT(result_from_errno(), "renameat2 failed");
 
-        if (link(current_binary, backup_file) != 0)
-            return result_from_errno();
+    /* Fallback method: keep a hardlink of the current binary as a backup, then rename over it */
+    autofree char *backup_file = nullptr;
+    append_sep(backup_file, "", current_binary, ".bak");
 
-        /* Step 2: Replace the current binary with the new one */
-        if (rename(new_binary, current_binary) != 0) {
-            RESULT result = result_from_errno();
-            LOG_ERROR("Failed to replace binary, restoring from backup");
-            unlink(current_binary);
-            rename(backup_file, current_binary);
-            return result;
-        }
+    if (access(backup_file, F_OK) == 0 && unlink(backup_file) != 0)
+        return result_from_errno();
+    if (link(current_binary, backup_file) != 0)
+        return result_from_errno();
 
-        LOG_DEBUG("Backup created at %s", backup_file);
-        return RESULT_OK;
+    /* rename() is atomic, the current binary is untouched if it fails */
+    if (rename(new_binary, current_binary) != 0) {
+        RESULT result = result_from_errno();
+        LOG_RESULT(Level::Error, result, "Failed to replace binary");
+        unlink(backup_file);
+        return result;
     }
-    LOG_DEBUG("Files on different filesystems, using copy method");
-    return copy_file(new_binary, current_binary);
+
+    sync_path(current_binary, true);
+    LOG_DEBUG("Backup created at %s", backup_file);
+    return RESULT_OK;
 }
 
 /* Parse version string and return a comparable integer */
@@ -310,29 +310,121 @@ static int parse_version(const char *version) {
     return (major * 10000) + (minor * 100) + patch;
 }
 
-static RESULT check_for_updates(void) {
+/* How long a previous check result stays valid, from YAWL_UPDATE_TTL (0 = always ask GitHub) */
+static time_t update_cache_ttl(void) {
+    const char *ttl_env = getenv("YAWL_UPDATE_TTL");
+    if (!ttl_env || !*ttl_env)
+        return UPDATE_DEFAULT_TTL;
+    long long ttl = strtoll(ttl_env, nullptr, 10);
+    return ttl > 0 ? (time_t)ttl : 0;
+}
+
+/* Read the cached result of the last successful check, if it's not older than the TTL.
+ * The cache is a single line: "<unix time> <latest tag> <download url>" */
+static bool read_update_cache(char *tag_name[], char *download_url[]) {
+    autofree char *cache_path = nullptr;
+    char tag[64] = {}, url[1024] = {};
+    long long checked = 0;
+
+    time_t ttl = update_cache_ttl();
+    if (!ttl)
+        return false;
+
+    join_paths(cache_path, config::yawl_dir, UPDATE_CACHE_FILE);
+    autoclose FILE *fp = fopen(cache_path, "r");
+    if (!fp || fscanf(fp, "%lld %63s %1023s", &checked, tag, url) != 3)
+        return false;
+
+    time_t now = time(nullptr);
+    if (checked > now || now - checked >= ttl)
+        return false;
+
+    *tag_name = strdup(tag);
+    *download_url = strdup(url);
+    return *tag_name && *download_url;
+}
+
+static void write_update_cache(const char *tag_name, const char *download_url) {
+    autofree char *cache_path = nullptr;
+    autofree char *temp_path = nullptr;
+
+    join_paths(cache_path, config::yawl_dir, UPDATE_CACHE_FILE);
+    append_sep(temp_path, "", cache_path, ".tmp");
+
+    {
+        autoclose FILE *fp = fopen(temp_path, "w");
+        if (!fp)
+            return;
+        fmt::fprintf(fp, "%lld %s %s\n", (long long)time(nullptr), tag_name, download_url);
+    }
+
+    /* Concurrent launches only ever see a complete cache file */
+    if (rename(temp_path, cache_path) != 0)
+        unlink(temp_path);
+}
+
+/* Where a downloaded binary waits before replacing the running one: next to it if that's writable,
+ * otherwise in yawl_dir */
+static char *staged_binary_path(const char *self_path) {
+    char *staged_path = nullptr;
+    autofree char *self_dir = strdup(self_path);
+
+    if (self_dir) {
+        char *last_slash = strrchr(self_dir, '/');
+        if (last_slash) {
+            *last_slash = '\0'; /* Truncate to get directory */
+
+            /* Check if directory is writable */
+            if (access(self_dir, W_OK) == 0) {
+                LOG_DEBUG("Using executable directory for download: %s", self_dir);
+                join_paths(staged_path, self_dir, PROG_NAME ".new");
+                return staged_path;
+            }
+        }
+    }
+
+    /* Use yawl_dir if exec dir is unwritable */
+    LOG_DEBUG("Using yawl directory for download: %s", config::yawl_dir);
+    join_paths(staged_path, config::yawl_dir, PROG_NAME ".new");
+    return staged_path;
+}
+
+/* Check for a release newer than ours. Its download URL goes into `download_url`, and its tag into `latest_tag`
+ * if that's not nullptr (the caller frees both) */
+static RESULT check_for_updates(char *download_url[], char *latest_tag[]) {
     autofree char *release_file = nullptr;
     autofree char *tag_name = nullptr;
-    autofree char *download_url = nullptr;
     RESULT result;
     const char *headers[] = {"Accept: application/vnd.github+json", "X-GitHub-Api-Version: 2022-11-28",
                              "User-Agent: " UPDATE_USER_AGENT, nullptr};
 
-    LOG_INFO("Checking for updates...");
+    *download_url = nullptr;
 
-    /* Download release information */
-    join_paths(release_file, config::yawl_dir, "latest_release.json");
-    result = download_file(GITHUB_API_RELEASES_URL, release_file, headers);
-    if (FAILED(result)) {
-        LOG_RESULT(Level::Error, result, "Failed to download release information");
-        return result;
-    }
+    if (read_update_cache(&tag_name, download_url)) {
+        LOG_DEBUG("Using the cached update check result (latest: %s)", tag_name);
+    } else {
+        free(tag_name);
+        tag_name = nullptr;
+        free(*download_url);
+        *download_url = nullptr;
+
+        LOG_INFO("Checking for updates...");
+
+        /* Download release information */
+        join_paths(release_file, config::yawl_dir, "latest_release.json");
+        result = download_file(GITHUB_API_RELEASES_URL, release_file, headers);
+        if (FAILED(result)) {
+            LOG_RESULT(Level::Error, result, "Failed to download release information");
+            return result;
+        }
 
-    /* Parse release information */
-    result = parse_release_info(release_file, &tag_name, &download_url);
-    if (FAILED(result)) {
+        /* Parse release information */
+        result = parse_release_info(release_file, &tag_name, download_url);
         unlink(release_file);
-        return result;
+        if (FAILED(result))
+            return result;
+
+        write_update_cache(tag_name, *download_url);
     }
 
     /* Compare versions */
@@ -341,81 +433,182 @@ static RESULT check_for_updates(void) {
 
     if (latest_version <= current_version) {
         LOG_INFO("You are already running the latest version (%s).", VERSION);
-        unlink(release_file);
         return RESULT_OK;
     }
 
     LOG_INFO("Update available: %s -> %s", "v" VERSION, tag_name);
+    if (latest_tag)
+        *latest_tag = strdup(tag_name);
+    return MAKE_RESULT(SEV_INFO, CAT_GENERAL, E_UPDATE_AVAILABLE);
+}
 
-    /* Save download URL for later use */
-    autoclose FILE *fp = fopen(release_file, "w");
-    if (fp)
-        fmt::fprintf(fp, "%s", download_url);
+/* Fetch the published hash of the binary at `download_url` into `hash` (lowercase hex) */
+static bool fetch_release_hash(const char *download_url, const char *staged_path, char hash[65]) {
+    autofree_del char *hash_path = nullptr;
+    autofree char *hash_url = nullptr;
+    append_sep(hash_path, "", staged_path, UPDATE_HASH_SUFFIX);
+    append_sep(hash_url, "", download_url, UPDATE_HASH_SUFFIX);
 
-    return MAKE_RESULT(SEV_INFO, CAT_GENERAL, E_UPDATE_AVAILABLE);
+    if (FAILED(download_file(hash_url, hash_path, nullptr)))
+        return false;
+
+    autoclose FILE *fp = fopen(hash_path, "re");
+    if (!fp || fscanf(fp, "%64s", hash) != 1 || strlen(hash) != 64)
+        return false;
+
+    for (char *c = hash; *c; c++) {
+        if (!isxdigit((unsigned char)*c))
+            return false;
+        *c = (char)tolower((unsigned char)*c);
+    }
+    return true;
 }
 
-static RESULT perform_update(void) {
-    autofree_del char *release_file = nullptr;
-    autofree_del char *temp_binary = nullptr;
-    autofree char *self_path = nullptr;
-    autofree char *download_dir = nullptr;
-    char download_url[1024] = {};
-    RESULT result;
+static RESULT verify_release_hash(const char *path, const char *expected_hash) {
+    char actual_hash[65];
+    RETURN_IF_FAILED(calculate_sha256(path, actual_hash));
 
-    /* Get the download URL from the saved file */
-    join_paths(release_file, config::yawl_dir, "latest_release.json");
+    if (!STRING_EQUALS(expected_hash, actual_hash)) {
+        LOG_WARNING("Update hash mismatch, expected: %s got: %s", expected_hash, actual_hash);
+        return MAKE_RESULT(SEV_ERROR, CAT_RUNTIME, E_INVALID_ARG);
+    }
+    return RESULT_OK;
+}
 
-    autoclose FILE *fp = fopen(release_file, "r");
-    if (!fp)
-        return result_from_errno();
+/* Rebuild the new binary at `output_path` from the running one and a `zstd --patch-from` patch */
+static RESULT apply_patch(const char *patch_path, const char *output_path) {
+    TRACE_SCOPE("apply_patch");
 
-    if (!fgets(download_url, sizeof(download_url), fp))
-        return MAKE_RESULT(SEV_ERROR, CAT_GENERAL, E_PARSE_ERROR);
+    /* The patch is against the exact bytes we're running, not whatever is at our path right now */
+    autoclosefd int old_fd = open("/proc/self/exe", O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (old_fd < 0 || fstat(old_fd, &st) != 0)
+        return result_from_errno();
 
-    /* Get current executable path */
-    self_path = realpath("/proc/self/exe", nullptr);
-    if (!self_path)
+    void *old_map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, old_fd, 0);
+    if (old_map == MAP_FAILED)
         return result_from_errno();
 
-    /* Try to use same directory as executable (scoped) */
-    {
-        autofree char *temp_dir = strdup(self_path);
-        if (temp_dir) {
-            char *last_slash = strrchr(temp_dir, '/');
-            if (last_slash) {
-                *last_slash = '\0'; /* Truncate to get directory */
-
-                /* Check if directory is writable */
-                if (access(temp_dir, W_OK) == 0) {
-                    LOG_DEBUG("Using executable directory for download: %s", temp_dir);
-                    download_dir = temp_dir;
-                    temp_dir = nullptr; /* Transfer ownership, don't free */
-                    join_paths(temp_binary, download_dir, PROG_NAME ".new");
-                }
+    autoclose FILE *in = fopen(patch_path, "re");
+    autoclose FILE *out = fopen(output_path, "we");
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    RESULT result = RESULT_OK;
+
+    if (!in || !out)
+        result = result_from_errno();
+    else if (!dctx)
+        result = MAKE_RESULT(SEV_ERROR, CAT_SYSTEM, E_OUT_OF_MEMORY);
+
+    size_t ret = 1;
+    if (!FAILED(result)) {
+        /* Patches reference the whole old binary, so their window is as large as it is */
+        ZSTD_DCtx_setParameter(dctx, ZSTD_d_windowLogMax, UPDATE_PATCH_WINDOW_LOG_MAX);
+        ret = ZSTD_DCtx_refPrefix(dctx, old_map, st.st_size);
+        if (ZSTD_isError(ret))
+            result = MAKE_RESULT(SEV_ERROR, CAT_GENERAL, E_NOT_SUPPORTED);
+    }
+
+    char in_buf[BUFFER_SIZE * 8], out_buf[BUFFER_SIZE * 16];
+    size_t read_size;
+    while (!FAILED(result) && (read_size = fread(in_buf, 1, sizeof(in_buf), in)) > 0) {
+        ZSTD_inBuffer input = {in_buf, read_size, 0};
+        while (input.pos < input.size) {
+            ZSTD_outBuffer output = {out_buf, sizeof(out_buf), 0};
+            ret = ZSTD_decompressStream(dctx, &output, &input);
+            if (ZSTD_isError(ret)) {
+                LOG_DEBUG("Failed to apply the update patch: %s", ZSTD_getErrorName(ret));
+                result = MAKE_RESULT(SEV_ERROR, CAT_GENERAL, E_PARSE_ERROR);
+                break;
+            }
+            if (fwrite(out_buf, 1, output.pos, out) != output.pos) {
+                result = MAKE_RESULT(SEV_ERROR, CAT_FILESYSTEM, E_IO_ERROR);
+                break;
             }
         }
     }
 
-    /* Use yawl_dir if exec dir is unwritable */
-    if (!download_dir) {
-        LOG_DEBUG("Using yawl directory for download: %s", config::yawl_dir);
-        join_paths(temp_binary, config::yawl_dir, PROG_NAME ".new");
+    /* A non-zero hint at the end means the patch was cut short */
+    if (!FAILED(result) && (ferror(in) || ret != 0))
+        result = MAKE_RESULT(SEV_ERROR, CAT_GENERAL, E_PARSE_ERROR);
+    if (!FAILED(result) && fflush(out) != 0)
+        result = result_from_errno();
+
+    ZSTD_freeDCtx(dctx);
+    munmap(old_map, st.st_size);
+    return result;
+}
+
+/* Download the binary from `download_url` and stage it (executable) at `staged_path`.
+ * If the release has a patch from our version, that's tried first, and the full binary is the fallback */
+static RESULT download_update(const char *download_url, const char *staged_path) {
+    autofree_del char *part_path = nullptr;
+    autofree_del char *patch_path = nullptr;
+    autofree char *patch_url = nullptr;
+    char expected_hash[65] = {};
+    RESULT result;
+
+    /* Download under a different name, so a half-finished download never looks staged */
+    append_sep(part_path, "", staged_path, ".part");
+    append_sep(patch_path, "", staged_path, ".patch");
+    append_sep(patch_url, "", download_url, UPDATE_PATCH_SUFFIX);
+
+    /* Without a hash to check it against, a patched binary is never trusted */
+    bool have_hash = fetch_release_hash(download_url, staged_path, expected_hash);
+    if (have_hash) {
+        result = download_file(patch_url, patch_path, nullptr);
+        if (!FAILED(result))
+            result = apply_patch(patch_path, part_path);
+        if (!FAILED(result))
+            result = verify_release_hash(part_path, expected_hash);
+
+        if (!FAILED(result))
+            LOG_INFO("Applied the delta update %s", patch_url);
+        else
+            LOG_DEBUG_RESULT(result, "No usable delta update, downloading the full binary");
     }
 
-    LOG_INFO("Downloading update from %s", download_url, temp_binary);
-    result = download_file(download_url, temp_binary, nullptr);
-    if (FAILED(result)) {
-        LOG_RESULT(Level::Error, result, "Failed to download update");
-        return result;
+    if (!have_hash || FAILED(result)) {
+        LOG_INFO("Downloading update from %s", download_url);
+        result = download_file(download_url, part_path, nullptr);
+        if (FAILED(result)) {
+            LOG_RESULT(Level::Error, result, "Failed to download update");
+            return result;
+        }
+
+        if (have_hash) {
+            result = verify_release_hash(part_path, expected_hash);
+            LOG_AND_RETURN_IF_FAILED(Level::Error, result, "The downloaded update is corrupt");
+        }
     }
 
-    result = make_executable(temp_binary);
+    result = make_executable(part_path);
     if (FAILED(result)) {
         LOG_RESULT(Level::Error, result, "Failed to set executable permissions");
         return result;
     }
 
+    if (rename(part_path, staged_path) != 0)
+        return result_from_errno();
+
+    return RESULT_OK;
+}
+
+static RESULT perform_update(const char *download_url) {
+    autofree_del char *temp_binary = nullptr;
+    autofree char *self_path = nullptr;
+    RESULT result;
+
+    /* Get current executable path */
+    self_path = realpath("/proc/self/exe", nullptr);
+    if (!self_path)
+        return result_from_errno();
+
+    temp_binary = staged_binary_path(self_path);
+    if (!temp_binary)
+        return MAKE_RESULT(SEV_ERROR, CAT_GENERAL, E_OUT_OF_MEMORY);
+
+    RETURN_IF_FAILED(download_update(download_url, temp_binary));
+
     LOG_INFO("Installing update...");
     result = replace_binary(temp_binary, self_path);
 
@@ -427,13 +620,131 @@ static RESULT perform_update(void) {
 
 /* Handle all update operations based on command line flags */
 RESULT handle_updates(int check_only, int do_update) {
+    TRACE_SCOPE("handle_updates");
+    autofree char *download_url = nullptr;
     RESULT result = RESULT_OK;
 
     if (check_only || do_update)
-        result = check_for_updates();
+        result = check_for_updates(&download_url, nullptr);
 
     if (do_update && RESULT_CODE(result) == E_UPDATE_AVAILABLE)
-        result = perform_update();
+        result = perform_update(download_url);
 
     return result;
 }
+
+/* Remember which release a staged binary came from, so a launch only installs it if it's still newer than itself */
+static RESULT write_staged_tag(const char *staged_path, const char *tag_name) {
+    autofree char *tag_path = nullptr;
+    autofree char *temp_path = nullptr;
+    append_sep(tag_path, "", staged_path, UPDATE_TAG_SUFFIX);
+    append_sep(temp_path, "", tag_path, ".tmp");
+    if (!tag_path || !temp_path)
+        return MAKE_RESULT(SEV_ERROR, CAT_GENERAL, E_OUT_OF_MEMORY);
+
+    {
+        autoclose FILE *fp = fopen(temp_path, "we");
+        if (!fp)
+            return result_from_errno();
+        fmt::fprintf(fp, "%s\n", tag_name);
+    }
+
+    if (rename(temp_path, tag_path) != 0) {
+        RESULT result = result_from_errno();
+        unlink(temp_path);
+        return result;
+    }
+    return RESULT_OK;
+}
+
+/* The version of the release the binary at `staged_path` was downloaded from, -1 if unknown */
+static int read_staged_version(const char *staged_path) {
+    autofree char *tag_path = nullptr;
+    char tag[64] = {};
+    append_sep(tag_path, "", staged_path, UPDATE_TAG_SUFFIX);
+    if (!tag_path)
+        return -1;
+
+    autoclose FILE *fp = fopen(tag_path, "re");
+    if (!fp || fscanf(fp, "%63s", tag) != 1)
+        return -1;
+    return parse_version(tag);
+}
+
+static void remove_staged(const char *staged_path) {
+    autofree char *tag_path = nullptr;
+    unlink(staged_path);
+    append_sep(tag_path, "", staged_path, UPDATE_TAG_SUFFIX);
+    if (tag_path)
+        unlink(tag_path);
+}
+
+/* The detached child of handle_auto_update(): check and stage, never install */
+static void __attribute__((__noreturn__)) background_update(const char *staged_path) {
+    autofree char *lock_path = nullptr;
+    autofree char *download_url = nullptr;
+    autofree char *tag_name = nullptr;
+
+    /* Only one background check at a time, no matter how many launches happen at once */
+    join_paths(lock_path, config::yawl_dir, UPDATE_LOCK_FILE);
+    int lock_fd = lock_path ? open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644) : -1;
+    if (lock_fd < 0 || flock(lock_fd, LOCK_EX | LOCK_NB) != 0)
+        _exit(0);
+
+    /* The tag goes first: a staged binary without one is never installed */
+    if (RESULT_CODE(check_for_updates(&download_url, &tag_name)) == E_UPDATE_AVAILABLE &&
+        access(staged_path, F_OK) != 0 && SUCCEEDED(write_staged_tag(staged_path, tag_name)) &&
+        FAILED(download_update(download_url, staged_path)))
+        remove_staged(staged_path);
+
+    _exit(0);
+}
+
+RESULT handle_auto_update(void) {
+    TRACE_SCOPE("handle_auto_update");
+    autofree char *self_path = nullptr;
+    autofree char *staged_path = nullptr;
+    autofree char *tag_name = nullptr;
+    autofree char *download_url = nullptr;
+
+    self_path = realpath("/proc/self/exe", nullptr);
+    if (!self_path)
+        return result_from_errno();
+
+    staged_path = staged_binary_path(self_path);
+    if (!staged_path)
+        return MAKE_RESULT(SEV_ERROR, CAT_GENERAL, E_OUT_OF_MEMORY);
+
+    /* Install what a previous launch downloaded, unless we're already that version or newer (e.g. because the
+     * package manager or `update` got there first), which would be a downgrade */
+    if (is_exec_file(staged_path) && read_staged_version(staged_path) <= parse_version(VERSION)) {
+        LOG_DEBUG("Discarding the staged update, it's not newer than v" VERSION);
+        remove_staged(staged_path);
+    } else if (is_exec_file(staged_path)) {
+        LOG_INFO("Installing the update downloaded by a previous launch...");
+        RESULT result = replace_binary(staged_path, self_path);
+        /* After an exchange this is the old binary, otherwise a staged binary we couldn't install */
+        remove_staged(staged_path);
+        if (FAILED(result)) {
+            LOG_RESULT(Level::Error, result, "Failed to install the update");
+            return result;
+        }
+        return MAKE_RESULT(SEV_INFO, CAT_RUNTIME, E_UPDATE_PERFORMED);
+    }
+
+    /* Nothing to do until the cached result expires, unless it says there's an update we haven't downloaded yet */
+    if (read_update_cache(&tag_name, &download_url) && parse_version(tag_name) <= parse_version(VERSION))
+        return RESULT_OK;
+
+    LOG_DEBUG("Checking for updates in the background");
+
+    /* Detached, so the check neither shows up in the program's process tree nor becomes a zombie */
+    pid_t pid = fork_detached(0);
+    if (pid < 0)
+        return result_from_errno();
+
+    if (pid == 0)
+        background_update(staged_path);
+
+    return RESULT_OK;
+}
@@ -11,18 +11,19 @@
 
 #include "result.hpp"
 
-
+/* Default for YAWL_UPDATE_TTL: how many seconds a check result is reused before asking GitHub again */
+#define UPDATE_DEFAULT_TTL (6 * 60 * 60)
 
 /* (private for now) Check if a new version is available and print information about it
  * Returns RESULT_OK if no update is available or if the update check was successful
  * Returns error RESULT on failure
  */
-/* RESULT check_for_updates(void); */
+/* RESULT check_for_updates(char *download_url[]); */
 
 /* (private for now) Download and apply available update
  * Returns RESULT_OK on success, error RESULT on failure
  */
-/* RESULT perform_update(void); */
+/* RESULT perform_update(const char *download_url); */
 
 /* Handle update operations based on command line options
  * check_only: 1 = just check for updates, 0 = don't check
@@ -31,4 +32,9 @@
  */
 RESULT handle_updates(int check_only, int do_update);
 
-
+/* Non-blocking update mode: installs a binary staged by a previous launch, if there is one.
+ * Otherwise, if the cached check result expired, starts a detached child that checks for updates
+ * and only stages the new binary for the next launch.
+ * Returns E_UPDATE_PERFORMED (SEV_INFO) if an update was installed, RESULT_OK otherwise, error RESULT on failure
+ */
+RESULT handle_auto_update(void);
@@ -7,29 +7,57 @@
  * See the full license text in the repository LICENSE file.
  */
 
+#include <atomic>
 #include <cassert>
 #include <cctype>
 #include <cerrno>
 #include <cstring>
+#include <ctime>
+#include <dirent.h>
 #include <fcntl.h>
+#include <new>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
 #include <sys/wait.h>
-#include <wordexp.h>
 
 #include "archive.h"
 #include "archive_entry.h"
 #include "curl/curl.h"
 #include "openssl/evp.h"
 
+#include "arena.hpp"
 #include "log.hpp"
 #include "macros.hpp"
+#include "tasks.hpp"
+#include "trace.hpp"
 #include "util.hpp"
 #include "yawlconfig.hpp"
 
-void _append_sep_impl(char *result_ptr[], const char *separator, size_t num_strings, ...) {
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+#define CLONE_MAX_THREADS 8
+#define CLONE_FILES_PER_THREAD 64 /* don't bother with threads for tiny trees */
+
+#define APPEND_CACHED_LENGTHS 16 /* string lengths remembered between the sizing and copying passes */
+
+#define REMOVE_MAX_THREADS 8
+#define REMOVE_SPAWN_THRESHOLD 16 /* queued directories before helper threads join in */
+#define REMOVE_MAX_OPEN 256       /* directories the pool keeps open at once, at most a quarter of RLIMIT_NOFILE */
+#define REMOVE_FD_RETRIES 20      /* waits for another directory to be closed when out of descriptors */
+#define REMOVE_FD_WAIT_MS 50
+
+void _append_sep_impl(char *result_ptr[], const char *separator, size_t num_strings, const char *const strings[]) {
     char *old_result = *result_ptr;
     size_t old_len = (old_result != nullptr) ? strlen(old_result) : 0;
     size_t sep_len = strlen(separator);
     size_t total_length = old_len;
+    size_t lengths[APPEND_CACHED_LENGTHS];
 
     size_t num_separators = num_strings;
     if (old_len == 0 && num_strings > 0)
@@ -37,15 +65,12 @@ void _append_sep_impl(char *result_ptr[], const char *separator, size_t num_stri
 
     total_length += num_separators * sep_len;
 
-    va_list args, args_copy;
-    va_start(args, num_strings);
-    va_copy(args_copy, args);
-
     for (size_t i = 0; i < num_strings; i++) {
-        const char *str = va_arg(args_copy, const char *);
-        total_length += strlen(str);
+        size_t str_len = strlen(strings[i]);
+        if (i < APPEND_CACHED_LENGTHS)
+            lengths[i] = str_len;
+        total_length += str_len;
     }
-    va_end(args_copy);
 
     char *new_result = (char *)realloc(old_result, total_length + 1);
     assert(new_result != nullptr); /* don't fail malloc */
@@ -54,28 +79,180 @@ void _append_sep_impl(char *result_ptr[], const char *separator, size_t num_stri
     if (old_len == 0 && num_strings == 0) {
         new_result[0] = '\0';
         *result_ptr = new_result;
-        va_end(args);
         return;
     }
 
     /* do the concatenation */
     char *dest = new_result + old_len;
     for (size_t i = 0; i < num_strings; i++) {
-        const char *str = va_arg(args, const char *);
-
         if (i > 0 || old_len > 0) {
             memcpy(dest, separator, sep_len);
             dest += sep_len;
         }
 
-        size_t str_len = strlen(str);
-        memcpy(dest, str, str_len);
+        size_t str_len = i < APPEND_CACHED_LENGTHS ? lengths[i] : strlen(strings[i]);
+        memcpy(dest, strings[i], str_len);
         dest += str_len;
     }
     *dest = '\0';
 
     *result_ptr = new_result;
-    va_end(args);
+}
+
+/* Growable string for expand_path() */
+struct expand_buf {
+    char *data;
+    size_t len;
+    size_t capacity;
+};
+
+static bool expand_append(struct expand_buf *buf, const char *str, size_t len) {
+    if (buf->len + len + 1 > buf->capacity) {
+        size_t capacity = buf->capacity ? buf->capacity : 256;
+        while (buf->len + len + 1 > capacity)
+            capacity *= 2;
+        char *data = (char *)realloc(buf->data, capacity);
+        if (!data)
+            return false;
+        buf->data = data;
+        buf->capacity = capacity;
+    }
+
+    memcpy(buf->data + buf->len, str, len);
+    buf->len += len;
+    buf->data[buf->len] = '\0';
+    return true;
+}
+
+static bool is_name_char(char c, bool first) {
+    return c == '_' || isalpha((unsigned char)c) || (!first && isdigit((unsigned char)c));
+}
+
+/* Home directory for the `len` characters of `user`, or ours if `len` is 0. nullptr if there's no such user. */
+static const char *home_dir(const char *user, size_t len) {
+    struct passwd *pw;
+    if (len == 0) {
+        const char *home = getenv("HOME");
+        if (home)
+            return home;
+        pw = getpwuid(getuid());
+    } else {
+        char name[256];
+        if (len >= sizeof(name))
+            return nullptr;
+        memcpy(name, user, len);
+        name[len] = '\0';
+        pw = getpwnam(name);
+    }
+    return pw ? pw->pw_dir : nullptr;
+}
+
+enum expand_error { EXPAND_OK, EXPAND_BADCHAR, EXPAND_SYNTAX, EXPAND_CMDSUB, EXPAND_SPLIT, EXPAND_NOMEM };
+
+/* The parts of POSIX word expansion that paths use: a leading ~ or ~user, $VAR and ${VAR}, and quoting.
+ * Anything that would make the shell run something, or split the path into several words, is an error. */
+static enum expand_error expand_word(const char *path, struct expand_buf *buf) {
+    const char *p = path;
+
+    if (*p == '~') {
+        size_t len = strcspn(p + 1, "/");
+        const char *user = p + 1;
+        const char *home = nullptr;
+
+        /* A quoted or expanded user name isn't a tilde prefix anymore, leave it as it is */
+        if (!memchr(user, '\'', len) && !memchr(user, '"', len) && !memchr(user, '\\', len) &&
+            !memchr(user, '$', len))
+            home = home_dir(user, len);
+
+        if (home) {
+            if (!expand_append(buf, home, strlen(home)))
+                return EXPAND_NOMEM;
+            p += 1 + len;
+        }
+    }
+
+    bool in_double = false;
+    while (*p) {
+        char c = *p;
+
+        if (c == '\'' && !in_double) {
+            const char *end = strchr(p + 1, '\'');
+            if (!end)
+                return EXPAND_SYNTAX;
+            if (!expand_append(buf, p + 1, end - (p + 1)))
+                return EXPAND_NOMEM;
+            p = end + 1;
+            continue;
+        }
+
+        if (c == '"') {
+            in_double = !in_double;
+            p++;
+            continue;
+        }
+
+        if (c == '\\') {
+            if (!p[1])
+                return EXPAND_SYNTAX;
+            /* Inside double quotes, backslashes only escape the characters that are special there */
+            if (in_double && !strchr("$`\"\\", p[1])) {
+                if (!expand_append(buf, p, 2))
+                    return EXPAND_NOMEM;
+            } else if (p[1] != '\n' && !expand_append(buf, p + 1, 1)) {
+                return EXPAND_NOMEM;
+            }
+            p += 2;
+            continue;
+        }
+
+        if (c == '`' || (c == '$' && p[1] == '('))
+            return EXPAND_CMDSUB;
+
+        if (c == '$' && (p[1] == '{' || is_name_char(p[1], true))) {
+            const char *name = p + (p[1] == '{' ? 2 : 1);
+            size_t len = 0;
+            while (is_name_char(name[len], len == 0))
+                len++;
+
+            /* ${VAR:-word} and friends aren't supported, and the shell would reject anything else */
+            if (p[1] == '{' && (len == 0 || name[len] != '}'))
+                return EXPAND_SYNTAX;
+
+            char var[256];
+            if (len >= sizeof(var))
+                return EXPAND_SYNTAX;
+            memcpy(var, name, len);
+            var[len] = '\0';
+
+            const char *value = getenv(var);
+            if (value) {
+                /* Unquoted, the shell would split a value with blanks into several words */
+                if (!in_double && strpbrk(value, " \t\n"))
+                    return EXPAND_SPLIT;
+                if (!expand_append(buf, value, strlen(value)))
+                    return EXPAND_NOMEM;
+            }
+            p = name + len + (p[1] == '{');
+            continue;
+        }
+
+        if (!in_double) {
+            if (strchr("|&;<>(){}\n", c))
+                return EXPAND_BADCHAR;
+            if (c == ' ' || c == '\t')
+                return EXPAND_SPLIT;
+        }
+
+        if (!expand_append(buf, p, 1))
+            return EXPAND_NOMEM;
+        p++;
+    }
+
+    if (in_double)
+        return EXPAND_SYNTAX;
+
+    /* Nothing left, e.g. an unset variable */
+    return buf->len ? EXPAND_OK : EXPAND_SPLIT;
 }
 
 char *expand_path(const char *path) {
@@ -86,33 +263,27 @@ char *expand_path(const char *path) {
     if (!strchr(path, '~') && !strchr(path, '$'))
         return strdup(path);
 
-    wordexp_t p;
-    char *result = nullptr;
-
-    /* Use wordexp to handle path expansion like the shell would */
-    int ret = wordexp(path, &p, WRDE_NOCMD);
-    if (ret != 0) {
-        /* Handle specific error cases */
-        if (ret == WRDE_BADCHAR)
-            LOG_WARNING("Invalid characters in path: %s", path);
-        else if (ret == WRDE_SYNTAX)
-            LOG_WARNING("Syntax error in path: %s", path);
+    /* Done here rather than with wordexp(), which forks a shell for every call with musl */
+    struct expand_buf buf = {};
+    enum expand_error error = expand_word(path, &buf);
+    if (error == EXPAND_OK)
+        return buf.data;
 
-        /* Fall back to the original path */
-        return strdup(path);
-    }
+    free(buf.data);
+    if (error == EXPAND_NOMEM)
+        return nullptr;
 
-    /* We should have exactly one expansion result */
-    if (p.we_wordc == 1) {
-        result = strdup(p.we_wordv[0]);
-    } else {
+    /* Handle specific error cases */
+    if (error == EXPAND_BADCHAR)
+        LOG_WARNING("Invalid characters in path: %s", path);
+    else if (error == EXPAND_SYNTAX)
+        LOG_WARNING("Syntax error in path: %s", path);
+    else if (error == EXPAND_SPLIT)
         /* If we get multiple results or none, fall back to the original path */
         LOG_WARNING("Ambiguous path expansion for: %s", path);
-        result = strdup(path);
-    }
 
-    wordfree(&p);
-    return result;
+    /* Fall back to the original path */
+    return strdup(path);
 }
 
 static forceinline RESULT create_directory_tree(char *path) {
@@ -165,42 +336,513 @@ RESULT ensure_dir(const char *path) {
     return ret;
 }
 
-RESULT remove_dir(const char *path) {
-    DIR *dir = opendir(path);
-    if (!dir)
-        return result_from_errno();
+/* Open a subdirectory to delete from, making it accessible first if needed (overlayfs work dirs are 000) */
+static int open_subdir(int parent_fd, const char *name) {
+    int fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0 && errno == EACCES && fchmodat(parent_fd, name, S_IRWXU, 0) == 0)
+        fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    return fd;
+}
+
+static bool entry_is_dir(int dir_fd, const struct dirent *entry) {
+    if (entry->d_type != DT_UNKNOWN)
+        return entry->d_type == DT_DIR;
 
+    /* Only some filesystems leave d_type empty, stat those */
+    struct stat st;
+    return fstatat(dir_fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+}
+
+static RESULT unlink_entry(int dir_fd, const char *name, int flags) {
+    if (unlinkat(dir_fd, name, flags) == 0 || errno == ENOENT)
+        return RESULT_OK;
+
+    RESULT result = result_from_errno();
+    LOG_RESULT(Level::Warning, result, flags ? "Failed to remove directory" : "Failed to remove file");
+    LOG_DEBUG("Entry: %s", name);
+    return result;
+}
+
+/* The directory a sequential removal descended into, and the identity of its parent to verify ".." against */
+struct remove_level {
+    char *name;
+    dev_t parent_dev;
+    ino_t parent_ino;
+};
+
+/* Single-threaded removal of `name` in `parent_fd` and everything below it. Never holds more than two
+ * descriptors: instead of keeping every level open, it walks back up through ".." and rescans the parent.
+ * Files that can't be removed are reported and skipped, a directory that can't be removed stops the walk. */
+static RESULT remove_tree_at(int parent_fd, const char *name) {
+    struct remove_level *levels = nullptr;
+    size_t depth = 0, capacity = 0;
     RESULT result = RESULT_OK;
+
+    int fd = open_subdir(parent_fd, name);
+    DIR *dir = fd >= 0 ? fdopendir(fd) : nullptr;
+    if (!dir) {
+        result = result_from_errno();
+        if (fd >= 0)
+            close(fd);
+        return result;
+    }
+
+    for (;;) {
+        struct dirent *entry;
+        int child_fd = -1;
+        while ((entry = readdir(dir)) != nullptr) {
+            if (STRING_EQUALS(entry->d_name, ".") || STRING_EQUALS(entry->d_name, ".."))
+                continue;
+
+            if (!entry_is_dir(dirfd(dir), entry)) {
+                RESULT entry_result = unlink_entry(dirfd(dir), entry->d_name, 0);
+                if (FAILED(entry_result))
+                    result = entry_result; /* remember the error, but continue */
+                continue;
+            }
+
+            struct stat st;
+            if (depth == capacity) {
+                size_t new_capacity = capacity ? capacity * 2 : 16;
+                void *new_levels = realloc(levels, new_capacity * sizeof(*levels));
+                if (!new_levels) {
+                    errno = ENOMEM;
+                    break;
+                }
+                levels = (struct remove_level *)new_levels;
+                capacity = new_capacity;
+            }
+            if (fstat(dirfd(dir), &st) != 0 || !(levels[depth].name = strdup(entry->d_name)))
+                break;
+            if ((child_fd = open_subdir(dirfd(dir), entry->d_name)) < 0) {
+                free(levels[depth].name);
+                break;
+            }
+            levels[depth].parent_dev = st.st_dev;
+            levels[depth].parent_ino = st.st_ino;
+            depth++;
+            break;
+        }
+
+        if (entry && child_fd < 0) {
+            result = result_from_errno();
+            break;
+        }
+
+        /* Go down first, and come back up once a directory has nothing left in it */
+        if (child_fd >= 0) {
+            closedir(dir);
+            if (!(dir = fdopendir(child_fd))) {
+                result = result_from_errno();
+                close(child_fd);
+                break;
+            }
+            continue;
+        }
+
+        if (depth == 0) {
+            closedir(dir);
+            dir = nullptr;
+            RESULT rmdir_result = unlink_entry(parent_fd, name, AT_REMOVEDIR);
+            if (!FAILED(result))
+                result = rmdir_result;
+            break;
+        }
+
+        /* Something else moved the tree around under us, don't delete from wherever ".." is now */
+        struct remove_level *level = &levels[depth - 1];
+        struct stat st;
+        int up_fd = openat(dirfd(dir), "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (up_fd < 0 || fstat(up_fd, &st) != 0 || st.st_dev != level->parent_dev || st.st_ino != level->parent_ino) {
+            result = up_fd < 0 ? result_from_errno() : MAKE_RESULT(SEV_ERROR, CAT_FILESYSTEM, E_NOT_FOUND);
+            if (up_fd >= 0)
+                close(up_fd);
+            break;
+        }
+
+        closedir(dir);
+        dir = fdopendir(up_fd);
+        if (!dir) {
+            result = result_from_errno();
+            close(up_fd);
+            break;
+        }
+
+        /* A directory that's still there after this would be found again by the rescan, give up instead */
+        RESULT rmdir_result = unlink_entry(dirfd(dir), level->name, AT_REMOVEDIR);
+        free(level->name);
+        depth--;
+        if (FAILED(rmdir_result)) {
+            result = rmdir_result;
+            break;
+        }
+    }
+
+    if (dir)
+        closedir(dir);
+    for (size_t i = 0; i < depth; i++)
+        free(levels[i].name);
+    free(levels);
+    return result;
+}
+
+static bool out_of_fds(RESULT result) {
+    return result == MAKE_RESULT(SEV_ERROR, CAT_SYSTEM, EMFILE) || result == MAKE_RESULT(SEV_ERROR, CAT_SYSTEM, ENFILE);
+}
+
+/* A directory being removed by the pool. It's removed from its parent once it has been scanned and all of
+ * its subdirectories are gone, which in turn may finish the parent. Queued directories aren't open yet, so
+ * the descriptors in use only grow with the directories that are being worked on. */
+struct remove_node {
+    struct remove_node *parent;
+    DIR *dir;                      /* nullptr until it's taken from a queue */
+    char *name;                    /* Name in the parent, nullptr for the root */
+    std::atomic<unsigned> pending; /* Subdirectories left, plus one until it has been scanned */
+};
+
+/* Owners push and pop at the tail (depth first, which keeps few directories open), thieves take the head */
+struct remove_queue {
+    pthread_mutex_t lock;
+    struct remove_node **items;
+    size_t head, tail, capacity;
+};
+
+struct remove_worker_arg {
+    struct remove_pool *pool;
+    unsigned index;
+};
+
+struct remove_pool {
+    struct remove_queue queues[REMOVE_MAX_THREADS];
+    struct remove_worker_arg args[REMOVE_MAX_THREADS];
+    pthread_t threads[REMOVE_MAX_THREADS];
+    unsigned max_workers;
+    std::atomic<unsigned> workers;
+    std::atomic<size_t> outstanding; /* Nodes queued or being worked on */
+    std::atomic<size_t> queued;
+    std::atomic<size_t> open_dirs;
+    std::atomic<size_t> max_open;
+    std::atomic<RESULT> result;
+
+    /* Idle workers wait for new nodes (or the end), workers out of descriptors for a directory to be closed */
+    pthread_mutex_t wait_lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t fd_cond;
+    unsigned fd_waiters;
+};
+
+/* Returns the number of queued nodes including `node`, 0 if it couldn't be queued */
+static size_t queue_push(struct remove_queue *queue, struct remove_node *node) {
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail == queue->capacity) {
+        size_t capacity = queue->capacity ? queue->capacity * 2 : 64;
+        void *items = realloc(queue->items, capacity * sizeof(*queue->items));
+        if (!items) {
+            pthread_mutex_unlock(&queue->lock);
+            return 0;
+        }
+        queue->items = (struct remove_node **)items;
+        queue->capacity = capacity;
+    }
+    queue->items[queue->tail++] = node;
+    size_t queued = queue->tail - queue->head;
+    pthread_mutex_unlock(&queue->lock);
+    return queued;
+}
+
+static struct remove_node *queue_take(struct remove_queue *queue, bool steal) {
+    struct remove_node *node = nullptr;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->head < queue->tail) {
+        node = steal ? queue->items[queue->head++] : queue->items[--queue->tail];
+        if (queue->head == queue->tail)
+            queue->head = queue->tail = 0;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return node;
+}
+
+static void pool_fail(struct remove_pool *pool, RESULT result) {
+    RESULT expected = RESULT_OK;
+    pool->result.compare_exchange_strong(expected, result, std::memory_order_relaxed);
+}
+
+static void pool_close_dir(struct remove_pool *pool, DIR *dir) {
+    closedir(dir);
+    pool->open_dirs.fetch_sub(1, std::memory_order_relaxed);
+
+    pthread_mutex_lock(&pool->wait_lock);
+    if (pool->fd_waiters)
+        pthread_cond_broadcast(&pool->fd_cond);
+    pthread_mutex_unlock(&pool->wait_lock);
+}
+
+/* Wait (a bounded time) for another worker to close a directory. Returns false if none is left to wait for. */
+static bool pool_wait_for_fd(struct remove_pool *pool, size_t open_ancestors) {
+    if (pool->open_dirs.load(std::memory_order_relaxed) <= open_ancestors)
+        return false;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += REMOVE_FD_WAIT_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&pool->wait_lock);
+    pool->fd_waiters++;
+    pthread_cond_timedwait(&pool->fd_cond, &pool->wait_lock, &deadline);
+    pool->fd_waiters--;
+    pthread_mutex_unlock(&pool->wait_lock);
+    return true;
+}
+
+/* Drop one reference to `node`, removing it (and then maybe its parents) once nothing is left inside */
+static void node_release(struct remove_pool *pool, struct remove_node *node) {
+    while (node && node->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        struct remove_node *parent = node->parent;
+        if (node->dir)
+            pool_close_dir(pool, node->dir);
+        if (parent && node->dir) {
+            RESULT result = unlink_entry(dirfd(parent->dir), node->name, AT_REMOVEDIR);
+            if (FAILED(result))
+                pool_fail(pool, result);
+        }
+        free(node->name);
+        delete node;
+        node = parent;
+    }
+}
+
+static void *remove_worker(void *data);
+
+static void pool_maybe_spawn(struct remove_pool *pool, size_t queued) {
+    unsigned workers = pool->workers.load(std::memory_order_relaxed);
+    if (queued < REMOVE_SPAWN_THRESHOLD || workers >= pool->max_workers ||
+        !pool->workers.compare_exchange_strong(workers, workers + 1, std::memory_order_relaxed))
+        return;
+
+    pool->args[workers] = {pool, workers};
+    if (pthread_create(&pool->threads[workers], nullptr, remove_worker, &pool->args[workers]) != 0)
+        pool->threads[workers] = 0;
+}
+
+/* Remove `name` in `parent` on this thread, waiting for descriptors to be freed if there are none left */
+static void remove_inline(struct remove_pool *pool, struct remove_node *parent, const char *name) {
+    size_t open_ancestors = 0;
+    for (struct remove_node *node = parent; node; node = node->parent)
+        open_ancestors++;
+
+    RESULT result;
+    for (unsigned attempt = 0;; attempt++) {
+        result = remove_tree_at(dirfd(parent->dir), name);
+        if (!out_of_fds(result) || attempt == REMOVE_FD_RETRIES || !pool_wait_for_fd(pool, open_ancestors))
+            break;
+    }
+    if (FAILED(result))
+        pool_fail(pool, result);
+}
+
+static void node_scan(struct remove_pool *pool, unsigned index, struct remove_node *node) {
     struct dirent *entry;
-    while ((entry = readdir(dir)) != nullptr) {
+    while ((entry = readdir(node->dir)) != nullptr) {
         if (STRING_EQUALS(entry->d_name, ".") || STRING_EQUALS(entry->d_name, ".."))
             continue;
 
-        char *full_path = nullptr;
-        join_paths(full_path, path, entry->d_name);
+        int dir_fd = dirfd(node->dir);
+        if (!entry_is_dir(dir_fd, entry)) {
+            RESULT result = unlink_entry(dir_fd, entry->d_name, 0);
+            if (FAILED(result))
+                pool_fail(pool, result);
+            continue;
+        }
 
-        struct stat st;
-        if (lstat(full_path, &st) == 0) {
-            if (S_ISDIR(st.st_mode)) {
-                RESULT dir_result = remove_dir(full_path);
-                if (FAILED(dir_result)) {
-                    free(full_path);
-                    closedir(dir);
-                    return dir_result;
-                }
-            } else if (unlink(full_path) != 0) {
-                RESULT unlink_result = result_from_errno();
-                LOG_RESULT(Level::Warning, unlink_result, "Failed to remove file");
-                result = unlink_result; /* remember the error, but continue */
+        struct remove_node *child = new (std::nothrow) remove_node;
+        if (child) {
+            child->parent = node;
+            child->dir = nullptr;
+            child->name = strdup(entry->d_name);
+            child->pending.store(1, std::memory_order_relaxed);
+            node->pending.fetch_add(1, std::memory_order_relaxed);
+            pool->outstanding.fetch_add(1, std::memory_order_relaxed);
+            pool->queued.fetch_add(1, std::memory_order_release);
+
+            size_t queued = child->name ? queue_push(&pool->queues[index], child) : 0;
+            if (queued) {
+                pthread_mutex_lock(&pool->wait_lock);
+                pthread_cond_signal(&pool->work_cond);
+                pthread_mutex_unlock(&pool->wait_lock);
+                pool_maybe_spawn(pool, queued);
+                continue;
             }
+
+            pool->queued.fetch_sub(1, std::memory_order_relaxed);
+            pool->outstanding.fetch_sub(1, std::memory_order_relaxed);
+            node->pending.fetch_sub(1, std::memory_order_relaxed);
+            free(child->name);
+            delete child;
         }
 
-        free(full_path);
+        /* Couldn't queue it, so take it apart right here */
+        remove_inline(pool, node, entry->d_name);
     }
+}
 
-    closedir(dir);
+/* Open a node taken from a queue and scan it. Past the open directory limit, or when the process is out of
+ * descriptors, the whole subtree is removed on this thread instead, which only needs two of them at a time. */
+static void node_run(struct remove_pool *pool, unsigned index, struct remove_node *node) {
+    if (!node->dir) {
+        size_t open_dirs = pool->open_dirs.load(std::memory_order_relaxed);
+        if (open_dirs < pool->max_open.load(std::memory_order_relaxed)) {
+            int fd = open_subdir(dirfd(node->parent->dir), node->name);
+            if (fd >= 0 && !(node->dir = fdopendir(fd)))
+                close(fd);
+            if (node->dir) {
+                pool->open_dirs.fetch_add(1, std::memory_order_relaxed);
+            } else if (errno == EMFILE || errno == ENFILE) {
+                /* Don't try to keep more open than there was room for this time */
+                pool->max_open.store(open_dirs ? open_dirs : 1, std::memory_order_relaxed);
+            } else if (errno == ENOENT) {
+                /* Someone else removed it already, which is all we wanted */
+                node_release(pool, node);
+                return;
+            } else {
+                RESULT result = result_from_errno();
+                LOG_RESULT(Level::Warning, result, "Failed to open directory");
+                LOG_DEBUG("Entry: %s", node->name);
+                pool_fail(pool, result);
+                node_release(pool, node);
+                return;
+            }
+        }
+
+        if (!node->dir) {
+            remove_inline(pool, node->parent, node->name);
+            node_release(pool, node);
+            return;
+        }
+    }
+
+    node_scan(pool, index, node);
+    node_release(pool, node);
+}
+
+static void *remove_worker(void *data) {
+    struct remove_worker_arg arg = *(struct remove_worker_arg *)data;
+    struct remove_pool *pool = arg.pool;
+
+    for (;;) {
+        struct remove_node *node = queue_take(&pool->queues[arg.index], false);
+        for (unsigned i = 1; !node && i < pool->max_workers; i++)
+            node = queue_take(&pool->queues[(arg.index + i) % pool->max_workers], true);
+
+        if (!node) {
+            bool done;
+            pthread_mutex_lock(&pool->wait_lock);
+            while (pool->queued.load(std::memory_order_acquire) == 0 &&
+                   pool->outstanding.load(std::memory_order_acquire) > 0)
+                pthread_cond_wait(&pool->work_cond, &pool->wait_lock);
+            done = pool->outstanding.load(std::memory_order_acquire) == 0;
+            pthread_mutex_unlock(&pool->wait_lock);
+            if (done)
+                break;
+            continue;
+        }
+
+        pool->queued.fetch_sub(1, std::memory_order_relaxed);
+        node_run(pool, arg.index, node);
+        if (pool->outstanding.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            pthread_mutex_lock(&pool->wait_lock);
+            pthread_cond_broadcast(&pool->work_cond);
+            pthread_mutex_unlock(&pool->wait_lock);
+        }
+    }
+
+    return nullptr;
+}
+
+RESULT remove_dir(const char *path) {
+    TRACE_SCOPE("remove_dir");
+
+    struct remove_node *root = new (std::nothrow) remove_node;
+    if (!root)
+        return MAKE_RESULT(SEV_ERROR, CAT_SYSTEM, E_OUT_OF_MEMORY);
+
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    root->parent = nullptr;
+    root->name = nullptr;
+    root->dir = fd >= 0 ? fdopendir(fd) : nullptr;
+    root->pending.store(1, std::memory_order_relaxed);
+    if (!root->dir) {
+        RESULT result = result_from_errno();
+        if (fd >= 0)
+            close(fd);
+        delete root;
+        return result;
+    }
+
+    struct remove_pool *pool = new (std::nothrow) remove_pool;
+    if (!pool) {
+        closedir(root->dir);
+        delete root;
+        return remove_tree_at(AT_FDCWD, path);
+    }
 
-    if (rmdir(path) != 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    pool->max_workers = cpus > 1 ? (cpus < REMOVE_MAX_THREADS ? (unsigned)cpus : REMOVE_MAX_THREADS) : 1;
+
+    /* Leave most of the descriptors to the rest of the process, and to the sequential fallback */
+    struct rlimit limit;
+    size_t max_open = REMOVE_MAX_OPEN;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur / 4 < max_open)
+        max_open = limit.rlim_cur / 4 ? limit.rlim_cur / 4 : 1;
+
+    for (unsigned i = 0; i < REMOVE_MAX_THREADS; i++) {
+        pthread_mutex_init(&pool->queues[i].lock, nullptr);
+        pool->queues[i].items = nullptr;
+        pool->queues[i].head = pool->queues[i].tail = pool->queues[i].capacity = 0;
+    }
+    pthread_mutex_init(&pool->wait_lock, nullptr);
+    pthread_cond_init(&pool->work_cond, nullptr);
+    pthread_cond_init(&pool->fd_cond, nullptr);
+    pool->fd_waiters = 0;
+    pool->workers.store(1, std::memory_order_relaxed); /* us */
+    pool->outstanding.store(1, std::memory_order_relaxed);
+    pool->queued.store(1, std::memory_order_relaxed);
+    pool->open_dirs.store(1, std::memory_order_relaxed);
+    pool->max_open.store(max_open, std::memory_order_relaxed);
+    pool->result.store(RESULT_OK, std::memory_order_relaxed);
+
+    /* The calling thread is worker 0, helpers only start once there's a backlog worth sharing */
+    bool removed = false;
+    if (queue_push(&pool->queues[0], root)) {
+        pool->args[0] = {pool, 0};
+        remove_worker(&pool->args[0]);
+    } else {
+        closedir(root->dir);
+        delete root;
+        pool->result.store(remove_tree_at(AT_FDCWD, path), std::memory_order_relaxed);
+        removed = true;
+    }
+
+    unsigned workers = pool->workers.load(std::memory_order_acquire);
+    for (unsigned i = 1; i < workers; i++) {
+        if (pool->threads[i])
+            pthread_join(pool->threads[i], nullptr);
+    }
+
+    RESULT result = pool->result.load(std::memory_order_relaxed);
+    for (unsigned i = 0; i < REMOVE_MAX_THREADS; i++) {
+        pthread_mutex_destroy(&pool->queues[i].lock);
+        free(pool->queues[i].items);
+    }
+    pthread_cond_destroy(&pool->fd_cond);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_mutex_destroy(&pool->wait_lock);
+    delete pool;
+
+    if (!removed && rmdir(path) != 0) {
         RESULT rmdir_result = result_from_errno();
         LOG_RESULT(Level::Error, rmdir_result, "Failed to remove directory");
         return rmdir_result;
@@ -209,6 +851,333 @@ RESULT remove_dir(const char *path) {
     return result;
 }
 
+pid_t fork_detached(int niceness) {
+    log_flush();
+    pid_t pid = fork();
+    if (pid < 0)
+        return -1;
+
+    if (pid == 0) {
+        /* Double fork, so the work outlives our exec into the runtime without becoming its child */
+        pid_t detached = fork();
+        if (detached != 0)
+            _exit(detached < 0);
+        setsid();
+
+        int null_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDIN_FILENO);
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+        }
+        if (niceness)
+            setpriority(PRIO_PROCESS, 0, niceness);
+        return 0;
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        errno = ECHILD;
+        return -1;
+    }
+    return pid;
+}
+
+#define REMOVE_TRASH_INFIX ".trash-"
+
+/* Remove leftover trash of `name` in `parent` from earlier background removals that didn't get to finish */
+static void remove_stale_trash(const char *parent, const char *name) {
+    autofree char *prefix = nullptr;
+    append_sep(prefix, "", ".", name, REMOVE_TRASH_INFIX);
+    if (!prefix)
+        return;
+
+    autoclosedir DIR *dir = opendir(parent);
+    if (!dir)
+        return;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        if (strncmp(entry->d_name, prefix, strlen(prefix)) != 0)
+            continue;
+        autofree char *stale = nullptr;
+        join_paths(stale, parent, entry->d_name);
+        remove_dir(stale);
+    }
+}
+
+RESULT remove_dir_background(const char *path) {
+    autofree char *parent = strdup(path);
+    if (!parent)
+        return MAKE_RESULT(SEV_ERROR, CAT_SYSTEM, E_OUT_OF_MEMORY);
+
+    char *slash = strrchr(parent, '/');
+    const char *name = slash ? slash + 1 : parent;
+    if (slash == parent)
+        slash[1] = '\0';
+    else if (slash)
+        *slash = '\0';
+    else
+        parent[0] = '.', parent[1] = '\0';
+
+    /* Hidden sibling on the same filesystem, so the rename is instant and `path` can be reused right away */
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), "%d", getpid());
+    autofree char *trash_name = nullptr;
+    autofree char *trash_path = nullptr;
+    append_sep(trash_name, "", ".", name, REMOVE_TRASH_INFIX, suffix);
+    join_paths(trash_path, parent, trash_name);
+    if (!trash_path)
+        return MAKE_RESULT(SEV_ERROR, CAT_SYSTEM, E_OUT_OF_MEMORY);
+
+    if (rename(path, trash_path) != 0) {
+        RESULT result = result_from_errno();
+        LOG_DEBUG_RESULT(result, "Couldn't move the directory aside, deleting it now");
+        return remove_dir(path);
+    }
+
+    pid_t pid = fork_detached(10);
+    if (pid < 0) {
+        RESULT result = result_from_errno();
+        LOG_DEBUG_RESULT(result, "Couldn't delete in the background, deleting now");
+        return remove_dir(trash_path);
+    }
+
+    if (pid == 0) {
+        remove_dir(trash_path);
+        remove_stale_trash(parent, name);
+        _exit(0);
+    }
+
+    LOG_DEBUG("Deleting %s in the background", trash_path);
+    return RESULT_OK;
+}
+
+/* Files collected by clone_walk(), copied by clone_worker() threads */
+struct clone_file {
+    char *src;
+    char *dst;
+    mode_t mode;
+    struct timespec mtime;
+};
+
+struct clone_state {
+    struct clone_file *files;
+    size_t count;
+    size_t capacity;
+    std::atomic<size_t> next;
+    std::atomic<bool> failed;
+    struct arena paths; /* every path of the walk, which is a few per file */
+};
+
+/* Create the directories and symlinks of the tree right away, and queue the regular files */
+static RESULT clone_walk(struct clone_state *state, const char *src, const char *dst, mode_t dir_mode) {
+    if (mkdir(dst, dir_mode | S_IRWXU) != 0)
+        return result_from_errno();
+
+    autoclosedir DIR *dir = opendir(src);
+    if (!dir)
+        return result_from_errno();
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        if (STRING_EQUALS(entry->d_name, ".") || STRING_EQUALS(entry->d_name, ".."))
+            continue;
+
+        struct stat st;
+        if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+            return result_from_errno();
+
+        /* Both stay around in the queue for regular files, and go with the arena at the end */
+        char *src_path = arena_path(&state->paths, src, entry->d_name);
+        char *dst_path = arena_path(&state->paths, dst, entry->d_name);
+        if (!src_path || !dst_path)
+            return MAKE_RESULT(SEV_ERROR, CAT_SYSTEM, E_OUT_OF_MEMORY);
+
+        if (S_ISDIR(st.st_mode)) {
+            RETURN_IF_FAILED(clone_walk(state, src_path, dst_path, st.st_mode & 07777));
+        } else if (S_ISLNK(st.st_mode)) {
+            char target[PATH_MAX];
+            ssize_t len = readlinkat(dirfd(dir), entry->d_name, target, sizeof(target) - 1);
+            if (len < 0)
+                return result_from_errno();
+            target[len] = '\0';
+            if (symlink(target, dst_path) != 0)
+                return result_from_errno();
+        } else if (S_ISREG(st.st_mode)) {
+            if (state->count == state->capacity) {
+                size_t capacity = state->capacity ? state->capacity * 2 : 256;
+                void *files = realloc(state->files, capacity * sizeof(*state->files));
+                if (!files)
+                    return MAKE_RESULT(SEV_ERROR, CAT_SYSTEM, E_OUT_OF_MEMORY);
+                state->files = (struct clone_file *)files;
+                state->capacity = capacity;
+            }
+            state->files[state->count++] = {src_path, dst_path, st.st_mode & 07777, st.st_mtim};
+        }
+        /* Sockets, fifos and devices have no business in a prefix */
+    }
+
+    return RESULT_OK;
+}
+
+int write_all(int fd, const void *buf, size_t count) {
+    const char *p = (const char *)buf;
+    while (count > 0) {
+        ssize_t written = write(fd, p, count);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN) {
+                struct pollfd pfd = {.fd = fd, .events = POLLOUT, .revents = 0};
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            return -1;
+        }
+        p += written;
+        count -= (size_t)written;
+    }
+    return 0;
+}
+
+bool copy_fd_data(int in_fd, int out_fd) {
+    if (ioctl(out_fd, FICLONE, in_fd) == 0)
+        return true;
+
+    /* Both of these copy in the kernel, sendfile() also works across filesystems on older kernels */
+    bool try_sendfile = false;
+    for (;;) {
+        ssize_t n = copy_file_range(in_fd, nullptr, out_fd, nullptr, 1 << 30, 0);
+        if (n == 0)
+            return true;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP) {
+                try_sendfile = true;
+                break; /* continue from the current offsets below */
+            }
+            return false;
+        }
+    }
+
+    while (try_sendfile) {
+        ssize_t n = sendfile(out_fd, in_fd, nullptr, 1 << 30);
+        if (n == 0)
+            return true;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == ENOSYS || errno == EINVAL)
+                break;
+            return false;
+        }
+    }
+
+    char buffer[BUFFER_SIZE];
+    for (;;) {
+        ssize_t n = read(in_fd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return n == 0;
+        for (ssize_t done = 0; done < n;) {
+            ssize_t written = write(out_fd, buffer + done, n - done);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written <= 0)
+                return false;
+            done += written;
+        }
+    }
+}
+
+static void *clone_worker(void *arg) {
+    struct clone_state *state = (struct clone_state *)arg;
+
+    for (size_t i; !state->failed.load(std::memory_order_relaxed) &&
+                   (i = state->next.fetch_add(1, std::memory_order_relaxed)) < state->count;) {
+        struct clone_file *file = &state->files[i];
+
+        autoclosefd int in_fd = open(file->src, O_RDONLY | O_CLOEXEC);
+        autoclosefd int out_fd = open(file->dst, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, file->mode | S_IWUSR);
+        if (in_fd < 0 || out_fd < 0 || !copy_fd_data(in_fd, out_fd)) {
+            LOG_DEBUG("Failed to clone %s: %s", file->src, strerror(errno));
+            state->failed.store(true, std::memory_order_relaxed);
+            break;
+        }
+
+        /* Wine compares timestamps of some files (e.g. the registry), keep them */
+        const struct timespec times[2] = {file->mtime, file->mtime};
+        futimens(out_fd, times);
+        if (!(file->mode & S_IWUSR))
+            fchmod(out_fd, file->mode);
+    }
+
+    return nullptr;
+}
+
+RESULT clone_file(const char *src, const char *dst) {
+    struct stat st;
+
+    autoclosefd int in_fd = open(src, O_RDONLY | O_CLOEXEC);
+    if (in_fd < 0 || fstat(in_fd, &st) != 0)
+        return result_from_errno();
+
+    autoclosefd int out_fd = open(dst, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, (st.st_mode & 07777) | S_IWUSR);
+    if (out_fd < 0 || !copy_fd_data(in_fd, out_fd))
+        return result_from_errno();
+
+    const struct timespec times[2] = {st.st_mtim, st.st_mtim};
+    futimens(out_fd, times);
+    if (!(st.st_mode & S_IWUSR))
+        fchmod(out_fd, st.st_mode & 07777);
+
+    return RESULT_OK;
+}
+
+RESULT clone_tree(const char *src, const char *dst) {
+    TRACE_SCOPE("clone_tree");
+    struct clone_state state = {};
+    struct stat st;
+
+    if (stat(src, &st) != 0)
+        return result_from_errno();
+    if (!S_ISDIR(st.st_mode))
+        return MAKE_RESULT(SEV_ERROR, CAT_FILESYSTEM, E_NOT_DIR);
+
+    RESULT result = clone_walk(&state, src, dst, st.st_mode & 07777);
+
+    if (!FAILED(result)) {
+        /* Reflinks are nearly free, but a real copy is worth spreading over a few threads */
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        size_t nthreads = cpus > 1 ? (size_t)cpus - 1 : 0;
+        if (nthreads > CLONE_MAX_THREADS)
+            nthreads = CLONE_MAX_THREADS;
+        if (nthreads > state.count / CLONE_FILES_PER_THREAD)
+            nthreads = state.count / CLONE_FILES_PER_THREAD;
+
+        pthread_t threads[CLONE_MAX_THREADS];
+        size_t started = 0;
+        for (; started < nthreads; started++) {
+            if (pthread_create(&threads[started], nullptr, clone_worker, &state) != 0)
+                break;
+        }
+        clone_worker(&state);
+        for (size_t i = 0; i < started; i++)
+            pthread_join(threads[i], nullptr);
+
+        if (state.failed.load())
+            result = MAKE_RESULT(SEV_ERROR, CAT_FILESYSTEM, E_IO_ERROR);
+    }
+
+    free(state.files);
+    arena_release(&state.paths);
+
+    return result;
+}
+
 RESULT calculate_sha256(const char *file_path, char hash_str[65]) {
     FILE *fp = fopen(file_path, "rb");
     if (!fp) {
@@ -341,8 +1310,12 @@ static constexpr const unsigned char curl_ca_embed[] = {
 };
 
 static int download_progress_callback(void *clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t, curl_off_t) {
+    /* Abort if another startup task failed in the meantime */
+    if (task_canceled())
+        return 1;
+
     const char *filename = (const char *)clientp;
-    if (dltotal > 0) {
+    if (filename && dltotal > 0) {
         double percentage = ((double)dlnow / (double)dltotal) * 100.0;
         log_progress(filename, percentage, (int)dlnow, (int)dltotal);
     }
@@ -353,12 +1326,14 @@ RESULT download_file(const char *url, const char *output_path, const char *heade
     if (!url || !output_path)
         return MAKE_RESULT(SEV_ERROR, CAT_GENERAL, E_INVALID_ARG);
 
+    TRACE_SCOPE("download_file");
+
     /* Similar, but for issues relating to system CA root certificates. Use the bundled certificate if this fails. */
-    static char broken_user_certificate_workaround = 0;
+    static std::atomic<bool> broken_user_certificate_workaround = false;
 
     /* Just always keep this disabled if we ever failed to verify the peer, it's most likely a misconfiguration on
      * behalf of the user */
-    static char broken_user_ssl_workaround = 0;
+    static std::atomic<bool> broken_user_ssl_workaround = false;
 
     CURL *curl = curl_easy_init();
     if (!curl) {
@@ -403,7 +1378,7 @@ RESULT download_file(const char *url, const char *output_path, const char *heade
         curl_easy_setopt(curl, CURLOPT_CAINFO_BLOB, &blob);
     }
 
-    /* progress meter */
+    /* progress meter (the callback also handles cancellation, so it's always installed) */
     const char *filename = nullptr;
     if (log_get_terminal_output()) {
         filename = strrchr(output_path, '/');
@@ -411,10 +1386,10 @@ RESULT download_file(const char *url, const char *output_path, const char *heade
             filename++;
         else
             filename = output_path;
-        curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
-        curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, download_progress_callback);
-        curl_easy_setopt(curl, CURLOPT_XFERINFODATA, filename);
     }
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, download_progress_callback);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, filename);
 
     CURLcode res = curl_easy_perform(curl);
 
@@ -427,6 +1402,9 @@ RESULT download_file(const char *url, const char *output_path, const char *heade
 
     curl_easy_cleanup(curl);
 
+    if (res == CURLE_ABORTED_BY_CALLBACK && task_canceled())
+        return MAKE_RESULT(SEV_ERROR, CAT_GENERAL, E_CANCELED);
+
     if (res != CURLE_OK) {
         /* Awesome Code */
         // clang-format off
@@ -443,7 +1421,7 @@ RESULT download_file(const char *url, const char *output_path, const char *heade
              (res == CURLE_SSL_CLIENTCERT)))
         {
             // clang-format on
-            broken_user_certificate_workaround = 1;
+            broken_user_certificate_workaround = true;
             LOG_WARNING(
                 "Your system's CA root certificate store is either missing or misconfigured. CURL error %u:\n\t%s", res,
                 curl_easy_strerror(res));
@@ -454,9 +1432,9 @@ RESULT download_file(const char *url, const char *output_path, const char *heade
             if (!broken_user_certificate_workaround) {
                 /* First, try using the bundled certificates before disabling peer verification entirely.
                  * Don't log anything yet. */
-                broken_user_certificate_workaround = 1;
+                broken_user_certificate_workaround = true;
             } else {
-                broken_user_ssl_workaround = 1;
+                broken_user_ssl_workaround = true;
                 LOG_ERROR(
                     "SSL peer verification failed. Fix your system's network configuration, but trying to download "
                     "%s again without it...",
@@ -495,6 +1473,8 @@ RESULT extract_archive(const char *archive_path, const char *extract_path) {
     if (!archive_path || !extract_path)
         return MAKE_RESULT(SEV_ERROR, CAT_GENERAL, E_INVALID_ARG);
 
+    TRACE_SCOPE("extract_archive");
+
     int flags = ARCHIVE_EXTRACT_TIME | ARCHIVE_EXTRACT_PERM | ARCHIVE_EXTRACT_ACL | ARCHIVE_EXTRACT_FFLAGS |
                 ARCHIVE_EXTRACT_OWNER;
     RESULT result = RESULT_OK;
@@ -524,6 +1504,11 @@ RESULT extract_archive(const char *archive_path, const char *extract_path) {
 
     struct archive_entry *entry;
     while (archive_read_next_header(a, &entry) == ARCHIVE_OK) {
+        if (task_canceled()) {
+            result = MAKE_RESULT(SEV_ERROR, CAT_GENERAL, E_CANCELED);
+            break;
+        }
+
         char fullpath[BUFFER_SIZE];
         const char *current_path = archive_entry_pathname(entry);
 
@@ -563,6 +1548,7 @@ int execute_program(const char *const argv[], const char *working_dir, const cha
     if (!argv || !argv[0])
         return -1;
 
+    uint64_t start_ns = trace_now_ns();
     pid_t pid = fork();
     if (pid == -1)
         return -1;
@@ -595,6 +1581,9 @@ int execute_program(const char *const argv[], const char *working_dir, const cha
     if (waitpid(pid, &status, 0) == -1)
         return -1;
 
+    if (start_ns)
+        trace_process(argv[0], pid, start_ns, trace_now_ns(), status);
+
     if (WIFEXITED(status)) {
         int childstatus = WEXITSTATUS(status);
         switch (childstatus) {
@@ -663,3 +1652,109 @@ RESULT remove_verbs_from_env(const char *verbs_to_remove[], int num_verbs) {
 
     return result;
 }
+
+/* Read the parent pid from /proc/<pid>/stat, the comm field can contain spaces and parentheses */
+static pid_t get_ppid(pid_t pid) {
+    char path[64], buf[512];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+
+    autoclose FILE *fp = fopen(path, "re");
+    if (!fp || !fgets(buf, sizeof(buf), fp))
+        return -1;
+
+    const char *after_comm = strrchr(buf, ')');
+    int ppid;
+    if (!after_comm || sscanf(after_comm + 1, " %*c %d", &ppid) != 1)
+        return -1;
+
+    return ppid;
+}
+
+static bool in_other_mount_ns(pid_t pid, ino_t self_mnt_ino) {
+    char path[64];
+    struct stat st;
+    snprintf(path, sizeof(path), "/proc/%d/ns/mnt", pid);
+    return stat(path, &st) == 0 && st.st_ino != self_mnt_ino;
+}
+
+static bool comm_equals(pid_t pid, const char *comm) {
+    char path[64], buf[64];
+    snprintf(path, sizeof(path), "/proc/%d/comm", pid);
+
+    autoclose FILE *fp = fopen(path, "re");
+    if (!fp || !fgets(buf, sizeof(buf), fp))
+        return false;
+
+    buf[strcspn(buf, "\n")] = '\0';
+    return STRING_EQUALS(buf, comm);
+}
+
+pid_t find_container_descendant(pid_t root, const char *comm) {
+    struct stat self_st;
+    if (stat("/proc/self/ns/mnt", &self_st) != 0)
+        return 0;
+
+    autoclosedir DIR *proc = opendir("/proc");
+    if (!proc)
+        return 0;
+
+    /* Snapshot all (pid, ppid) pairs, then grow the set of descendants until it stops changing */
+    size_t count = 0, capacity = 256;
+    autofree pid_t *pids = (pid_t *)malloc(capacity * sizeof(pid_t));
+    autofree pid_t *ppids = (pid_t *)malloc(capacity * sizeof(pid_t));
+    autofree bool *descendant = nullptr;
+    if (!pids || !ppids)
+        return 0;
+
+    struct dirent *entry;
+    while ((entry = readdir(proc))) {
+        if (!isdigit((unsigned char)entry->d_name[0]))
+            continue;
+        pid_t pid = (pid_t)strtol(entry->d_name, nullptr, 10);
+        pid_t ppid = get_ppid(pid);
+        if (ppid <= 0)
+            continue;
+
+        if (count == capacity) {
+            capacity *= 2;
+            pid_t *new_pids = (pid_t *)realloc(pids, capacity * sizeof(pid_t));
+            if (!new_pids)
+                return 0;
+            pids = new_pids;
+            pid_t *new_ppids = (pid_t *)realloc(ppids, capacity * sizeof(pid_t));
+            if (!new_ppids)
+                return 0;
+            ppids = new_ppids;
+        }
+        pids[count] = pid;
+        ppids[count] = ppid;
+        count++;
+    }
+
+    descendant = (bool *)calloc(count ? count : 1, sizeof(bool));
+    if (!descendant)
+        return 0;
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t i = 0; i < count; i++) {
+            if (descendant[i])
+                continue;
+            bool parent_found = (ppids[i] == root);
+            for (size_t j = 0; j < count && !parent_found; j++)
+                parent_found = descendant[j] && pids[j] == ppids[i];
+            if (parent_found) {
+                descendant[i] = true;
+                changed = true;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (descendant[i] && in_other_mount_ns(pids[i], self_st.st_ino) && (!comm || comm_equals(pids[i], comm)))
+            return pids[i];
+    }
+
+    return 0;
+}
@@ -16,6 +16,7 @@
 #include <unistd.h>
 
 #include "config.h"
+#include "macros.hpp"
 #include "result.hpp"
 
 #define PROG_NAME "yawl"
@@ -40,14 +41,18 @@
 
 #define STRING_AFTER_PREFIX(string, prefix) (string + (sizeof(prefix) - 1UL))
 
-void _append_sep_impl(char *result_ptr[], const char *separator, size_t num_strings, ...);
+void _append_sep_impl(char *result_ptr[], const char *separator, size_t num_strings, const char *const strings[]);
 
-#define COUNT_JOIN_ARGS(...) (sizeof((const char *[]){__VA_ARGS__}) / sizeof(const char *))
+/* Only takes strings, anything else doesn't compile */
+template <typename... Strings>
+static forceinline void _append_sep(char *result_ptr[], const char *separator, Strings... strings) {
+    const char *const array[] = {strings...};
+    _append_sep_impl(result_ptr, separator, sizeof...(strings), array);
+}
 
 /* Join strings with a `sep` separator into the first argument (`result`) */
 /* Assumes that allocation will succeed. */
-#define append_sep(result, sep, ...)                                                                                   \
-    _append_sep_impl(&(result), sep, COUNT_JOIN_ARGS(__VA_ARGS__) __VA_OPT__(, ) __VA_ARGS__)
+#define append_sep(result, sep, ...) _append_sep(&(result), sep, __VA_ARGS__)
 
 /* Join paths with a `/` separator into the first argument (`result`) */
 /* Assumes that allocation will succeed. */
@@ -58,10 +63,39 @@ void _append_sep_impl(char *result_ptr[], const char *separator, size_t num_stri
  * Returns RESULT_OK on success, error RESULT on failure */
 RESULT ensure_dir(const char *path);
 
-/* Removes a directory and all its contents recursively
+/* Removes a directory and all its contents recursively, on several threads for big trees
  * Returns RESULT_OK on success, error RESULT on failure */
 RESULT remove_dir(const char *path);
 
+/* Fork a process that's detached from us (its own session, stdio on /dev/null, `niceness` added to its priority)
+ * and isn't our child, so it keeps going after we exit or exec. Returns 0 in that process, which must end with
+ * _exit() or exec, a positive value in the caller, or -1 if it couldn't be started */
+pid_t fork_detached(int niceness);
+
+/* Move the directory out of the way and remove it from a detached process, which keeps going after we exit or
+ * exec. `path` is free to be reused as soon as this returns.
+ * Returns RESULT_OK on success, error RESULT on failure */
+RESULT remove_dir_background(const char *path);
+
+/* Write all of `buf`, retrying after interrupts and short writes (and waiting on non-blocking descriptors).
+ * Only uses async-signal-safe calls. Returns 0 on success, -1 with errno set on failure */
+int write_all(int fd, const void *buf, size_t count);
+
+/* Copy everything from `in_fd` to `out_fd` (both at offset 0): reflink if the filesystem can, otherwise let
+ * the kernel copy (copy_file_range(), then sendfile()), otherwise read and write.
+ * Returns false with errno set on failure */
+bool copy_fd_data(int in_fd, int out_fd);
+
+/* Recursively copy the `src` directory to `dst` (which must not exist yet). Files are reflinked where the
+ * filesystem supports it (btrfs, xfs, ...) and copied in parallel otherwise. Symlinks are copied as-is,
+ * file modes and mtimes are preserved.
+ * Returns RESULT_OK on success, error RESULT on failure (a partial `dst` is left for the caller to remove) */
+RESULT clone_tree(const char *src, const char *dst);
+
+/* Copy (or reflink) the regular file `src` to `dst` (which must not exist yet), keeping its mode and mtime.
+ * Returns RESULT_OK on success, error RESULT on failure */
+RESULT clone_file(const char *src, const char *dst);
+
 /* Calculates a sha256sum for a file and puts it in `hash_str`
  * Returns RESULT_OK on success, error RESULT on failure */
 RESULT calculate_sha256(const char *file_path, char hash_str[65]);
@@ -71,7 +105,7 @@ RESULT calculate_sha256(const char *file_path, char hash_str[65]);
  * Returns RESULT_OK on success, error RESULT on failure */
 RESULT get_online_slr_sha256sum(const char *file_name, const char *hash_url, char hash_str[65]);
 
-/* Expands shell paths like ~ to their full equivalents (using wordexp)
+/* Expands shell paths like ~, ~user, $VAR and ${VAR} to their full equivalents, without running a shell
  * Returns a newly allocated string that must be freed by the caller
  * Returns nullptr on failure */
 char *expand_path(const char *path);
@@ -103,5 +137,10 @@ static inline bool is_exec_file(const char *path) {
     return true;
 }
 
+/* Find a descendant of `root` running in a different mount namespace (i.e. inside a container),
+ * optionally only matching processes named `comm`
+ * Returns the host pid, or 0 if there's none */
+pid_t find_container_descendant(pid_t root, const char *comm);
+
 /* Remove specified verbs from YAWL_VERBS environment variable */
 RESULT remove_verbs_from_env(const char *verbs_to_remove[], int num_verbs);
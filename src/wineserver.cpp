@@ -0,0 +1,183 @@
+/*
+ * Persistent wineserver management
+ *
+ * Starting wineserver and loading the prefix registry is a noticeable part of every short
+ * wine invocation. With a persistent server, every wine process for the prefix connects to
+ * the one that's already running instead (through its socket in /tmp, which the container
+ * shares with the host), no matter which container it runs in.
+ *
+ * Copyright (C) 2025 William Horvath
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ * See the full license text in the repository LICENSE file.
+ */
+
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "log.hpp"
+#include "macros.hpp"
+#include "util.hpp"
+#include "wineserver.hpp"
+
+char *wineserver_find(const char *wineserver, const char *exec_path, const char *proton) {
+    char *result = nullptr;
+
+    if (wineserver)
+        return is_exec_file(wineserver) ? strdup(wineserver) : nullptr;
+
+    /* Proton keeps its wine build in files/ (or dist/ for older versions) next to the script */
+    const char *base = proton ? proton : exec_path;
+    if (!base)
+        return nullptr;
+
+    autofree char *dir = strdup(base);
+    char *last_slash = strrchr(dir, '/');
+    if (!last_slash)
+        return nullptr;
+    *last_slash = '\0';
+
+    static const char *const wine_candidates[] = {"wineserver", nullptr};
+    static const char *const proton_candidates[] = {"files/bin/wineserver", "dist/bin/wineserver", nullptr};
+    for (const char *const *candidate = proton ? proton_candidates : wine_candidates; *candidate; candidate++) {
+        join_paths(result, dir, *candidate);
+        if (is_exec_file(result))
+            return result;
+        free(result);
+        result = nullptr;
+    }
+
+    return nullptr;
+}
+
+char *wineserver_get_prefix(const char *proton) {
+    char *result = nullptr;
+    const char *env;
+
+    if ((env = getenv("WINEPREFIX")) && *env)
+        return strdup(env);
+
+    if (proton && (env = getenv("STEAM_COMPAT_DATA_PATH"))) {
+        join_paths(result, env, "pfx");
+        return result;
+    }
+
+    if ((env = getenv("HOME")))
+        join_paths(result, env, ".wine");
+    return result;
+}
+
+bool wineserver_running(const char *prefix) {
+    struct stat st;
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+
+    if (stat(prefix, &st) != 0)
+        return false;
+
+    /* Same naming as wine's server/request.c */
+    if (snprintf(addr.sun_path, sizeof(addr.sun_path), "/tmp/.wine-%u/server-%llx-%llx/socket", getuid(),
+                 (unsigned long long)st.st_dev, (unsigned long long)st.st_ino) >= (int)sizeof(addr.sun_path))
+        return false;
+
+    /* A server that crashed or was killed leaves its socket behind, only one that accepts is running.
+     * Connecting is what wine clients do as well, the server just sees a client that went away again. */
+    autoclosefd int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return false;
+    return connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+}
+
+/* Our environment with `vars` ("NAME=VALUE", nullptr-terminated) replacing the variables of the same name.
+ * Built before forking, since the detached process can't safely allocate while other threads are running.
+ * Only the array needs to be freed */
+static char **env_with(const char *const vars[]) {
+    size_t count = 0;
+    for (char **env = environ; *env; env++)
+        count++;
+    for (const char *const *var = vars; *var; var++)
+        count++;
+
+    char **envp = (char **)calloc(count + 1, sizeof(char *));
+    if (!envp)
+        return nullptr;
+
+    size_t n = 0;
+    for (char **env = environ; *env; env++) {
+        bool replaced = false;
+        for (const char *const *var = vars; *var && !replaced; var++) {
+            size_t name_len = strcspn(*var, "=");
+            replaced = strncmp(*env, *var, name_len + 1) == 0;
+        }
+        if (!replaced)
+            envp[n++] = *env;
+    }
+    for (const char *const *var = vars; *var; var++)
+        envp[n++] = (char *)*var;
+    return envp;
+}
+
+RESULT wineserver_prewarm(const char *entry_point, const char *wineserver, const char *prefix, long persist_secs,
+                          const char *lib_paths) {
+    if (wineserver_running(prefix)) {
+        LOG_DEBUG("wineserver is already running for %s", prefix);
+        return MAKE_RESULT(SEV_INFO, CAT_RUNTIME, E_ALREADY_EXISTS);
+    }
+
+    RETURN_IF_FAILED(ensure_dir(prefix));
+
+    char persist_arg[32];
+    if (persist_secs == WINESERVER_PERSIST_FOREVER)
+        snprintf(persist_arg, sizeof(persist_arg), "-p");
+    else
+        snprintf(persist_arg, sizeof(persist_arg), "-p%ld", persist_secs);
+
+    /* -f keeps the server (and with it, its container) in the foreground of the detached process */
+    const char *argv[] = {entry_point, "--verb=waitforexitandrun", "--", wineserver, "-f", persist_arg, nullptr};
+    autofree char *prefix_var = nullptr;
+    autofree char *lib_var = nullptr;
+    append_sep(prefix_var, "", "WINEPREFIX=", prefix);
+    if (lib_paths)
+        append_sep(lib_var, "", "LD_LIBRARY_PATH=", lib_paths);
+    const char *vars[] = {prefix_var, lib_var, nullptr};
+    autofree char **envp = prefix_var ? env_with(vars) : nullptr;
+    if (!envp)
+        return MAKE_RESULT(SEV_ERROR, CAT_SYSTEM, E_OUT_OF_MEMORY);
+
+    /* Detached, so that the server outlives us and isn't reaped by the launch it's warming up for.
+     * At normal priority, every wine process of the launch waits on it. */
+    pid_t pid = fork_detached(0);
+    if (pid < 0)
+        return result_from_errno();
+
+    if (pid == 0) {
+        execve(argv[0], (char *const *)argv, envp);
+        _exit(127);
+    }
+
+    LOG_INFO("Started a persistent wineserver for %s", prefix);
+
+    return RESULT_OK;
+}
+
+RESULT wineserver_kill(const char *entry_point, const char *wineserver, const char *prefix) {
+    if (!wineserver_running(prefix)) {
+        LOG_INFO("No wineserver is running for %s", prefix);
+        return MAKE_RESULT(SEV_INFO, CAT_RUNTIME, E_NOT_FOUND);
+    }
+
+    const char *argv[] = {entry_point, "--verb=waitforexitandrun", "--", wineserver, "-k", nullptr};
+
+    setenv("WINEPREFIX", prefix, 1);
+    int status = execute_program(argv, nullptr, nullptr, nullptr);
+    if (status != 0) {
+        LOG_ERROR("wineserver -k failed for %s (exit status %d)", prefix, status);
+        return MAKE_RESULT(SEV_ERROR, CAT_RUNTIME, E_UNKNOWN);
+    }
+
+    LOG_INFO("Stopped the wineserver for %s", prefix);
+    return RESULT_OK;
+}
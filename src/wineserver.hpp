@@ -0,0 +1,38 @@
+/*
+ * Persistent wineserver management
+ *
+ * Copyright (C) 2025 William Horvath
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ * See the full license text in the repository LICENSE file.
+ */
+
+#pragma once
+
+#include "result.hpp"
+
+#define WINESERVER_PERSIST_FOREVER (-1L)
+
+/* Find the wineserver that belongs to the wine being launched: `wineserver` if given, otherwise
+ * next to `exec_path`, or inside the Proton distribution for `proton`
+ * Returns a newly allocated path, or nullptr if none was found */
+char *wineserver_find(const char *wineserver, const char *exec_path, const char *proton);
+
+/* Get the prefix a launch will use (WINEPREFIX, the Proton prefix, or ~/.wine)
+ * Returns a newly allocated path */
+char *wineserver_get_prefix(const char *proton);
+
+/* Whether a wineserver is already serving `prefix` (connects to its socket, so leftovers of a dead one don't count) */
+bool wineserver_running(const char *prefix);
+
+/* Start a detached, persistent wineserver for `prefix` through the runtime `entry_point`, unless one is running.
+ * `persist_secs` is how long it stays around after the last client exits (WINESERVER_PERSIST_FOREVER = until killed).
+ * The server gets `lib_paths` as its LD_LIBRARY_PATH, unless that's nullptr. Doesn't touch our environment, so it
+ * can run alongside the other startup tasks, and doesn't wait for the server to come up.
+ * Returns RESULT_OK on success, error RESULT on failure */
+RESULT wineserver_prewarm(const char *entry_point, const char *wineserver, const char *prefix, long persist_secs,
+                          const char *lib_paths);
+
+/* Ask the wineserver for `prefix` to shut down (`wineserver -k`) and wait for it
+ * Returns RESULT_OK on success, error RESULT on failure */
+RESULT wineserver_kill(const char *entry_point, const char *wineserver, const char *prefix);
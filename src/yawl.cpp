@@ -14,17 +14,29 @@
 #include <cstdio>
 #include <cstring>
 #include <getopt.h>
-#include <sys/prctl.h>
 
 #include "apparmor.hpp"
+#include "arena.hpp"
+#include "capture.hpp"
+#include "daemon.hpp"
+#include "dedup.hpp"
+#include "launchplan.hpp"
 #include "log.hpp"
 #include "macros.hpp"
 #include "nsenter.hpp"
+#include "prefix.hpp"
+#include "registry.hpp"
 #include "result.hpp"
+#include "shadercache.hpp"
+#include "supervisor.hpp"
+#include "tasks.hpp"
+#include "trace.hpp"
 #include "update.hpp"
 #include "util.hpp"
+#include "wineserver.hpp"
 #include "yawlconfig.hpp"
 
+#include "curl/curl.h"
 #include "fmt/compile.h"
 #include "fmt/core.h"
 #include "fmt/printf.h"
@@ -46,6 +58,7 @@ using namespace fmt::literals;
 
 #define DEFAULT_EXEC_PATH "/usr/bin/wine"
 #define CONFIG_EXTENSION ".cfg"
+#define CONFIG_MAX_EXTRA_LINES 32
 
 static void __attribute__((__noreturn__)) print_usage() {
     fmt::print(R"_(Usage: {2} [args_for_executable...]
@@ -58,6 +71,8 @@ Environment variables:
                    - 'help'      Display this help and exit
                    - 'check'     Check for updates to {0} (without downloading/installing)
                    - 'update'    Check for, download, and install available updates
+                   - 'auto_update' Check for updates in the background without delaying the launch,
+                                 and install a downloaded update at the start of the next launch
                    - 'exec=PATH' Set the executable to run in the container (default: {1})
                    - 'make_wrapper=NAME' Create a wrapper configuration and symlink
                    - 'config=NAME'       Use a specific configuration file
@@ -65,6 +80,41 @@ Environment variables:
                    - 'proton=PATH':      Set the Proton script to run in the container (overrides 'exec=')
                    - 'proton_verb=NAME': Verb to use to run Proton (default: 'run')
                    - 'enter=PID'         Run an executable in the same container as PID
+                   - 'enter=name:NAME'   Run an executable in the container started by the NAME wrapper/config
+                   - 'enter=prefix:PATH' Run an executable in the container running the PATH prefix
+                   - 'enter=wait:NAME'   Like 'enter=name:NAME' (or 'wait:prefix:PATH'), but wait for the container to start
+                   - 'enter_timeout=SECS' Give up waiting with 'enter=wait:' after SECS seconds (default: wait forever)
+                   - 'daemon'            Keep a container running for this config/prefix, later launches run inside it
+                   - 'daemon_idle=SECS'  Stop the daemon after SECS seconds without launches (default: {3})
+                   - 'supervise'         Stay resident while the program runs, reap orphaned processes, forward signals
+                                         and report CPU/memory/IO usage of the whole process tree when it exits
+                   - 'supervise_grace=SECS' Like 'supervise', and give processes left over after the program exits
+                                         SECS seconds to quit before killing them
+                   - 'capture_output'    Like 'supervise', and write the program's stdout/stderr to zstd-compressed,
+                                         rotating files in $YAWL_INSTALL_DIR/logs instead of the terminal
+                   - 'capture_rate=N'    Keep at most N lines per second from each wine debug channel (default: {5},
+                                         0 = unlimited). If set, it also limits the program's other output
+                   - 'capture_drop=CLASS:CHANNEL,...' Drop these wine debug channels ('*' matches anything,
+                                         e.g. 'fixme:*,err:d3d'), 'stdout'/'stderr' match other output
+                   - 'capture_tail=MB'   Keep the last MB of output in memory, saved next to the logs if the program
+                                         crashes (default: {6})
+                   - 'wineserver_persist[=SECS]' Start a persistent wineserver for the prefix early, so later launches
+                                         reuse it (stays for SECS seconds after the last program exits, default: forever)
+                   - 'make_template'     Run in the prefix template for this wine/proton build (e.g. with 'wineboot'),
+                                         new prefixes are then cloned from it instead of being initialized
+                   - 'overlay_prefix'    Create new prefixes as overlays on top of the prefix template instead of
+                                         cloning it, so that they share its files (needs Linux 5.11 or later and
+                                         unprivileged user namespaces)
+                   - 'flatten_prefix'    Turn the overlay prefix into a standalone prefix and exit
+                   - 'shader_cache_max=MB' Keep the per-app shader caches in $YAWL_INSTALL_DIR/shadercache under MB
+                                         in total, evicting the least recently used apps first (default: {7},
+                                         0 = unlimited)
+                   - 'no_shader_cache'   Leave the DXVK/vkd3d/Mesa/NVIDIA shader caches where they'd normally be
+                   - 'dedup'             Share the disk space of identical files across all prefixes and templates
+                                         (on filesystems with reflinks, e.g. btrfs or xfs) and exit
+                   - 'dedup_hardlink'    Like 'dedup', and hardlink wine's builtin DLLs where reflinks aren't
+                                         supported (the shared files are made read-only)
+                   - 'wineserver_kill'   Stop the persistent wineserver for the prefix ('wineserver -k') and exit
 
             Examples:
                 YAWL_VERBS="make_wrapper=osu;exec=/opt/wine-osu/bin/wine;wineserver=/opt/wine-osu/bin/wineserver" {2}
@@ -72,6 +122,8 @@ Environment variables:
                 YAWL_VERBS="exec=/opt/wine/bin/wine64" {2} winecfg
                 YAWL_VERBS="make_wrapper=cool-wine;exec=/opt/wine/bin/wine64" {2}
                 YAWL_VERBS="enter=$(pgrep game.exe)" {2} cheatengine.exe
+                YAWL_VERBS="enter=name:osu" {2} cheatengine.exe
+                YAWL_VERBS="daemon;config=osu" {2}
 
   YAWL_INSTALL_DIR Override the default installation directory of $XDG_DATA_HOME/{0} or $HOME/.local/share/{0}
             Example:
@@ -87,8 +139,23 @@ Environment variables:
   YAWL_LOG_FILE    Specify a custom path for the log file. By default, logs are written to:
                    - Terminal output (only when running interactively)
                    - $YAWL_INSTALL_DIR/{0}.log
+
+  YAWL_LOG_FORMAT  Set to 'json' to write the log file as JSON lines (timestamps, level, source location, decoded
+                   error codes) instead of plain text
+
+  YAWL_LOG_MAX_SIZE Rotate the log file once it grows past this size (K/M/G suffixes, default: 16M, 0 = never).
+                   The last 3 rotated segments are kept as {0}.log.1 to {0}.log.3
+
+  YAWL_LOG_COMPRESS Set to 'zstd' to compress rotated log segments
+
+  YAWL_UPDATE_TTL  Seconds to reuse the result of the last update check before asking GitHub again
+                   (default: {4}, 0 = always check)
+
+  YAWL_TRACE       Write a Chrome trace-event JSON file with timings for each startup phase and child process
+                   (load it in Perfetto or chrome://tracing). Multiple runs append to the same file.
 )_"_cf,
-               PROG_NAME, DEFAULT_EXEC_PATH, program_invocation_short_name);
+               PROG_NAME, DEFAULT_EXEC_PATH, program_invocation_short_name, DAEMON_DEFAULT_IDLE_TIMEOUT,
+               UPDATE_DEFAULT_TTL, CAPTURE_DEFAULT_RATE, CAPTURE_DEFAULT_TAIL_MB, SHADERCACHE_DEFAULT_MAX_MB);
     exit(0);
 }
 
@@ -100,12 +167,32 @@ struct options {
     const char *proton;       /* Path to the proton script */
     const char *proton_verb;  /* Verb to use to run proton (default: run)*/
     unsigned long enterpid;   /* The pid of the namespace we want to run a command in */
+    const char *enter;        /* Registered container to run a command in ("name:NAME", "prefix:PATH" or "wait:...") */
+    unsigned enter_timeout;   /* Seconds to wait for the container with enter=wait: (0 = forever) */
+    unsigned daemon_idle;     /* Idle timeout for the daemon in seconds (0 = default) */
+    unsigned supervise_grace; /* Seconds leftover processes get after the runtime exits (0 = leave them alone) */
+    struct capture_config capture; /* Output capture settings for 'capture_output' */
+    long wineserver_persist;  /* Keep a wineserver running for this many seconds (0 = don't, -1 = forever) */
+    unsigned shader_cache_max; /* Shader cache budget in MiB (0 = default, -1u = unlimited) */
+    const char *config_lines[CONFIG_MAX_EXTRA_LINES]; /* env./path_prepend=/ld_prepend=/include= verbs, for make_wrapper */
+    unsigned config_line_count;
     unsigned version : 1;     /* 1 = return a version string and exit */
     unsigned verify : 1;      /* 0 = no verification (default), 1 = verify */
     unsigned reinstall : 1;   /* 0 = don't reinstall unless needed, 1 = force reinstall */
     unsigned help : 1;        /* 0 = don't show help, 1 = show help and exit */
     unsigned check : 1;       /* 1 = check for updates */
     unsigned update : 1;      /* 1 = check for and apply updates */
+    unsigned auto_update : 1; /* 1 = check for updates in the background, install them on the next launch */
+    unsigned daemon : 1;      /* 1 = start a container daemon for this config/prefix */
+    unsigned supervise : 1;   /* 1 = stay resident as the subreaper of the runtime instead of exec'ing it */
+    unsigned capture_output : 1; /* 1 = capture the program's stdout/stderr into compressed logs (implies supervise) */
+    unsigned wineserver_kill : 1; /* 1 = stop the persistent wineserver for the prefix and exit */
+    unsigned make_template : 1;   /* 1 = run in (and so initialize) the prefix template for this wine/proton build */
+    unsigned overlay_prefix : 1;  /* 1 = create new prefixes as overlays on top of the template */
+    unsigned flatten_prefix : 1;  /* 1 = turn the overlay prefix into a standalone one and exit */
+    unsigned no_shader_cache : 1; /* 1 = don't manage the shader cache directories */
+    unsigned dedup : 1;           /* 1 = deduplicate the prefixes and exit */
+    unsigned dedup_hardlink : 1;  /* 1 = also hardlink builtin DLLs where reflinks aren't supported */
 };
 
 /* Parse a single option string and update the options structure */
@@ -125,8 +212,80 @@ static RESULT parse_option(nonnull_charp option, struct options *opts) {
         opts->check = 1;
     } else if (LCSTRING_EQUALS(option, "update")) {
         opts->update = 1;
+    } else if (LCSTRING_EQUALS(option, "auto_update")) {
+        opts->auto_update = 1;
+    } else if (LCSTRING_EQUALS(option, "daemon")) {
+        opts->daemon = 1;
+    } else if (LCSTRING_PREFIX(option, "enter_timeout=")) {
+        opts->enter_timeout = str2unum(STRING_AFTER_PREFIX(option, "enter_timeout="), 10);
+    } else if (LCSTRING_PREFIX(option, "daemon_idle=")) {
+        opts->daemon_idle = str2unum(STRING_AFTER_PREFIX(option, "daemon_idle="), 10);
+    } else if (LCSTRING_EQUALS(option, "supervise")) {
+        opts->supervise = 1;
+    } else if (LCSTRING_PREFIX(option, "supervise_grace=")) {
+        opts->supervise = 1;
+        opts->supervise_grace = str2unum(STRING_AFTER_PREFIX(option, "supervise_grace="), 10);
+    } else if (LCSTRING_EQUALS(option, "capture_output")) {
+        opts->supervise = 1;
+        opts->capture_output = 1;
+    } else if (LCSTRING_PREFIX(option, "capture_rate=")) {
+        opts->capture.rate = str2unum(STRING_AFTER_PREFIX(option, "capture_rate="), 10);
+        if (!opts->capture.rate)
+            opts->capture.rate = (unsigned)-1; /* unlimited */
+    } else if (LCSTRING_PREFIX(option, "capture_drop=")) {
+        opts->capture.drop = strdup(STRING_AFTER_PREFIX(option, "capture_drop="));
+    } else if (LCSTRING_PREFIX(option, "capture_tail=")) {
+        opts->capture.tail_mb = str2unum(STRING_AFTER_PREFIX(option, "capture_tail="), 10);
+    } else if (LCSTRING_EQUALS(option, "wineserver_persist")) {
+        opts->wineserver_persist = WINESERVER_PERSIST_FOREVER;
+    } else if (LCSTRING_PREFIX(option, "wineserver_persist=")) {
+        opts->wineserver_persist = str2unum(STRING_AFTER_PREFIX(option, "wineserver_persist="), 10);
+        if (!opts->wineserver_persist)
+            opts->wineserver_persist = WINESERVER_PERSIST_FOREVER;
+    } else if (LCSTRING_EQUALS(option, "make_template")) {
+        opts->make_template = 1;
+    } else if (LCSTRING_EQUALS(option, "wineserver_kill")) {
+        opts->wineserver_kill = 1;
+    } else if (LCSTRING_EQUALS(option, "overlay_prefix")) {
+        opts->overlay_prefix = 1;
+    } else if (LCSTRING_EQUALS(option, "flatten_prefix")) {
+        opts->flatten_prefix = 1;
+    } else if (LCSTRING_PREFIX(option, "shader_cache_max=")) {
+        opts->shader_cache_max = str2unum(STRING_AFTER_PREFIX(option, "shader_cache_max="), 10);
+        if (!opts->shader_cache_max)
+            opts->shader_cache_max = (unsigned)-1; /* unlimited */
+    } else if (LCSTRING_EQUALS(option, "no_shader_cache")) {
+        opts->no_shader_cache = 1;
+    } else if (LCSTRING_EQUALS(option, "dedup")) {
+        opts->dedup = 1;
+    } else if (LCSTRING_EQUALS(option, "dedup_hardlink")) {
+        opts->dedup = 1;
+        opts->dedup_hardlink = 1;
+    } else if (LCSTRING_PREFIX(option, "env.") || LCSTRING_PREFIX(option, "path_prepend=") ||
+               LCSTRING_PREFIX(option, "ld_prepend=") || LCSTRING_PREFIX(option, "include=")) {
+        /* The same entries a config file can have, applied right away (except include=, which is only
+         * meaningful for make_wrapper) and remembered so that make_wrapper can write them out */
+        if (LCSTRING_PREFIX(option, "env.")) {
+            autofree char *key = strdup(STRING_AFTER_PREFIX(option, "env."));
+            char *equals = strchr(key, '=');
+            if (!equals || equals == key)
+                return MAKE_RESULT(SEV_WARNING, CAT_CONFIG, E_INVALID_ARG);
+            *equals = '\0';
+            config::apply_env_entry(config::entry_kind::Env, key, equals + 1);
+        } else if (LCSTRING_PREFIX(option, "path_prepend=")) {
+            config::apply_env_entry(config::entry_kind::PathPrepend, nullptr,
+                                    STRING_AFTER_PREFIX(option, "path_prepend="));
+        } else if (LCSTRING_PREFIX(option, "ld_prepend=")) {
+            config::apply_env_entry(config::entry_kind::LdPrepend, nullptr, STRING_AFTER_PREFIX(option, "ld_prepend="));
+        }
+        if (opts->config_line_count < CONFIG_MAX_EXTRA_LINES)
+            opts->config_lines[opts->config_line_count++] = strdup(option);
     } else if (LCSTRING_PREFIX(option, "enter=")) {
-        opts->enterpid = str2unum(STRING_AFTER_PREFIX(option, "enter="), 10);
+        const char *target = STRING_AFTER_PREFIX(option, "enter=");
+        if (STRING_PREFIX(target, "name:") || STRING_PREFIX(target, "prefix:") || STRING_PREFIX(target, "wait:"))
+            opts->enter = strdup(target);
+        else
+            opts->enterpid = str2unum(target, 10);
     } else if (LCSTRING_PREFIX(option, "exec=")) {
         opts->exec_path = expand_path(STRING_AFTER_PREFIX(option, "exec="));
         if (!opts->exec_path)
@@ -154,6 +313,7 @@ static RESULT parse_option(nonnull_charp option, struct options *opts) {
 }
 
 static RESULT parse_env_options(struct options *opts) {
+    TRACE_SCOPE("parse_env_options");
     const char *verbs = getenv("YAWL_VERBS");
     if (!verbs)
         return RESULT_OK;
@@ -181,26 +341,11 @@ static RESULT parse_env_options(struct options *opts) {
     return RESULT_OK;
 }
 
-static RESULT verify_runtime(nonnull_charp runtime_path) {
-    autofree char *versions_txt_path = nullptr;
+static RESULT run_pv_verify(void *data) {
+    const char *runtime_path = (const char *)data;
     autofree char *pv_verify_path = nullptr;
-
-    /* First, a lightweight check for VERSIONS.txt (same as the SLR shell script) */
-    join_paths(versions_txt_path, runtime_path, "VERSIONS.txt");
-
-    if (access(versions_txt_path, F_OK) != 0) {
-        LOG_ERROR("VERSIONS.txt not found. Runtime may be corrupt or incomplete.");
-        return MAKE_RESULT(SEV_ERROR, CAT_RUNTIME, E_NOT_FOUND);
-    }
-
-    /* Check if pv-verify exists */
     join_paths(pv_verify_path, runtime_path, "pressure-vessel/bin/pv-verify");
 
-    if (!is_exec_file(pv_verify_path)) {
-        LOG_ERROR("pv-verify not found. Runtime may be corrupt or incomplete.");
-        return MAKE_RESULT(SEV_ERROR, CAT_RUNTIME, E_NOT_FOUND);
-    }
-
     const char *argv[] = {pv_verify_path, "--quiet", nullptr};
     int cmd_ret = execute_program(argv, runtime_path, nullptr, nullptr);
 
@@ -214,17 +359,50 @@ static RESULT verify_runtime(nonnull_charp runtime_path) {
                                           : E_UNKNOWN);
     }
 
-    autofree char *entry_point = nullptr;
-    join_paths(entry_point, config::yawl_dir, RUNTIME_NAME "/_v2-entry-point");
+    return RESULT_OK;
+}
+
+static RESULT run_apparmor_detect(void *data) { return apparmor_detect((const char *)data); }
+
+static RESULT verify_runtime(nonnull_charp runtime_path) {
+    TRACE_SCOPE("verify_runtime");
+    autoarena struct arena paths = {};
+    char *versions_txt_path = arena_path(&paths, runtime_path, "VERSIONS.txt");
+    char *pv_verify_path = arena_path(&paths, runtime_path, "pressure-vessel/bin/pv-verify");
+    char *entry_point = arena_path(&paths, config::yawl_dir, RUNTIME_NAME "/_v2-entry-point");
+
+    if (!versions_txt_path || !pv_verify_path || !entry_point)
+        return MAKE_RESULT(SEV_ERROR, CAT_SYSTEM, E_OUT_OF_MEMORY);
+
+    /* First, a lightweight check for VERSIONS.txt (same as the SLR shell script) */
+    if (access(versions_txt_path, F_OK) != 0) {
+        LOG_ERROR("VERSIONS.txt not found. Runtime may be corrupt or incomplete.");
+        return MAKE_RESULT(SEV_ERROR, CAT_RUNTIME, E_NOT_FOUND);
+    }
+
+    /* Check if pv-verify exists */
+    if (!is_exec_file(pv_verify_path)) {
+        LOG_ERROR("pv-verify not found. Runtime may be corrupt or incomplete.");
+        return MAKE_RESULT(SEV_ERROR, CAT_RUNTIME, E_NOT_FOUND);
+    }
 
     if (!is_exec_file(entry_point)) {
         LOG_ERROR("Runtime entry point not found: %s", entry_point);
         return MAKE_RESULT(SEV_ERROR, CAT_RUNTIME, E_NOT_FOUND);
     }
 
-    /* Check and fix AppArmor issues if needed */
-    RESULT apparmor_result = handle_apparmor(entry_point);
-    if (FAILED(apparmor_result)) {
+    /* pv-verify and the AppArmor container probe are both just waiting on subprocesses, run them side by side.
+     * Installing a profile waits until pv-verify has vouched for the runtime. */
+    struct task_graph graph = {};
+    task_add(&graph, "pv-verify", run_pv_verify, (void *)runtime_path, 0, TASK_FATAL);
+    int apparmor_task = task_add(&graph, "apparmor_detect", run_apparmor_detect, entry_point, 0, 0);
+
+    RESULT result = task_graph_run(&graph);
+    if (FAILED(result))
+        return result;
+
+    /* Fix AppArmor issues if needed */
+    if (FAILED(graph.tasks[apparmor_task].result) && FAILED(apparmor_fix(entry_point))) {
         LOG_WARNING("AppArmor issues detected but couldn't be fully resolved.");
         LOG_WARNING("The program will continue, but may not work correctly.");
     }
@@ -257,22 +435,24 @@ static RESULT verify_slr_hash(nonnull_charp archive_path, nonnull_charp hash_url
 }
 
 static RESULT setup_runtime(const struct options *opts) {
+    TRACE_SCOPE("setup_runtime");
     /* Reinstall obviously implies verify */
     RESULT ret = RESULT_OK;
     int install = opts->reinstall, verify = (opts->verify || opts->reinstall);
-    autofree char *archive_path = nullptr;
-    autofree char *runtime_path = nullptr;
+    autoarena struct arena paths = {};
+    char *archive_path = arena_path(&paths, config::yawl_dir, RUNTIME_NAME ".tar.xz");
+    char *runtime_path = arena_path(&paths, config::yawl_dir, RUNTIME_NAME);
     struct stat st;
 
-    join_paths(archive_path, config::yawl_dir, RUNTIME_NAME ".tar.xz");
-    join_paths(runtime_path, config::yawl_dir, RUNTIME_NAME);
+    if (!archive_path || !runtime_path)
+        return MAKE_RESULT(SEV_ERROR, CAT_SYSTEM, E_OUT_OF_MEMORY);
 
     if (!(stat(runtime_path, &st) == 0 && S_ISDIR(st.st_mode))) {
         LOG_INFO("Installing runtime...");
         install = 1;
     } else if (install) {
         LOG_INFO("Reinstalling runtime...");
-        RESULT remove_result = remove_dir(runtime_path);
+        RESULT remove_result = remove_dir_background(runtime_path);
         if (FAILED(remove_result))
             LOG_RESULT(Level::Warning, remove_result, "Failed to remove existing runtime directory");
         unlink(archive_path);
@@ -287,7 +467,7 @@ static RESULT setup_runtime(const struct options *opts) {
                 ret = RESULT_FAIL;
                 return ret;
             }
-            RESULT remove_result = remove_dir(runtime_path);
+            RESULT remove_result = remove_dir_background(runtime_path);
             if (FAILED(remove_result))
                 LOG_RESULT(Level::Warning, remove_result, "Failed to remove corrupt runtime directory");
             LOG_INFO("Reinstalling corrupt runtime folder...");
@@ -310,7 +490,7 @@ static RESULT setup_runtime(const struct options *opts) {
             }
             if (attempt == 2) {
                 LOG_WARNING("Previous attempt failed, trying one more time...");
-                RESULT remove_result = remove_dir(runtime_path);
+                RESULT remove_result = remove_dir_background(runtime_path);
                 if (FAILED(remove_result)) {
                     LOG_RESULT(Level::Warning, remove_result, "Failed to remove runtime directory");
                 }
@@ -386,6 +566,7 @@ static char *get_top_libdir(nonnull_charp exec_path) {
 }
 
 static char *build_library_paths(nonnull_charp exec_path) {
+    TRACE_SCOPE("build_library_paths");
     autofree char *top_libdir = nullptr;
     char *result = nullptr;
     struct stat st;
@@ -397,10 +578,12 @@ static char *build_library_paths(nonnull_charp exec_path) {
     top_libdir = get_top_libdir(exec_path);
 
     /* append_sep with "" as separator just acts like concatenation */
+    plan_add_dependency(top_libdir);
     if (top_libdir && stat(top_libdir, &st) == 0 && S_ISDIR(st.st_mode))
         append_sep(result, "", orig_path ? ":" : "", top_libdir, "/lib64:", top_libdir, "/lib32:", top_libdir, "/lib");
 
 #ifdef YAWL_ARCH_AARCH64
+    plan_add_dependency("/usr/aarch64-linux-gnu/lib");
     if (stat("/usr/aarch64-linux-gnu/lib", &st) == 0 && S_ISDIR(st.st_mode))
         append_sep(result, "", result ? ":" : "", "/usr/aarch64-linux-gnu/lib");
 #endif
@@ -410,6 +593,7 @@ static char *build_library_paths(nonnull_charp exec_path) {
 
 /* required for ancient Debian/Ubuntu */
 static char *build_mesa_paths(void) {
+    TRACE_SCOPE("build_mesa_paths");
     const char *mesa_paths[] = {"/usr/lib/i386-linux-gnu/dri",
                                 "/usr/i386-linux-gnu/lib/dri",
                                 "/usr/i386-linux-gnu/lib32/dri",
@@ -429,6 +613,7 @@ static char *build_mesa_paths(void) {
         result = strdup(orig_path);
 
     for (const char **path = mesa_paths; *path; path++) {
+        plan_add_dependency(*path);
         if (access(*path, F_OK) == 0)
             append_sep(result, ":", *path);
     }
@@ -454,13 +639,34 @@ static RESULT create_config_file(nonnull_charp config_name, const struct options
         return result;
     }
 
-    /* Write the current configuration */
-    /* TODO: maybe support adding PATHs and other env vars */
+    /* Write the current configuration, inherited configs first so that the rest can override them */
+    for (unsigned i = 0; i < opts->config_line_count; i++) {
+        if (LCSTRING_PREFIX(opts->config_lines[i], "include="))
+            fmt::fprintf(fp, "%s\n", opts->config_lines[i]);
+    }
+
     if (opts->proton)
         fmt::fprintf(fp, "proton=%s\n", opts->proton);
     else if (opts->exec_path && !STRING_EQUALS(opts->exec_path, DEFAULT_EXEC_PATH))
         fmt::fprintf(fp, "exec=%s\n", opts->exec_path);
 
+    if (opts->wineserver_persist) {
+        if (opts->wineserver)
+            fmt::fprintf(fp, "wineserver=%s\n", opts->wineserver);
+        if (opts->wineserver_persist == WINESERVER_PERSIST_FOREVER)
+            fmt::fprintf(fp, "wineserver_persist\n");
+        else
+            fmt::fprintf(fp, "wineserver_persist=%ld\n", opts->wineserver_persist);
+    }
+
+    if (opts->overlay_prefix)
+        fmt::fprintf(fp, "overlay_prefix\n");
+
+    for (unsigned i = 0; i < opts->config_line_count; i++) {
+        if (!LCSTRING_PREFIX(opts->config_lines[i], "include="))
+            fmt::fprintf(fp, "%s\n", opts->config_lines[i]);
+    }
+
     LOG_INFO("Created configuration file: %s", config_path);
 
     return result;
@@ -471,6 +677,7 @@ static RESULT create_symlink(nonnull_charp config_name) {
     autofree char *exec_path = nullptr;
     autofree char *exec_dir = nullptr;
     autofree char *symlink_path = nullptr;
+    autofree char *launcher_path = nullptr;
     RESULT result = RESULT_OK;
 
     /* Get the full path to the current executable */
@@ -492,6 +699,14 @@ static RESULT create_symlink(nonnull_charp config_name) {
     join_paths(symlink_path, exec_dir, program_invocation_short_name);
     append_sep(symlink_path, "-", config_name);
 
+    /* Point the wrapper at the minimal front-end if it's installed alongside us, it falls back to this binary */
+    join_paths(launcher_path, exec_dir, PROG_NAME_ARCH LAUNCHER_SUFFIX);
+    if (is_exec_file(launcher_path)) {
+        char *temp = exec_path;
+        exec_path = launcher_path;
+        launcher_path = temp;
+    }
+
     if (access(symlink_path, F_OK) == 0) {
         LOG_DEBUG("Symlink already exists: %s", symlink_path);
         unlink(symlink_path);
@@ -561,73 +776,121 @@ static inline const char *get_config_name(const struct options *opts) {
 
     const char *temp = strchr(program_invocation_short_name, '-');
     /* Whoops, originally I uploaded aarch64 releases as yawl-aarch64, which breaks this check... */
-    if (temp && (temp + 1) && !STRING_EQUALS(temp + 1, "aarch64"))
+    if (temp && (temp + 1) && !STRING_EQUALS(temp + 1, "aarch64") && !STRING_EQUALS(temp, LAUNCHER_SUFFIX))
         wrapper_name = temp + 1;
 
     return wrapper_name;
 }
 
-/* Load a configuration from a file, overrides opts passed in from env var */
-static RESULT load_config(nonnull_charp config_name, struct options *opts) {
-    autofree char *config_path = nullptr;
-    autoclose FILE *fp = nullptr;
+static RESULT apply_config_entry(config::entry_kind kind, const char *key, const char *value, void *data) {
+    struct options *opts = (struct options *)data;
+
+    if (kind != config::entry_kind::Option) {
+        config::apply_env_entry(kind, key, value);
+        return RESULT_OK;
+    }
+
+    /* parse_option() may modify the string, and the value points into the read-only cache */
     char line[BUFFER_SIZE];
-    RESULT result = RESULT_OK;
+    snprintf(line, sizeof(line), "%s", value);
 
-    /* First, try using the name directly as a path */
-    if (access(config_name, F_OK) == 0) {
-        config_path = strdup(config_name);
-    } else {
-        /* Build the config file path in the standard location */
-        join_paths(config_path, config::config_dir, config_name);
+    RESULT option_result = parse_option(line, opts);
+    if (FAILED(option_result)) {
+        if (RESULT_SEVERITY(option_result) > SEV_WARNING)
+            return option_result;
+        LOG_INFO("Unknown configuration option: %s", line);
+    }
 
-        /* Add extension if not already present */
-        if (!strstr(config_name, CONFIG_EXTENSION))
-            append_sep(config_path, "", CONFIG_EXTENSION);
+    return RESULT_OK;
+}
 
-        /* Check if the file exists */
-        if (access(config_path, F_OK) != 0) {
-            LOG_ERROR("Config file not found: %s", config_path);
-            return MAKE_RESULT(SEV_ERROR, CAT_CONFIG, E_NOT_FOUND);
-        }
+/* Load a configuration from a file, overrides opts passed in from env var */
+static RESULT load_config(nonnull_charp config_name, struct options *opts) {
+    TRACE_SCOPE("load_config");
+    autofree char *config_path = config::find_file(config_name);
+    RESULT result = RESULT_OK;
+
+    /* Check if the file exists */
+    plan_add_dependency(config_path);
+    if (access(config_path, F_OK) != 0) {
+        LOG_ERROR("Config file not found: %s", config_path);
+        return MAKE_RESULT(SEV_ERROR, CAT_CONFIG, E_NOT_FOUND);
     }
 
-    /* Open the config file */
-    fp = fopen(config_path, "r");
-    if (!fp) {
-        result = result_from_errno();
-        LOG_RESULT(Level::Error, result, "Failed to open config file");
+    result = config::load_file(config_path, apply_config_entry, opts);
+    if (FAILED(result))
         return result;
-    }
 
-    /* Read the configuration */
-    while (fgets(line, sizeof(line), fp)) {
-        /* Remove trailing newline */
-        char *newline = strchr(line, '\n');
-        if (newline)
-            *newline = '\0';
+    LOG_DEBUG("Loaded configuration from: %s", config_path);
+    return result;
+}
 
-        /* Skip empty lines */
-        if (line[0] == '\0')
-            continue;
+/* Startup steps that run concurrently in main(). They must not touch the environment, since the other
+ * tasks read it; results are stored here and applied on the main thread afterwards. */
+struct startup_state {
+    const struct options *opts;
+    char *lib_paths;
+    char *mesa_paths;
+    const char *entry_point;
+    char *wineserver; /* for the prewarm, with the prefix it serves */
+    char *wineserver_prefix;
+};
 
-        RESULT option_result = parse_option(line, opts);
-        if (FAILED(option_result)) {
-            if (RESULT_SEVERITY(option_result) > SEV_WARNING) {
-                result = option_result;
-                break;
-            }
-            LOG_INFO("Unknown configuration option: %s", line);
-        }
-    }
+static RESULT update_task(void *data) {
+    const struct startup_state *state = (const struct startup_state *)data;
+    return handle_updates(state->opts->check, state->opts->update);
+}
 
-    LOG_DEBUG("Loaded configuration from: %s", config_path);
+static RESULT runtime_task(void *data) { return setup_runtime(((const struct startup_state *)data)->opts); }
+
+static RESULT lib_paths_task(void *data) {
+    struct startup_state *state = (struct startup_state *)data;
+    state->lib_paths = build_library_paths(state->opts->exec_path);
+    return RESULT_OK;
+}
+
+static RESULT mesa_paths_task(void *data) {
+    ((struct startup_state *)data)->mesa_paths = build_mesa_paths();
+    return RESULT_OK;
+}
+
+/* Get the wineserver going while the rest of startup and then the entry point run */
+static RESULT prewarm_task(void *data) {
+    const struct startup_state *state = (const struct startup_state *)data;
+    RESULT result = wineserver_prewarm(state->entry_point, state->wineserver, state->wineserver_prefix,
+                                       state->opts->wineserver_persist, state->lib_paths);
+    if (FAILED(result))
+        LOG_RESULT(Level::Warning, result, "Failed to start a persistent wineserver");
     return result;
 }
 
+/* Report the result of handle_updates(), restarting into the new binary if requested */
+static void finish_update(RESULT update_result, bool restart, char *argv[]) {
+    if (FAILED(update_result)) {
+        LOG_RESULT(Level::Warning, update_result, "Update unsuccessful");
+        LOG_DEBUG_RESULT(update_result, "May have hit rate limit");
+    } else if (RESULT_CODE(update_result) == E_UPDATE_PERFORMED) {
+        LOG_INFO("Update installed.");
+        /* Restart if there are verbs remaining to be processed. */
+        if (restart) {
+            LOG_INFO("Additional verbs supplied, restarting...");
+            trace_finish();
+            log_flush();
+            execv(argv[0], argv);
+            LOG_ERROR("Failed to restart: %s", strerror(errno));
+        }
+    }
+}
+
 /* Note that we don't *really* care about freeing things from main(), since that's handled
    either when execv() is called or when the process exits. */
 int main(int argc, char *argv[]) {
+    trace_init();
+    uint64_t main_start_ns = trace_now_ns();
+
+    /* Paths that are needed until the exec */
+    autoarena struct arena launch_paths = {};
+
     if (geteuid() == 0) {
         fmt::fprintf(stderr, "This program should not be run as root. Exiting.\n");
         return 1;
@@ -639,6 +902,16 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    /* Replay the launch plan from a previous identical launch if it's still valid, otherwise record a new one */
+    const char *plan_name = nullptr;
+    char *plan_dir = nullptr;
+    if (plan_verbs_eligible(&plan_name)) {
+        plan_name = plan_name_for(plan_name);
+        plan_dir = arena_path(&launch_paths, config::yawl_dir, PLAN_DIR);
+        plan_exec(plan_dir, plan_name, argc, argv);
+        plan_record_begin();
+    }
+
     if (FAILED(config::setup_config_dir())) {
         fmt::fprintf(stderr, "The configuration directory is unusable\n");
         return 1;
@@ -656,6 +929,8 @@ int main(int argc, char *argv[]) {
     struct options opts = {};
     opts.exec_path = DEFAULT_EXEC_PATH;
 
+    /* env. entries don't override what the user set, but do override each other */
+    config::protect_env();
     result = parse_env_options(&opts);
     LOG_AND_RETURN_IF_FAILED(Level::Error, result, "Failed to parse options");
 
@@ -664,28 +939,24 @@ int main(int argc, char *argv[]) {
         return 0;
     }
 
+    bool defer_update = false;
     if (opts.check || opts.update) {
         /* Remove update verbs from env */
         const char *verbs_to_remove[] = {"update", "check"};
         RESULT remove_result = remove_verbs_from_env(verbs_to_remove, 2);
-
-        RESULT update_result = handle_updates(opts.check, opts.update);
-        if (FAILED(update_result)) {
-            LOG_RESULT(Level::Warning, update_result, "Update unsuccessful");
-            LOG_DEBUG_RESULT(update_result, "May have hit rate limit");
-        } else if (RESULT_CODE(update_result) == E_UPDATE_PERFORMED) {
-            LOG_INFO("Update installed.");
-            /* Restart if there are verbs remaining to be processed. */
-            if (RESULT_CODE(remove_result) != E_NOT_FOUND) {
-                LOG_INFO("Additional verbs supplied, restarting...");
-                execv(argv[0], argv);
-                LOG_ERROR("Failed to restart: %s", strerror(errno));
+        bool more_verbs = RESULT_CODE(remove_result) != E_NOT_FOUND;
+
+        /* For a normal launch, the update check runs alongside the rest of startup instead */
+        defer_update = more_verbs && !opts.version && !opts.make_wrapper && !opts.enterpid && !opts.enter &&
+                       !opts.daemon && !opts.wineserver_kill && !opts.flatten_prefix && !opts.dedup;
+        if (!defer_update) {
+            RESULT update_result = handle_updates(opts.check, opts.update);
+            finish_update(update_result, more_verbs, argv);
+            if (!more_verbs) {
+                LOG_DEBUG("Exiting now, no more verbs to process.");
+                return RESULT_CODE(update_result);
             }
         }
-        if (RESULT_CODE(remove_result) == E_NOT_FOUND) {
-            LOG_DEBUG("Exiting now, no more verbs to process.");
-            return RESULT_CODE(update_result);
-        }
     }
 
     if (opts.version) {
@@ -693,6 +964,12 @@ int main(int argc, char *argv[]) {
         return 0;
     }
 
+    if (opts.dedup) {
+        result = dedup_run(opts.dedup_hardlink);
+        LOG_AND_RETURN_IF_FAILED(Level::Error, result, "Failed to deduplicate the prefixes");
+        return 0;
+    }
+
     /* Handle make_wrapper option */
     if (opts.make_wrapper) {
         LOG_DEBUG("Making wrapper %s", opts.make_wrapper);
@@ -714,11 +991,22 @@ int main(int argc, char *argv[]) {
 
     const char *config_name = get_config_name(&opts);
     if (config_name) {
+        /* The env. entries of YAWL_VERBS win over the config's */
+        config::protect_env();
         result = load_config(config_name, &opts);
         if (FAILED(result))
             LOG_WARNING("Failed to load configuration. Continuing with defaults.");
     }
 
+    /* Config files can contain verbs too, which a plan can't reproduce */
+    if (opts.verify || opts.reinstall || opts.enterpid || opts.enter || opts.check || opts.update || opts.daemon ||
+        opts.supervise || opts.wineserver_persist || opts.wineserver_kill || opts.make_template || opts.auto_update)
+        plan_record_cancel();
+
+    /* After the config, which is where auto_update usually comes from */
+    if (opts.auto_update && !opts.check && !opts.update)
+        finish_update(handle_auto_update(), true, argv);
+
     if (opts.proton) {
         opts.exec_path = opts.proton;
 
@@ -730,53 +1018,216 @@ int main(int argc, char *argv[]) {
 
         /* Create default compat data path if none specified */
         const char *wineprefix = getenv("WINEPREFIX");
-        if (wineprefix) {
+        if (opts.make_template) {
+            /* Handled below */
+        } else if (wineprefix) {
             /* Make sure Wineprefix exists beforehand */
-            ensure_dir(wineprefix);
+            prefix_provision(wineprefix, opts.exec_path, opts.overlay_prefix);
+            plan_add_dependency(wineprefix);
             setenv("STEAM_COMPAT_DATA_PATH", wineprefix, 1);
         } else {
-            /* Look for appid and if not default, create the corresponding prefix for it */
+            /* Create the prefix corresponding to the appid (or the default one) */
             char *appid = getenv("STEAM_COMPAT_APP_ID");
-            char *prefix_path = nullptr;
+            char *prefix_path = arena_path(&launch_paths, config::yawl_dir, PREFIX_DIR, appid);
+
+            prefix_provision(prefix_path, opts.exec_path, opts.overlay_prefix);
+            plan_add_dependency(prefix_path);
+            setenv("STEAM_COMPAT_DATA_PATH", prefix_path, 1);
+        }
+
+        /* Keep the shader caches out of the prefix, so they survive it being reset */
+        if (!opts.make_template && !opts.no_shader_cache) {
+            const char *shader_cache_app = getenv("STEAM_COMPAT_APP_ID");
+            result = shadercache_setup(shader_cache_app);
+            if (FAILED(result)) {
+                LOG_RESULT(Level::Warning, result, "Failed to set up the shader cache directories");
+            } else if (opts.shader_cache_max != (unsigned)-1) {
+                unsigned max_mb = opts.shader_cache_max ? opts.shader_cache_max : SHADERCACHE_DEFAULT_MAX_MB;
+                result = shadercache_gc(shader_cache_app, (uint64_t)max_mb * 1024 * 1024);
+                if (FAILED(result))
+                    LOG_DEBUG_RESULT(result, "Couldn't start the shader cache cleanup");
+            }
+        }
+    } else if (!opts.make_template && getenv("WINEPREFIX")) {
+        prefix_provision(getenv("WINEPREFIX"), opts.exec_path, opts.overlay_prefix);
+    }
+
+    /* Run this launch in the template itself, so that wine/proton initializes it for later clones */
+    if (opts.make_template) {
+        autofree char *template_path = prefix_template_path(opts.exec_path);
+        if (!template_path || FAILED(ensure_dir(template_path))) {
+            LOG_ERROR("Can't make a prefix template for %s", opts.exec_path);
+            return 1;
+        }
+        LOG_INFO("Initializing the prefix template %s", template_path);
+        setenv(opts.proton ? "STEAM_COMPAT_DATA_PATH" : "WINEPREFIX", template_path, 1);
+    }
+
+    const char *active_prefix = getenv(opts.proton ? "STEAM_COMPAT_DATA_PATH" : "WINEPREFIX");
+    if (opts.flatten_prefix) {
+        if (!active_prefix) {
+            LOG_ERROR("No prefix to flatten, set WINEPREFIX (or STEAM_COMPAT_APP_ID with 'proton=').");
+            return 1;
+        }
+        result = prefix_flatten(active_prefix);
+        if (RESULT_CODE(result) == E_NOT_FOUND)
+            LOG_WARNING("%s is not an overlay prefix.", active_prefix);
+        else if (RESULT_CODE(result) == E_NOT_READY)
+            LOG_ERROR("%s is in use, quit the program running in it first.", active_prefix);
+        else if (FAILED(result))
+            LOG_RESULT(Level::Error, result, "Failed to flatten the prefix");
+        return FAILED(result) ? 1 : 0;
+    }
 
-            if (!STRING_EQUALS(appid, PROG_NAME "-default"))
-                join_paths(prefix_path, config::yawl_dir, "prefixes", appid);
+    /* A plan would exec the entry point without mounting the overlay first */
+    bool overlay_mount = !opts.make_template && active_prefix && prefix_is_overlay(active_prefix);
+    if (overlay_mount)
+        plan_record_cancel();
+
+    int enter_pidfd = -1;
+    if (opts.enter) {
+        pid_t container_pid = 0;
+        if (STRING_PREFIX(opts.enter, "wait:")) {
+            /* wait:NAME is short for wait:name:NAME */
+            autofree char *spec = nullptr;
+            const char *target = STRING_AFTER_PREFIX(opts.enter, "wait:");
+            if (STRING_PREFIX(target, "name:") || STRING_PREFIX(target, "prefix:"))
+                spec = strdup(target);
             else
-                join_paths(prefix_path, config::yawl_dir, "prefixes", PROG_NAME "-default");
+                append_sep(spec, "", "name:", target);
 
-            ensure_dir(prefix_path);
-            setenv("STEAM_COMPAT_DATA_PATH", prefix_path, 1);
+            LOG_INFO("Waiting for the container for %s...", spec);
+            result = registry_wait(config::yawl_dir, spec, opts.enter_timeout * 1000L, &container_pid, &enter_pidfd);
+        } else {
+            result = registry_lookup(config::yawl_dir, opts.enter, &container_pid, &enter_pidfd);
         }
+
+        if (RESULT_CODE(result) == E_NOT_READY) {
+            LOG_ERROR("The container for %s is still starting up, try again in a moment.", opts.enter);
+            return 1;
+        } else if (RESULT_CODE(result) == E_TIMEOUT) {
+            LOG_ERROR("Timed out waiting for the container for %s.", opts.enter);
+            return 1;
+        } else if (FAILED(result)) {
+            LOG_RESULT(Level::Error, result, "No running container found");
+            return 1;
+        }
+        LOG_DEBUG("Resolved %s to pid %d", opts.enter, container_pid);
+        opts.enterpid = container_pid;
     }
 
     if (opts.enterpid) {
-        do_nsenter(argc, argv, opts.enterpid);
+        trace_end("main", main_start_ns);
+        trace_finish();
+        log_flush();
+        do_nsenter(argc, argv, opts.enterpid, enter_pidfd);
         /* Should not reach here if do_nsenter succeeded */
         return 1;
     }
 
-    /* Set up library paths based on the executable path */
-    char *lib_paths = build_library_paths(opts.exec_path);
-    if (lib_paths) {
-        setenv("LD_LIBRARY_PATH", lib_paths, 1);
-        free(lib_paths);
+    if (opts.wineserver_kill) {
+        autofree char *ws_entry_point = nullptr;
+        autofree char *wineserver = wineserver_find(opts.wineserver, opts.exec_path, opts.proton);
+        autofree char *prefix = wineserver_get_prefix(opts.proton);
+        join_paths(ws_entry_point, config::yawl_dir, RUNTIME_NAME "/_v2-entry-point");
+
+        if (!wineserver || !prefix) {
+            LOG_WARNING("Couldn't find the wineserver for %s, use 'wineserver=PATH' to set it.",
+                        opts.proton ? opts.proton : opts.exec_path);
+            return 1;
+        }
+        if (!is_exec_file(ws_entry_point)) {
+            LOG_ERROR("Runtime entry point not found: %s", ws_entry_point);
+            return 1;
+        }
+
+        char *lib_paths = build_library_paths(opts.exec_path);
+        if (lib_paths) {
+            setenv("LD_LIBRARY_PATH", lib_paths, 1);
+            free(lib_paths);
+        }
+        return FAILED(wineserver_kill(ws_entry_point, wineserver, prefix)) ? 1 : 0;
     }
 
-    result = setup_runtime(&opts);
+    /* The overlay only exists in a namespace of this launch, which everything started from here on inherits.
+     * The namespace has to be entered while we're still single-threaded, the mount waits for the runtime. */
+    if (overlay_mount) {
+        if (opts.daemon || opts.wineserver_persist) {
+            LOG_WARNING("Overlay prefixes are mounted per launch, ignoring 'daemon' and 'wineserver_persist'.");
+            opts.daemon = 0;
+            opts.wineserver_persist = 0;
+        }
+        if (FAILED(prefix_overlay_enter()))
+            return 1; /* already reported */
+    }
+    log_start_async();
+
+    /* The update check, runtime setup/verification and environment construction don't depend on each other,
+     * so run them side by side. A runtime failure cancels the rest (including any update download). */
+    /* With the update task, two tasks may start using curl at once, and curl_global_init() isn't thread-safe.
+     * Otherwise only a runtime download would need it, which leaves it to its first curl_easy_init(). */
+    if (defer_update)
+        curl_global_init(CURL_GLOBAL_DEFAULT);
+
+    char *entry_point = arena_path(&launch_paths, config::yawl_dir, RUNTIME_NAME "/_v2-entry-point");
+    struct startup_state state = {&opts, nullptr, nullptr, entry_point, nullptr, nullptr};
+    struct task_graph graph = {};
+    int update_idx = defer_update ? task_add(&graph, "handle_updates", update_task, &state, 0, 0) : -1;
+    int runtime_idx = task_add(&graph, "setup_runtime", runtime_task, &state, 0, TASK_FATAL);
+    int lib_paths_idx = task_add(&graph, "build_library_paths", lib_paths_task, &state, 0, 0);
+    task_add(&graph, "build_mesa_paths", mesa_paths_task, &state, 0, 0);
+
+    if (opts.wineserver_persist) {
+        state.wineserver = wineserver_find(opts.wineserver, opts.exec_path, opts.proton);
+        state.wineserver_prefix = wineserver_get_prefix(opts.proton);
+        if (!state.wineserver || !state.wineserver_prefix)
+            LOG_WARNING("Couldn't find the wineserver for %s, use 'wineserver=PATH' to set it.",
+                        opts.proton ? opts.proton : opts.exec_path);
+        else
+            task_add(&graph, "wineserver_prewarm", prewarm_task, &state,
+                     TASK_DEP(runtime_idx) | TASK_DEP(lib_paths_idx), 0);
+    }
+
+    result = task_graph_run(&graph);
     LOG_AND_RETURN_IF_FAILED(Level::Error, result, "Failed setting up the runtime");
 
+    if (update_idx >= 0)
+        finish_update(graph.tasks[update_idx].result, true, argv);
+
+    /* Set up library paths based on the executable path */
+    if (state.lib_paths) {
+        setenv("LD_LIBRARY_PATH", state.lib_paths, 1);
+        free(state.lib_paths);
+    }
+
+    if (state.mesa_paths) {
+        setenv("LIBGL_DRIVERS_PATH", state.mesa_paths, 1);
+        free(state.mesa_paths);
+    }
+
+    plan_add_dependency(opts.exec_path);
     if (!is_exec_file(opts.exec_path)) {
         LOG_ERROR("Executable not found or not executable: %s", opts.exec_path);
         return 1;
     }
 
-    char *entry_point = nullptr;
-    join_paths(entry_point, config::yawl_dir, RUNTIME_NAME "/_v2-entry-point");
+    plan_add_dependency(entry_point);
     if (!is_exec_file(entry_point)) {
         LOG_ERROR("Runtime entry point not found: %s", entry_point);
         return 1;
     }
 
+    if (overlay_mount) {
+        result = prefix_overlay_mount(active_prefix);
+        if (RESULT_CODE(result) == E_NOT_READY) {
+            LOG_ERROR("The overlay prefix %s is in use by another launch, use 'enter=prefix:%s' to run in it.",
+                      active_prefix, active_prefix);
+            return 1;
+        }
+        if (FAILED(result))
+            return 1; /* already reported */
+    }
+
     int extra_args = opts.proton ? 5 : 4;
     char **new_argv = (char **)calloc(argc + extra_args, sizeof(char *));
     new_argv[0] = entry_point;
@@ -797,12 +1248,6 @@ int main(int argc, char *argv[]) {
         new_argv[i + args_sum] = argv[i];
     }
 
-    char *mesa_paths = build_mesa_paths();
-    if (mesa_paths) {
-        setenv("LIBGL_DRIVERS_PATH", mesa_paths, 1);
-        free(mesa_paths);
-    }
-
     /* TODO: factor and allow setting paths from config */
     if (opts.exec_path && !STRING_EQUALS(opts.exec_path, DEFAULT_EXEC_PATH)) {
         char *exec_dir = strdup(opts.exec_path);
@@ -828,13 +1273,62 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    /* TODO: this doesn't do anything, because we execv immediately after
-     * need to implement "daemon mode" for this to be effective */
-    if (prctl(PR_SET_CHILD_SUBREAPER, 1UL) == -1)
-        LOG_WARNING("Failed to set child subreaper status: %s", strerror(errno));
+    /* Run through a daemon's container if one is serving this config/prefix (starting it first, if requested) */
+    autofree char *socket_path = overlay_mount ? nullptr : daemon_socket_path(plan_name_for(config_name));
+    if (socket_path) {
+        /* Starting or stopping a daemon changes this directory, which invalidates plans that bypass it */
+        plan_add_dependency(arena_path(&launch_paths, config::yawl_dir, DAEMON_RUN_DIR));
+
+        if (opts.daemon) {
+            result = daemon_start(socket_path, entry_point,
+                                  opts.daemon_idle ? opts.daemon_idle : DAEMON_DEFAULT_IDLE_TIMEOUT);
+            LOG_AND_RETURN_IF_FAILED(Level::Error, result, "Failed to start the daemon");
+            if (argc <= 1) {
+                LOG_INFO("Daemon running for %s.", plan_name_for(config_name));
+                return 0;
+            }
+        }
+
+        int exit_status = 1;
+        /* Skip the entry point arguments, the container is already running */
+        result = daemon_run(socket_path, new_argv + 3, &exit_status);
+        if (RESULT_CODE(result) != E_NOT_FOUND) {
+            if (FAILED(result))
+                LOG_RESULT(Level::Error, result, "Failed to run through the daemon");
+            log_cleanup();
+            return exit_status;
+        }
+    }
+
+    /* Record the container for enter=name:/prefix: (we are, or are about to become, its root process) */
+    result = registry_add(config::yawl_dir, plan_name_for(config_name));
+    if (FAILED(result))
+        LOG_DEBUG_RESULT(result, "Couldn't register the container");
+
+    /* Stay resident as the subreaper of the whole process tree instead of replacing ourselves */
+    if (opts.supervise) {
+        trace_end("main", main_start_ns);
+        int exit_status = supervise(new_argv, opts.supervise_grace, opts.capture_output ? &opts.capture : nullptr);
+        log_cleanup();
+        return exit_status;
+    }
+
+    if (plan_dir) {
+        /* Stamp the real binary, so that updates (or a different yawl) invalidate the plan */
+        autofree char *self_path = realpath("/proc/self/exe", nullptr);
+        plan_add_dependency(self_path);
+
+        result = plan_write(plan_dir, plan_name, new_argv, args_sum + 1);
+        if (FAILED(result))
+            LOG_DEBUG_RESULT(result, "Couldn't write the launch plan");
+    }
 
     log_cleanup();
 
+    trace_end("main", main_start_ns);
+    trace_instant("execv " RUNTIME_NAME "/_v2-entry-point");
+    trace_finish();
+
     execv(entry_point, new_argv);
     perror("Failed to execute runtime"); /* Shouldn't reach here. */
 
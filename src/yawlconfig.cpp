@@ -10,7 +10,16 @@
 #include "config.h"
 
 #include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
+#include "launchplan.hpp"
+#include "log.hpp"
+#include "macros.hpp"
+#include "trace.hpp"
 #include "yawlconfig.hpp"
 #include "util.hpp"
 
@@ -38,6 +47,7 @@ const char *yawl_dir = nullptr;
 const char *config_dir = nullptr;
 
 RESULT setup_prog_dir(void) {
+    TRACE_SCOPE("setup_prog_dir");
     struct passwd *pw;
     std::string result = {};
     const char *temp_path = getenv("YAWL_INSTALL_DIR");
@@ -67,6 +77,7 @@ RESULT setup_prog_dir(void) {
 }
 
 RESULT setup_config_dir(void) {
+    TRACE_SCOPE("setup_config_dir");
     assert(!!yawl_dir);
     std::string result = fmt::format("{}/{}", yawl_dir, CONFIG_DIR);
 
@@ -86,4 +97,347 @@ RESULT setup_config_dir(void) {
 
     return RESULT_OK;
 }
+
+/* Compiled config cache: a header, a stamp for every file of the include chain, then the entries.
+ * It's only ever read on the machine that wrote it, so everything is in native byte order. */
+#define CONFIG_CACHE_SUFFIX ".cache"
+#define CONFIG_CACHE_MAGIC "YAWLCF01"
+#define CONFIG_INCLUDE_DEPTH 8
+
+struct cache_header {
+    char magic[8];
+    uint32_t dep_count;
+    uint32_t entry_count;
+};
+
+struct cache_dep {
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t size;
+    uint64_t ino;
+    uint32_t path_len; /* followed by the path and a NUL */
+    uint32_t reserved;
+};
+
+struct cache_entry {
+    uint32_t kind;
+    uint32_t key_len;   /* followed by the key and a NUL */
+    uint32_t value_len; /* then the value and a NUL */
+};
+
+struct compiled_config {
+    std::string deps;
+    std::string entries;
+    uint32_t dep_count = 0;
+    uint32_t entry_count = 0;
+};
+
+static char *config_dir_file(const char *name) {
+    char *path = nullptr;
+    join_paths(path, config_dir, name);
+    if (!strstr(name, CONFIG_EXTENSION.data()))
+        append_sep(path, "", CONFIG_EXTENSION.data());
+    return path;
+}
+
+char *find_file(const char *name) {
+    /* First, try using the name directly as a path */
+    if (access(name, F_OK) == 0)
+        return strdup(name);
+
+    return config_dir_file(name);
+}
+
+/* Includes never depend on the working directory (which is the game's, and which the cache couldn't check):
+ * a plain name is a config in config_dir, a relative path is relative to the including file */
+static char *find_include(const char *name, const char *including_path) {
+    if (name[0] == '/')
+        return strdup(name);
+    if (!strchr(name, '/'))
+        return config_dir_file(name);
+
+    char *path = nullptr;
+    const char *slash = strrchr(including_path, '/');
+    if (!slash)
+        return strdup(name);
+
+    autofree char *dir = strndup(including_path, slash - including_path);
+    join_paths(path, dir[0] ? dir : "/", name);
+    return path;
+}
+
+static void add_dep(struct compiled_config *compiled, const char *path, const struct stat *st) {
+    struct cache_dep dep = {};
+    dep.mtime_sec = st->st_mtim.tv_sec;
+    dep.mtime_nsec = st->st_mtim.tv_nsec;
+    dep.size = st->st_size;
+    dep.ino = st->st_ino;
+    dep.path_len = (uint32_t)strlen(path);
+
+    compiled->deps.append((const char *)&dep, sizeof(dep));
+    compiled->deps.append(path, dep.path_len + 1);
+    compiled->dep_count++;
+}
+
+static void add_entry(struct compiled_config *compiled, entry_kind kind, const char *key, size_t key_len,
+                      const char *value) {
+    struct cache_entry entry = {(uint32_t)kind, (uint32_t)key_len, (uint32_t)strlen(value)};
+
+    compiled->entries.append((const char *)&entry, sizeof(entry));
+    compiled->entries.append(key, key_len);
+    compiled->entries.push_back('\0');
+    compiled->entries.append(value, entry.value_len + 1);
+    compiled->entry_count++;
+}
+
+/* The files that are being compiled right now, innermost first */
+struct include_chain {
+    dev_t dev;
+    ino_t ino;
+    const struct include_chain *parent;
+};
+
+/* Parse `path` and everything it includes into `compiled` */
+static RESULT compile_file(struct compiled_config *compiled, const char *path, const struct include_chain *chain,
+                           int depth) {
+    if (depth > CONFIG_INCLUDE_DEPTH) {
+        LOG_WARNING("Ignoring include of %s: includes are nested too deeply", path);
+        return RESULT_OK;
+    }
+
+    autoclose FILE *fp = fopen(path, "re");
+    if (!fp) {
+        RESULT result = result_from_errno();
+        LOG_RESULT(Level::Error, result, "Failed to open config file");
+        LOG_DEBUG("Config file: %s", path);
+        return result;
+    }
+
+    /* Stamp the file before reading it, so a change while we read invalidates the cache */
+    struct stat st;
+    struct include_chain self = {0, 0, chain};
+    if (fstat(fileno(fp), &st) == 0) {
+        /* Compare files rather than paths, "a.cfg" and "./a.cfg" are the same include */
+        for (const struct include_chain *link = chain; link; link = link->parent) {
+            if (link->dev == st.st_dev && link->ino == st.st_ino) {
+                LOG_ERROR("Include loop: %s includes itself (directly or through other includes)", path);
+                return MAKE_RESULT(SEV_ERROR, CAT_CONFIG, E_PARSE_ERROR);
+            }
+        }
+        add_dep(compiled, path, &st);
+        self.dev = st.st_dev;
+        self.ino = st.st_ino;
+    }
+
+    char line[BUFFER_SIZE];
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = '\0';
+
+        /* Skip empty lines and comments */
+        if (line[0] == '\0' || line[0] == '#')
+            continue;
+
+        if (LCSTRING_PREFIX(line, "include=")) {
+            autofree char *include_path = find_include(STRING_AFTER_PREFIX(line, "include="), path);
+            RETURN_IF_FAILED(compile_file(compiled, include_path, &self, depth + 1));
+        } else if (LCSTRING_PREFIX(line, "env.")) {
+            const char *key = STRING_AFTER_PREFIX(line, "env.");
+            const char *equals = strchr(key, '=');
+            if (!equals || equals == key) {
+                LOG_WARNING("Ignoring invalid environment entry in %s: %s", path, line);
+                continue;
+            }
+            add_entry(compiled, entry_kind::Env, key, equals - key, equals + 1);
+        } else if (LCSTRING_PREFIX(line, "path_prepend=")) {
+            add_entry(compiled, entry_kind::PathPrepend, "", 0, STRING_AFTER_PREFIX(line, "path_prepend="));
+        } else if (LCSTRING_PREFIX(line, "ld_prepend=")) {
+            add_entry(compiled, entry_kind::LdPrepend, "", 0, STRING_AFTER_PREFIX(line, "ld_prepend="));
+        } else {
+            add_entry(compiled, entry_kind::Option, "", 0, line);
+        }
+    }
+
+    return RESULT_OK;
+}
+
+/* Check that the blob is intact and that none of the files it was compiled from changed (registering
+ * them as launch plan dependencies along the way). Returns a pointer to the first entry, or nullptr */
+static const char *cache_entries(const char *blob, size_t size) {
+    const char *end = blob + size;
+    struct cache_header header;
+
+    if (size < sizeof(header))
+        return nullptr;
+    memcpy(&header, blob, sizeof(header));
+    if (memcmp(header.magic, CONFIG_CACHE_MAGIC, sizeof(header.magic)) != 0)
+        return nullptr;
+
+    const char *p = blob + sizeof(header);
+    for (uint32_t i = 0; i < header.dep_count; i++) {
+        struct cache_dep dep;
+        if ((size_t)(end - p) < sizeof(dep))
+            return nullptr;
+        memcpy(&dep, p, sizeof(dep));
+        p += sizeof(dep);
+
+        const char *path = p;
+        if ((size_t)(end - p) <= dep.path_len || path[dep.path_len] != '\0')
+            return nullptr;
+        p += dep.path_len + 1;
+
+        struct stat st;
+        plan_add_dependency(path);
+        if (stat(path, &st) != 0 || st.st_mtim.tv_sec != dep.mtime_sec || st.st_mtim.tv_nsec != dep.mtime_nsec ||
+            st.st_size != dep.size || st.st_ino != dep.ino)
+            return nullptr;
+    }
+
+    return p;
+}
+
+/* Pass the entries starting at `p` to `fn` */
+static RESULT apply_entries(const char *p, const char *end, entry_fn fn, void *data) {
+    while (p < end) {
+        struct cache_entry entry;
+        if ((size_t)(end - p) < sizeof(entry))
+            return MAKE_RESULT(SEV_ERROR, CAT_CONFIG, E_PARSE_ERROR);
+        memcpy(&entry, p, sizeof(entry));
+        p += sizeof(entry);
+
+        const char *key = p;
+        const char *value = key + entry.key_len + 1;
+        if ((size_t)(end - p) < (size_t)entry.key_len + entry.value_len + 2 || key[entry.key_len] != '\0' ||
+            value[entry.value_len] != '\0')
+            return MAKE_RESULT(SEV_ERROR, CAT_CONFIG, E_PARSE_ERROR);
+        p = value + entry.value_len + 1;
+
+        RETURN_IF_FAILED(fn((entry_kind)entry.kind, entry.key_len ? key : nullptr, value, data));
+    }
+
+    return RESULT_OK;
+}
+
+static void write_cache(const char *cache_path, const std::string &blob) {
+    autofree char *tmp_path = strdup(cache_path);
+    append_sep(tmp_path, "", ".tmp");
+
+    autoclosefd int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || write(fd, blob.data(), blob.size()) != (ssize_t)blob.size() || rename(tmp_path, cache_path) != 0) {
+        LOG_DEBUG("Couldn't write config cache %s: %s", cache_path, strerror(errno));
+        unlink(tmp_path);
+    }
+}
+
+RESULT load_file(const char *path, entry_fn fn, void *data) {
+    TRACE_SCOPE("config_load_file");
+    autofree char *cache_path = strdup(path);
+    append_sep(cache_path, "", CONFIG_CACHE_SUFFIX);
+
+    /* Fast path: one mmap'd blob, no parsing */
+    autoclosefd int fd = open(cache_path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            const char *blob = (const char *)map;
+            const char *entries = cache_entries(blob, st.st_size);
+            RESULT result = RESULT_OK;
+            if (entries)
+                result = apply_entries(entries, blob + st.st_size, fn, data);
+            munmap(map, st.st_size);
+
+            if (entries) {
+                LOG_DEBUG("Loaded compiled configuration from: %s", cache_path);
+                return result;
+            }
+        }
+    }
+
+    struct compiled_config compiled;
+    RETURN_IF_FAILED(compile_file(&compiled, path, nullptr, 0));
+
+    struct cache_header header = {};
+    memcpy(header.magic, CONFIG_CACHE_MAGIC, sizeof(header.magic));
+    header.dep_count = compiled.dep_count;
+    header.entry_count = compiled.entry_count;
+
+    std::string blob((const char *)&header, sizeof(header));
+    blob += compiled.deps;
+    blob += compiled.entries;
+    write_cache(cache_path, blob);
+
+    /* Registers the plan dependencies */
+    const char *entries = cache_entries(blob.data(), blob.size());
+    if (!entries)
+        entries = blob.data() + sizeof(header) + compiled.deps.size();
+
+    return apply_entries(entries, blob.data() + blob.size(), fn, data);
+}
+
+static void prepend_path_var(const char *var, const char *dir) {
+    autofree char *expanded = expand_path(dir);
+    if (!expanded || !expanded[0])
+        return;
+
+    const char *orig = getenv(var);
+    if (!orig || !orig[0]) {
+        setenv(var, expanded, 1);
+        return;
+    }
+
+    autofree char *new_value = strdup(expanded);
+    append_sep(new_value, ":", orig);
+    setenv(var, new_value, 1);
+}
+
+/* Names of the variables that were set before the entries started being applied, sorted */
+static char **protected_vars = nullptr;
+static size_t protected_count = 0;
+
+static int compare_var_names(const void *a, const void *b) { return strcmp(*(char *const *)a, *(char *const *)b); }
+
+void protect_env(void) {
+    for (size_t i = 0; i < protected_count; i++)
+        free(protected_vars[i]);
+    free(protected_vars);
+    protected_vars = nullptr;
+    protected_count = 0;
+
+    size_t count = 0;
+    while (environ[count])
+        count++;
+    if (!count || !(protected_vars = (char **)malloc(count * sizeof(*protected_vars))))
+        return;
+
+    for (size_t i = 0; i < count; i++) {
+        char *name = strndup(environ[i], strcspn(environ[i], "="));
+        if (name)
+            protected_vars[protected_count++] = name;
+    }
+    qsort(protected_vars, protected_count, sizeof(*protected_vars), compare_var_names);
+}
+
+static bool env_protected(const char *key) {
+    return protected_count &&
+           bsearch(&key, protected_vars, protected_count, sizeof(*protected_vars), compare_var_names);
+}
+
+void apply_env_entry(entry_kind kind, const char *key, const char *value) {
+    switch (kind) {
+    case entry_kind::Env:
+        /* Like the Steam compatibility variables, what the user set wins; among entries, the last one does */
+        if (key && !env_protected(key))
+            setenv(key, value, 1);
+        break;
+    case entry_kind::PathPrepend:
+        prepend_path_var("PATH", value);
+        break;
+    case entry_kind::LdPrepend:
+        prepend_path_var("LD_LIBRARY_PATH", value);
+        break;
+    case entry_kind::Option:
+        break;
+    }
+}
+
 }; // namespace config
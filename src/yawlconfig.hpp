@@ -9,6 +9,8 @@
 
 #pragma once
 
+#include <cstdint>
+
 #include "config.h"
 #include "result.hpp"
 
@@ -20,4 +22,31 @@ namespace config {
     extern const char *yawl_dir;
     /* The global configuration path, set at startup in main() */
     extern const char *config_dir;
+
+    /* Wrapper config files hold one YAWL_VERBS option per line ('#' starts a comment), and also:
+     *   env.KEY=VALUE     set KEY, unless the user already set it (see protect_env()); the last one wins
+     *   path_prepend=DIR  put DIR in front of PATH
+     *   ld_prepend=DIR    put DIR in front of LD_LIBRARY_PATH
+     *   include=NAME      read the NAME config at this point: NAME.cfg in config_dir, or a path (relative
+     *                     ones are relative to the including file)
+     * The resolved file chain is compiled into a binary PATH.cache next to the config, which is used
+     * as long as none of the files it was built from changed. */
+    enum class entry_kind : uint8_t { Option = 0, Env = 1, PathPrepend = 2, LdPrepend = 3 };
+
+    /* Called for every entry in file order; `key` is only set for entry_kind::Env */
+    typedef RESULT (*entry_fn)(entry_kind kind, const char *key, const char *value, void *data);
+
+    /* Path for a config name: the name itself if it's an existing file, otherwise NAME.cfg in config_dir
+     * (which may not exist). Returns a malloc'd string */
+    char *find_file(const char *name);
+
+    /* Load the config at `path` (from its cache, when current) and pass each entry to `fn`.
+     * Returns RESULT_OK, the first failed RESULT from `fn`, or error RESULT if the files couldn't be read */
+    RESULT load_file(const char *path, entry_fn fn, void *data);
+
+    /* Remember the variables that are set right now, so that Env entries applied afterwards leave them alone */
+    void protect_env(void);
+
+    /* Apply an Env, PathPrepend or LdPrepend entry to the environment */
+    void apply_env_entry(entry_kind kind, const char *key, const char *value);
 };